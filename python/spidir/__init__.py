@@ -35,7 +35,8 @@ except ImportError:
 ex = Exporter(globals())
 export = ex.export
 
-# typedefs
+# typedefs (must match floatlk in src/lk_kernels.h; use c_float if the
+# library is built with SINGLE_LK=1)
 c_floatlk = c_double
 c_floatlk_p = c_double_p
 
@@ -67,6 +68,8 @@ if spidir:
            [c_double, "y", c_int, "n", c_float_list, "alpha",
             c_float_list, "beta", 
             c_float, "tol"])
+    export(spidir, "discreteGammaRates", c_void_p,
+           [c_float, "alpha", c_int, "ncats", c_float_p, "rates"])
     
     #export(spidir, "negbinomPdf", c_double,
     #       [c_int, "k", c_double, "r", c_double, "p"])
@@ -86,6 +89,8 @@ if spidir:
            newname="ctree2ptree")
     export(spidir, "setTreeDists", c_void_p, [c_void_p, "tree",
                                               c_float_p, "dists"])
+    export(spidir, "getTreeDists", c_void_p, [c_void_p, "tree",
+                                              c_float_p, "dists"])
 
 
     # search
@@ -192,18 +197,21 @@ if spidir:
     export(spidir, "makeHkyDerivMatrix", c_void_p,
            [c_float_p, "bgfreq", c_float, "kappa", c_float, "time",
             c_float_p, "matrix"])
+    export(spidir, "makeGtrMatrix", c_void_p,
+           [c_float_p, "bgfreq", c_float_p, "rates", c_float, "time",
+            c_float_p, "matrix"])
     export(spidir, "makeHkyDeriv2Matrix", c_void_p,
            [c_float_p, "bgfreq", c_float, "kappa", c_float, "time",
             c_float_p, "matrix"])
-    export(spidir, "branchLikelihoodHky", c_floatlk,
+    export(spidir, "branchLikelihoodHky", c_double,
            [c_floatlk_p, "probs1", c_floatlk_p, "probs2",
             c_int, "seqlen", c_float_p, "bgfreq", c_float, "kappa",
             c_float, "time"])
-    export(spidir, "branchLikelihoodHkyDeriv", c_floatlk,
+    export(spidir, "branchLikelihoodHkyDeriv", c_double,
            [c_floatlk_p, "probs1", c_floatlk_p, "probs2",
             c_int, "seqlen", c_float_p, "bgfreq",
             c_float, "kappa", c_float, "time"])       
-    export(spidir, "branchLikelihoodHkyDeriv2", c_floatlk,
+    export(spidir, "branchLikelihoodHkyDeriv2", c_double,
            [c_floatlk_p, "probs1", c_floatlk_p, "probs2",
             c_int, "seqlen", c_float_p, "bgfreq",
             c_float, "kappa", c_float, "time"])
@@ -211,14 +219,77 @@ if spidir:
            [c_floatlk_p, "probs1", c_floatlk_p, "probs2",
             c_int, "seqlen", c_float_p, "bgfreq",
             c_float, "kappa", c_float, "t0", c_float, "t1"])
-    export(spidir, "calcSeqProbHky", c_floatlk,
+    export(spidir, "calcSeqProbHky", c_double,
            [c_void_p, "tree", c_int, "nseqs", c_char_p_p, "seqs",
             c_float_p, "bgfreq", c_float, "kappa"])
-    export(spidir, "findMLBranchLengthsHky", c_floatlk,
+    export(spidir, "calcSeqProbGtr", c_double,
+           [c_void_p, "tree", c_int, "nseqs", c_char_p_p, "seqs",
+            c_float_p, "bgfreq", c_float_p, "rates"])
+    export(spidir, "findMLBranchLengthsGtr", c_double,
+           [c_void_p, "tree", c_int, "nseqs", c_char_p_p, "seqs",
+            c_float_p, "bgfreq", c_float_p, "rates", c_int, "maxiter"])
+    export(spidir, "calcSeqProbHkyTrees", c_void_p,
+           [c_void_p, "trees", c_int, "ntrees", c_int, "nseqs",
+            c_char_p_p, "seqs", c_float_p, "bgfreq", c_float, "kappa",
+            c_double_p, "logls"])
+    export(spidir, "allocSubtreeRowCache", c_void_p,
+           [c_int, "nseqs", c_char_p_p, "seqs", c_int, "maxrows"])
+    export(spidir, "freeSubtreeRowCache", c_void_p, [c_void_p, "cache"])
+    export(spidir, "calcSeqProbHkyCached", c_double,
+           [c_void_p, "tree", c_int, "nseqs", c_char_p_p, "seqs",
+            c_float_p, "bgfreq", c_float, "kappa", c_void_p, "cache"])
+    export(spidir, "SubtreeRowCache_getLookups", c_longlong, 
+           [c_void_p, "cache"])
+    export(spidir, "SubtreeRowCache_getHits", c_longlong, [c_void_p, "cache"])
+    export(spidir, "SubtreeRowCache_getInserts", c_longlong, 
+           [c_void_p, "cache"])
+    export(spidir, "SubtreeRowCache_getEvictions", c_longlong, 
+           [c_void_p, "cache"])
+    export(spidir, "SubtreeRowCache_getHitRate", c_double, 
+           [c_void_p, "cache"])
+    export(spidir, "allocLikelihoodEngine", c_void_p,
+           [c_int, "nseqs", c_int, "seqlen", c_char_p_p, "seqs",
+            c_float_p, "bgfreq", c_float, "kappa"])
+    export(spidir, "freeLikelihoodEngine", c_void_p, [c_void_p, "engine"])
+    export(spidir, "LikelihoodEngine_calcSeqProb", c_double,
+           [c_void_p, "engine", c_void_p, "tree"])
+    export(spidir, "LikelihoodEngine_accept", c_void_p, [c_void_p, "engine"])
+    export(spidir, "LikelihoodEngine_reject", c_void_p, [c_void_p, "engine"])
+    export(spidir, "LikelihoodEngine_getRowsComputed", c_int,
+           [c_void_p, "engine"])
+    export(spidir, "LikelihoodEngine_setMemoryLimit", c_void_p,
+           [c_void_p, "engine", c_size_t, "bytes"])
+    export(spidir, "LikelihoodEngine_getCheckpoints", c_int,
+           [c_void_p, "engine"])
+    export(spidir, "LikelihoodEngine_setRowCache", c_void_p,
+           [c_void_p, "engine", c_int, "maxrows"])
+    export(spidir, "LikelihoodEngine_getRowCache", c_void_p,
+           [c_void_p, "engine"])
+    export(spidir, "LikelihoodEngine_setGammaRates", c_void_p,
+           [c_void_p, "engine", c_float, "alpha", c_int, "ncats"])
+    export(spidir, "setLkKernel", c_bool, [c_int, "kernel"])
+    export(spidir, "getLkKernelName", c_char_p, [])
+    export(spidir, "setLkThreads", c_void_p, [c_int, "nthreads"])
+    export(spidir, "setLkSplit", c_void_p, [c_int, "split"])
+    export(spidir, "findMLBranchLengthsHky", c_double,
            [c_int, "nnodes", c_int_p, "ptree", c_int, "nseqs",
             c_char_p_p, "seqs", c_float_p, "dists",
             c_float_p, "bgfreq", c_float, "kappa",
             c_int, "maxiter", c_int, "parsinit"])
+    export(spidir, "findMLKappaHky", c_double,
+           [c_void_p, "tree", c_int, "nseqs", c_char_p_p, "seqs",
+            c_float_p, "bgfreq", c_float, "minkappa", c_float, "maxkappa",
+            c_float, "kappastep"])
+    export(spidir, "writeColumnAlignSeqs", c_int,
+           [c_char_p, "filename", c_int, "nseqs", c_int, "seqlen",
+            c_char_p_p, "names", c_char_p_p, "seqs"])
+    export(spidir, "calcSeqProbHkyFile", c_double,
+           [c_void_p, "tree", c_char_p, "filename",
+            c_float_p, "bgfreq", c_float, "kappa", c_int, "chunksize"])
+    export(spidir, "findMLBranchLengthsHkyFile", c_double,
+           [c_void_p, "tree", c_char_p, "filename",
+            c_float_p, "bgfreq", c_float, "kappa", c_int, "maxiter",
+            c_int, "chunksize"])
 
 
     # training functions
@@ -626,6 +697,32 @@ def make_hky_matrix(bgfreq, kappa, t):
             matrix[8:12],
             matrix[12:16]]
 
+def make_gtr_matrix(bgfreq, rates, t):
+    """
+    Returns a GTR matrix
+
+    bgfreq -- the background frequency A,C,G,T
+    rates  -- exchangeabilities AC, AG, AT, CG, CT, GT
+    """
+    
+    matrix = [0.0] * 16
+    matrix = c_list(c_float, matrix)
+    makeGtrMatrix(c_list(c_float, bgfreq), c_list(c_float, rates), t, matrix)
+    return [matrix[0:4],
+            matrix[4:8],
+            matrix[8:12],
+            matrix[12:16]]
+
+def discrete_gamma_rates(alpha, ncats):
+    """
+    Returns the rates of ncats equally likely categories of a gamma
+    distribution with shape alpha and mean 1
+    """
+
+    rates = c_list(c_float, [0.0] * ncats)
+    discreteGammaRates(alpha, ncats, rates)
+    return rates[0:ncats]
+
 def make_hky_deriv_matrix(bgfreq, kappa, t):
     """
     Returns a HKY Derivative matrix
@@ -695,6 +792,225 @@ def calc_seq_likelihood_hky(tree, align, bgfreq, kappa):
     return l
 
 
+def make_ptree_leaves(tree, names):
+    """
+    Make parent tree array from tree, where leaf i is the leaf named 
+    names[i].  Returns the array and the node of each index.
+    """
+    ptree, nodes, nodelookup = make_ptree(tree)
+    order = dict((name, i) for i, name in enumerate(names))
+    perm = [order[node.name] if node.is_leaf() else i
+            for i, node in enumerate(nodes)]
+
+    ptree2 = [-1] * len(ptree)
+    nodes2 = [None] * len(ptree)
+    for i, parent in enumerate(ptree):
+        if parent != -1:
+            ptree2[perm[i]] = perm[parent]
+        nodes2[perm[i]] = nodes[i]
+    return ptree2, nodes2
+
+
+def calc_seq_likelihood_gtr(tree, align, bgfreq, rates):
+    """
+    Returns the log likelihood of tree with a nucleotide GTR model
+
+    rates -- exchangeabilities AC, AG, AT, CG, CT, GT
+    """
+    names = sorted(align.keys())
+    calign = (c_char_p * len(names))(* [align[x] for x in names])
+    ctree = tree2ctree_leaves(tree, names)
+    l = calcSeqProbGtr(ctree, len(names), calign, c_list(c_float, bgfreq),
+                       c_list(c_float, rates))
+    deleteTree(ctree)
+    return l
+
+
+def find_ml_branch_lengths_gtr(tree, align, bgfreq, rates, maxiter=20):
+    """
+    Sets the branch lengths of tree to their ML estimate with a nucleotide
+    GTR model.  Returns the log likelihood.
+    """
+    names = sorted(align.keys())
+    calign = (c_char_p * len(names))(* [align[x] for x in names])
+    ptree, nodes = make_ptree_leaves(tree, names)
+    ctree = ptree2ctree(ptree)
+    setTreeDists(ctree, c_list(c_float, [x.dist for x in nodes]))
+
+    l = findMLBranchLengthsGtr(ctree, len(names), calign, 
+                               c_list(c_float, bgfreq), 
+                               c_list(c_float, rates), maxiter)
+    dists = c_list(c_float, [0.0] * len(nodes))
+    getTreeDists(ctree, dists)
+    deleteTree(ctree)
+
+    for i, node in enumerate(nodes):
+        node.dist = dists[i]
+    return l
+
+
+def tree2ctree_leaves(tree, names):
+    """Make a c++ Tree whose leaf i is the leaf named names[i]"""
+    ptree, nodes = make_ptree_leaves(tree, names)
+    ctree = ptree2ctree(ptree)
+    setTreeDists(ctree, c_list(c_float, [x.dist for x in nodes]))
+    return ctree
+
+
+def calc_seq_likelihood_hky_trees(trees, align, bgfreq, kappa):
+    """
+    Returns the log likelihood of each tree of trees (with the same
+    leaves), computing subtrees shared by several trees once
+    """
+
+    names = align.keys()
+    calign = (c_char_p * len(names))(* [align[x] for x in names])
+    ctrees = [tree2ctree_leaves(tree, names) for tree in trees]
+    logls = c_list(c_double, [0.0] * len(trees))
+
+    calcSeqProbHkyTrees((c_void_p * len(ctrees))(* ctrees), len(ctrees),
+                        len(names), calign, c_list(c_float, bgfreq), kappa,
+                        logls)
+
+    for ctree in ctrees:
+        deleteTree(ctree)
+
+    return list(logls)
+
+
+def alloc_subtree_row_cache(align, maxrows=1000):
+    """
+    Returns a cache of the rows of up to maxrows subtrees, for the 
+    likelihoods of trees for align
+    """
+    names = sorted(align.keys())
+    calign = (c_char_p * len(names))(* [align[x] for x in names])
+    return allocSubtreeRowCache(len(names), calign, maxrows)
+
+
+def free_subtree_row_cache(cache):
+    freeSubtreeRowCache(cache)
+
+
+def calc_seq_likelihood_hky_cached(tree, align, bgfreq, kappa, cache):
+    """
+    Returns the log likelihood of tree, taking the rows of subtrees seen
+    in earlier calls from cache
+    """
+    names = sorted(align.keys())
+    calign = (c_char_p * len(names))(* [align[x] for x in names])
+    ctree = tree2ctree_leaves(tree, names)
+    l = calcSeqProbHkyCached(ctree, len(names), calign, 
+                             c_list(c_float, bgfreq), kappa, cache)
+    deleteTree(ctree)
+    return l
+
+
+def subtree_row_cache_stats(cache):
+    """
+    Returns the statistics of cache: the number of lookups, hits, 
+    inserts and evictions and the hit rate
+    """
+    return {"lookups": SubtreeRowCache_getLookups(cache),
+            "hits": SubtreeRowCache_getHits(cache),
+            "inserts": SubtreeRowCache_getInserts(cache),
+            "evictions": SubtreeRowCache_getEvictions(cache),
+            "hit_rate": SubtreeRowCache_getHitRate(cache)}
+
+
+def alloc_likelihood_engine(align, bgfreq, kappa):
+    """
+    Returns a persistent likelihood engine for the sequences of align,
+    which only recomputes the rows that change between trees
+    """
+
+    names = sorted(align.keys())
+    calign = (c_char_p * len(names))(* [align[x] for x in names])
+    return allocLikelihoodEngine(len(names), len(align[names[0]]), calign,
+                                 c_list(c_float, bgfreq), kappa)
+
+
+def free_likelihood_engine(engine):
+    freeLikelihoodEngine(engine)
+
+
+def likelihood_engine_calc_seq_likelihood(engine, tree):
+    """Returns the log likelihood of tree (with the leaves of the alignment)"""
+
+    ctree = tree2ctree_leaves(tree, sorted(tree.leaf_names()))
+    l = LikelihoodEngine_calcSeqProb(engine, ctree)
+    deleteTree(ctree)
+    return l
+
+
+def likelihood_engine_accept(engine):
+    LikelihoodEngine_accept(engine)
+
+
+def likelihood_engine_reject(engine):
+    LikelihoodEngine_reject(engine)
+
+
+def likelihood_engine_rows_computed(engine):
+    """Returns the number of rows the engine has computed"""
+    return LikelihoodEngine_getRowsComputed(engine)
+
+
+def likelihood_engine_set_memory_limit(engine, nbytes):
+    """Keeps at most about nbytes of rows (0: no limit)"""
+    LikelihoodEngine_setMemoryLimit(engine, nbytes)
+
+
+def likelihood_engine_checkpoints(engine):
+    """Returns the number of internal nodes whose rows are kept"""
+    return LikelihoodEngine_getCheckpoints(engine)
+
+
+def likelihood_engine_set_row_cache(engine, maxrows):
+    """Caches the rows of up to maxrows subtrees (0: no cache)"""
+    LikelihoodEngine_setRowCache(engine, maxrows)
+
+
+def likelihood_engine_row_cache(engine):
+    """Returns the row cache of the engine (None without a cache)"""
+    return LikelihoodEngine_getRowCache(engine)
+
+
+def likelihood_engine_set_gamma_rates(engine, alpha, ncats):
+    """Uses ncats discrete gamma rate categories of shape alpha"""
+    LikelihoodEngine_setGammaRates(engine, alpha, ncats)
+
+
+LK_KERNELS = {"auto": -1, "scalar": 0, "avx2": 1, "avx512": 2}
+
+def set_lk_kernel(name="auto"):
+    """
+    Chooses the likelihood kernel (auto, scalar, avx2 or avx512).
+    Returns False if the CPU does not support it.
+    """
+    return setLkKernel(LK_KERNELS[name])
+
+
+def get_lk_kernel_name():
+    """Returns the name of the likelihood kernel in use"""
+    return getLkKernelName()
+
+
+def set_lk_threads(nthreads):
+    """Sets the number of threads that compute likelihoods"""
+    setLkThreads(nthreads)
+
+
+LK_SPLITS = {"auto": 0, "sites": 1, "subtrees": 2}
+
+def set_lk_split(name="auto"):
+    """
+    Divides the rows of likelihood traversals among threads by sites or
+    by subtrees (or automatically)
+    """
+    setLkSplit(LK_SPLITS[name])
+
+
 def find_ml_branch_lengths_hky(tree, align, bgfreq, kappa, maxiter=20,
                                parsinit=True):
 
@@ -714,6 +1030,82 @@ def find_ml_branch_lengths_hky(tree, align, bgfreq, kappa, maxiter=20,
     return l
 
 
+def find_ml_kappa_hky(tree, align, bgfreq, minkappa=.4, maxkappa=5.0,
+                      kappastep=.1):
+    """
+    Returns the ML estimate of kappa for tree within [minkappa, maxkappa]
+    to about kappastep.  The branch lengths of tree are the starting
+    point of the fit.
+    """
+
+    names = sorted(align.keys())
+    calign = (c_char_p * len(names))(* [align[x] for x in names])
+    ctree = tree2ctree_leaves(tree, names)
+    kappa = findMLKappaHky(ctree, len(names), calign,
+                           c_list(c_float, bgfreq), minkappa, maxkappa,
+                           kappastep)
+    deleteTree(ctree)
+    return kappa
+
+
+def write_column_align(filename, align, names=None):
+    """
+    Writes align as a column file (sequences in the order of names, 
+    default: sorted names) for the streaming likelihood functions
+    """
+    if names is None:
+        names = sorted(align.keys())
+    seqlen = len(align[names[0]])
+    cnames = (c_char_p * len(names))(* names)
+    calign = (c_char_p * len(names))(* [align[x] for x in names])
+    return bool(writeColumnAlignSeqs(filename, len(names), seqlen, 
+                                     cnames, calign))
+
+
+def read_column_align_names(filename):
+    """Returns the sequence names of a column file"""
+    infile = open(filename)
+    nseqs = int(infile.readline().split()[1])
+    names = [infile.readline().rstrip("\n") for i in xrange(nseqs)]
+    infile.close()
+    return names
+
+
+def calc_seq_likelihood_hky_file(tree, filename, bgfreq, kappa,
+                                 chunksize=8192):
+    """
+    Returns the log likelihood of tree for the alignment in a column file,
+    read chunksize columns at a time
+    """
+    ctree = tree2ctree_leaves(tree, read_column_align_names(filename))
+    l = calcSeqProbHkyFile(ctree, filename, c_list(c_float, bgfreq), kappa,
+                           chunksize)
+    deleteTree(ctree)
+    return l
+
+
+def find_ml_branch_lengths_hky_file(tree, filename, bgfreq, kappa, 
+                                    maxiter=10, chunksize=8192):
+    """
+    Sets the branch lengths of tree to their ML estimate for the alignment 
+    in a column file, read chunksize columns at a time.  Returns the log 
+    likelihood.
+    """
+    ptree, nodes = make_ptree_leaves(tree, read_column_align_names(filename))
+    ctree = ptree2ctree(ptree)
+    setTreeDists(ctree, c_list(c_float, [x.dist for x in nodes]))
+
+    l = findMLBranchLengthsHkyFile(ctree, filename, c_list(c_float, bgfreq),
+                                   kappa, maxiter, chunksize)
+    dists = c_list(c_float, [0.0] * len(nodes))
+    getTreeDists(ctree, dists)
+    deleteTree(ctree)
+
+    for i, node in enumerate(nodes):
+        node.dist = dists[i]
+    return l
+
+
 #=============================================================================
 # training
 
@@ -170,7 +170,8 @@ public:
         if (needed <= capacity)
             return true;
         
-        int newsize = needed;
+        // grow geometrically, so that appending is amortized O(1)
+        int newsize = capacity;
         if (newsize < minsize)
             newsize = minsize;
         while (newsize < needed)
@@ -7,6 +7,11 @@
 
 =============================================================================*/
 
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
 // spidir headers
 #include "seq.h"
 #include "Sequences.h"
@@ -70,6 +75,22 @@ Sequences *readAlignFasta(const char *filename)
 }
 
 
+// read a whole column file (see writeColumnAlign) into memory
+Sequences *readColumnAlign(const char *filename)
+{
+    MappedAlignment columns;
+    if (!columns.open(filename))
+        return NULL;
+
+    Sequences *aln = new Sequences();
+    aln->alloc(columns.nseqs, columns.seqlen);
+    for (int i=0; i<columns.nseqs; i++)
+        aln->names[i] = columns.names[i];
+    columns.getColumns(0, columns.seqlen, aln->seqs);
+    return aln;
+}
+
+
 bool writeFasta(const char *filename, Sequences *seqs)
 {
     FILE *stream = NULL;
@@ -94,22 +115,167 @@ void writeFasta(FILE *stream, Sequences *seqs)
 }
 
 
+//=============================================================================
+// column files
+
+
+bool writeColumnAlign(const char *filename, Sequences *aln)
+{
+    ExtendArray<const char*> names(aln->nseqs);
+    for (int i=0; i<aln->nseqs; i++)
+        names[i] = aln->names[i].c_str();
+    return writeColumnAlignSeqs(filename, aln->nseqs, aln->seqlen, 
+                                names, aln->seqs);
+}
+
+
+extern "C" {
+
+bool writeColumnAlignSeqs(const char *filename, int nseqs, int seqlen,
+                          const char **names, char **seqs)
+{
+    FILE *stream = NULL;
+    
+    if ((stream = fopen(filename, "w")) == NULL) {
+        fprintf(stderr, "cannot open '%s'\n", filename);
+        return false;
+    }
+
+    fprintf(stream, "#columns %d %d\n", nseqs, seqlen);
+    for (int i=0; i<nseqs; i++)
+        fprintf(stream, "%s\n", names[i]);
+
+    // transpose blocks of columns
+    const int blocksize = 4096;
+    ExtendArray<char> block(blocksize * nseqs);
+    for (int start=0; start<seqlen; start+=blocksize) {
+        const int end = min(start + blocksize, seqlen);
+        for (int i=0; i<nseqs; i++) {
+            const char *seq = seqs[i];
+            for (int j=start; j<end; j++)
+                block[(j - start) * nseqs + i] = seq[j];
+        }
+        fwrite(block, 1, (end - start) * nseqs, stream);
+    }
+
+    fclose(stream);
+    return true;
+}
+
+} // extern "C"
+
+
+MappedAlignment::MappedAlignment() :
+    nseqs(0),
+    seqlen(0),
+    map(NULL),
+    mapsize(0),
+    datastart(0),
+    released(0)
+{}
+
+
+MappedAlignment::~MappedAlignment()
+{
+    close();
+}
+
+
+bool MappedAlignment::open(const char *filename)
+{
+    close();
+
+    int fd = ::open(filename, O_RDONLY);
+    if (fd < 0) {
+        fprintf(stderr, "cannot read file '%s'\n", filename);
+        return false;
+    }
+    struct stat info;
+    if (fstat(fd, &info) == 0 && info.st_size > 0) {
+        mapsize = info.st_size;
+        map = (char*) mmap(NULL, mapsize, PROT_READ, MAP_PRIVATE, fd, 0);
+        if (map == MAP_FAILED)
+            map = NULL;
+    }
+    ::close(fd);
+    if (!map) {
+        fprintf(stderr, "cannot map file '%s'\n", filename);
+        return false;
+    }
+    madvise(map, mapsize, MADV_SEQUENTIAL);
+
+    // header and names
+    const char *end = (const char*) memchr(map, '\n', mapsize);
+    if (!end || sscanf(map, "#columns %d %d", &nseqs, &seqlen) != 2 ||
+        nseqs <= 0 || seqlen <= 0) 
+    {
+        fprintf(stderr, "'%s' is not a column file\n", filename);
+        close();
+        return false;
+    }
+    for (int i=0; i<nseqs && end; i++) {
+        const char *start = end + 1;
+        end = (const char*) memchr(start, '\n', map + mapsize - start);
+        if (end)
+            names.append(string(start, end - start));
+    }
+    if (!end || (size_t) (end + 1 - map) + 
+        (size_t) nseqs * seqlen > mapsize) 
+    {
+        fprintf(stderr, "column file '%s' is truncated\n", filename);
+        close();
+        return false;
+    }
+    datastart = end + 1 - map;
+    released = 0;
+
+    return true;
+}
+
+
+void MappedAlignment::close()
+{
+    if (map)
+        munmap(map, mapsize);
+    map = NULL;
+    mapsize = 0;
+    nseqs = 0;
+    seqlen = 0;
+    names.clear();
+}
+
+
+void MappedAlignment::getColumns(int start, int end, char **seqs)
+{
+    const char *col = map + datastart + (size_t) start * nseqs;
+    for (int j=start; j<end; j++) {
+        for (int i=0; i<nseqs; i++)
+            seqs[i][j - start] = col[i];
+        col += nseqs;
+    }
+    for (int i=0; i<nseqs; i++)
+        seqs[i][end - start] = '\0';
+
+    // pages of earlier columns are not needed again
+    const size_t pagesize = sysconf(_SC_PAGESIZE);
+    const size_t done = (datastart + (size_t) start * nseqs) / 
+        pagesize * pagesize;
+    if (done < released)
+        released = 0;   // a new pass over the columns
+    if (done > released) {
+        madvise(map + released, done - released, MADV_DONTNEED);
+        released = done;
+    }
+}
+
 
 // ensures that all characters in the alignment are sensible
-// TODO: do not change alignment (keep Ns)
+// (bases, IUPAC ambiguity codes and gaps)
 bool checkSequences(int nseqs, int seqlen, char **seqs)
 {
-    // check seqs
-    // CHANGE N's to gaps
     for (int i=0; i<nseqs; i++) {
         for (int j=0; j<seqlen; j++) {
-            char x = seqs[i][j];
-            if (strchr("NnRrYyWwSsKkMmBbDdHhVv", x))
-                // treat Ns as gaps
-                x = '-';
-            if (x != '-' &&
-                dna2int[(int) (unsigned char) x] == -1)
-            {
+            if (dna2mask[(int) (unsigned char) seqs[i][j]] == 0) {
                 // an unknown character is in the alignment
                 return false;
             }
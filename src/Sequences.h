@@ -74,13 +74,61 @@ public:
 };
 
 
+// Alignment read from a column file that is mapped into memory
+//
+// A column file has a line "#columns <nseqs> <seqlen>", one line with the
+// name of each sequence, and then the characters of column 0 of all 
+// sequences, column 1, and so on.  Since columns are contiguous, a range 
+// of sites can be read without reading (or holding) the rest of the 
+// alignment.
+class MappedAlignment
+{
+public:
+    MappedAlignment();
+    ~MappedAlignment();
+
+    bool open(const char *filename);
+    void close();
+
+    // Copy columns [start, end) to seqs (nseqs buffers of at least 
+    // end - start + 1 chars, NUL terminated).  Columns before start are 
+    // dropped from memory, so columns should be read in order.
+    void getColumns(int start, int end, char **seqs);
+
+    int nseqs;
+    int seqlen;
+    ExtendArray<string> names;
+
+protected:
+    char *map;
+    size_t mapsize;
+    size_t datastart;   // offset of column 0
+    size_t released;    // bytes before this offset have been dropped
+
+private:
+    // not copyable
+    MappedAlignment(const MappedAlignment &other);
+    MappedAlignment &operator=(const MappedAlignment &other);
+};
+
+
 Sequences *readFasta(const char *filename);
 Sequences *readAlignFasta(const char *filename);
+Sequences *readColumnAlign(const char *filename);
 void writeFasta(FILE *stream, Sequences *seqs);
+bool writeColumnAlign(const char *filename, Sequences *aln);
 bool writeFasta(const char *filename, Sequences *seqs);
 bool checkSequences(int nseqs, int seqlen, char **seqs);
 void resampleAlign(Sequences *aln, Sequences *aln2);
 
+extern "C" {
+
+// write a column file of nseqs sequences of length seqlen
+bool writeColumnAlignSeqs(const char *filename, int nseqs, int seqlen,
+                          const char **names, char **seqs);
+
+}
+
 } // namespace spidir
 
 #endif
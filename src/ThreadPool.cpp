@@ -0,0 +1,303 @@
+/*=============================================================================
+
+  SPIMAP
+  Copyright 2007-2013
+
+  Persistent pool of worker threads
+
+=============================================================================*/
+
+
+#include <stdlib.h>
+
+#include "ThreadPool.h"
+
+
+namespace spidir {
+
+
+// a worker thread and its index
+struct WorkerArgs
+{
+    ThreadPool *pool;
+    int thread;
+};
+
+
+ThreadPool::ThreadPool(int _nthreads) :
+    nthreads(_nthreads < 1 ? 1 : _nthreads),
+    threads(NULL),
+    func(NULL),
+    arg(NULL),
+    generation(0),
+    pending(0),
+    quit(false)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&start_cond, NULL);
+    pthread_cond_init(&done_cond, NULL);
+
+    // thread 0 is the caller of run()
+    if (nthreads > 1) {
+        threads = new pthread_t [nthreads - 1];
+        for (int i=1; i<nthreads; i++) {
+            WorkerArgs *args = new WorkerArgs;
+            args->pool = this;
+            args->thread = i;
+            pthread_create(&threads[i-1], NULL, workerMain, args);
+        }
+    }
+}
+
+
+ThreadPool::~ThreadPool()
+{
+    pthread_mutex_lock(&lock);
+    quit = true;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&lock);
+
+    for (int i=1; i<nthreads; i++)
+        pthread_join(threads[i-1], NULL);
+    delete [] threads;
+
+    pthread_cond_destroy(&done_cond);
+    pthread_cond_destroy(&start_cond);
+    pthread_mutex_destroy(&lock);
+}
+
+
+void *ThreadPool::workerMain(void *_args)
+{
+    WorkerArgs *args = (WorkerArgs*) _args;
+    ThreadPool *pool = args->pool;
+    const int thread = args->thread;
+    delete args;
+
+    pool->work(thread);
+    return NULL;
+}
+
+
+void ThreadPool::work(int thread)
+{
+    int seen = 0;
+
+    while (true) {
+        // wait for a new job
+        pthread_mutex_lock(&lock);
+        while (generation == seen && !quit)
+            pthread_cond_wait(&start_cond, &lock);
+        if (quit) {
+            pthread_mutex_unlock(&lock);
+            return;
+        }
+        seen = generation;
+        Func f = func;
+        void *a = arg;
+        pthread_mutex_unlock(&lock);
+
+        f(a, thread);
+
+        // report completion
+        pthread_mutex_lock(&lock);
+        if (--pending == 0)
+            pthread_cond_signal(&done_cond);
+        pthread_mutex_unlock(&lock);
+    }
+}
+
+
+void ThreadPool::run(Func _func, void *_arg)
+{
+    if (nthreads == 1) {
+        _func(_arg, 0);
+        return;
+    }
+
+    pthread_mutex_lock(&lock);
+    func = _func;
+    arg = _arg;
+    pending = nthreads - 1;
+    generation++;
+    pthread_cond_broadcast(&start_cond);
+    pthread_mutex_unlock(&lock);
+
+    _func(_arg, 0);
+
+    pthread_mutex_lock(&lock);
+    while (pending > 0)
+        pthread_cond_wait(&done_cond, &lock);
+    pthread_mutex_unlock(&lock);
+}
+
+
+void ThreadPool::getRange(int n, int thread, int *start, int *end,
+                          int align) const
+{
+    int chunk = (n + nthreads - 1) / nthreads;
+    chunk = (chunk + align - 1) / align * align;
+
+    *start = thread * chunk;
+    *end = *start + chunk;
+    if (*start > n)
+        *start = n;
+    if (*end > n)
+        *end = n;
+}
+
+
+//=============================================================================
+// tasks with dependencies
+
+TaskForest::TaskForest() :
+    ntasks(0),
+    queueLocks(NULL),
+    nlocks(0),
+    nthreads(0),
+    func(NULL),
+    arg(NULL)
+{}
+
+
+TaskForest::~TaskForest()
+{
+    for (int i=0; i<nlocks; i++)
+        pthread_mutex_destroy(&queueLocks[i]);
+    delete [] queueLocks;
+}
+
+
+void TaskForest::setTasks(int _ntasks, const int *_parents)
+{
+    ntasks = _ntasks;
+    parents.setSize(0);
+    for (int i=0; i<ntasks; i++)
+        parents.append(_parents[i]);
+}
+
+
+void TaskForest::run(ThreadPool *pool, Func _func, void *_arg)
+{
+    // one thread runs the tasks in order
+    if (pool->nthreads == 1) {
+        for (int i=0; i<ntasks; i++)
+            _func(_arg, i);
+        return;
+    }
+
+    nthreads = pool->nthreads;
+    func = _func;
+    arg = _arg;
+
+    if (nlocks < nthreads) {
+        for (int i=0; i<nlocks; i++)
+            pthread_mutex_destroy(&queueLocks[i]);
+        delete [] queueLocks;
+        queueLocks = new pthread_mutex_t [nthreads];
+        nlocks = nthreads;
+        for (int i=0; i<nlocks; i++)
+            pthread_mutex_init(&queueLocks[i], NULL);
+    }
+
+    pending.setSize(0);
+    for (int i=0; i<ntasks; i++)
+        pending.append(0);
+    for (int i=0; i<ntasks; i++)
+        if (parents[i] >= 0)
+            pending[parents[i]]++;
+
+    queue.setSize(0);
+    for (int i=0; i<ntasks; i++)
+        if (pending[i] == 0)
+            queue.append(i);
+
+    queueStart.setSize(0);
+    queueEnd.setSize(0);
+    for (int i=0; i<nthreads; i++) {
+        int start, end;
+        pool->getRange(queue.size(), i, &start, &end);
+        queueStart.append(start);
+        queueEnd.append(end);
+    }
+
+    pool->run(&TaskForest::workMain, this);
+}
+
+
+void TaskForest::workMain(void *forest, int thread)
+{
+    ((TaskForest*) forest)->work(thread);
+}
+
+
+// The queues only hold the tasks without children, so a thread that finds
+// them all empty is done: every remaining task is run by the thread that
+// finishes its last child.  ThreadPool::run() returns once all threads are
+// done.
+void TaskForest::work(int thread)
+{
+    int task;
+    while ((task = takeTask(thread)) >= 0) {
+        // continue with the parent if this was its last child
+        // (the atomic operation orders the rows of both children before
+        // the parent)
+        while (task >= 0) {
+            func(arg, task);
+
+            const int parent = parents[task];
+            task = -1;
+            if (parent >= 0 && __sync_sub_and_fetch(&pending[parent], 1) == 0)
+                task = parent;
+        }
+    }
+}
+
+
+// front of the own queue, or else the back of the queue of another thread
+int TaskForest::takeTask(int thread)
+{
+    for (int k=0; k<nthreads; k++) {
+        const int i = (thread + k) % nthreads;
+        int task = -1;
+
+        pthread_mutex_lock(&queueLocks[i]);
+        if (queueStart[i] < queueEnd[i]) {
+            if (k == 0)
+                task = queue[queueStart[i]++];
+            else
+                task = queue[--queueEnd[i]];
+        }
+        pthread_mutex_unlock(&queueLocks[i]);
+
+        if (task >= 0)
+            return task;
+    }
+    return -1;
+}
+
+
+//=============================================================================
+// likelihood thread pool
+
+static ThreadPool *g_lkPool = NULL;
+
+
+void setLkThreads(int nthreads)
+{
+    if (g_lkPool && g_lkPool->nthreads == nthreads)
+        return;
+    delete g_lkPool;
+    g_lkPool = new ThreadPool(nthreads);
+}
+
+
+ThreadPool *getLkThreadPool()
+{
+    if (!g_lkPool)
+        g_lkPool = new ThreadPool(1);
+    return g_lkPool;
+}
+
+
+} // namespace spidir
@@ -0,0 +1,121 @@
+/*=============================================================================
+
+  SPIMAP
+  Copyright 2007-2013
+
+  Persistent pool of worker threads
+
+=============================================================================*/
+
+
+#ifndef SPIDIR_THREAD_POOL_H
+#define SPIDIR_THREAD_POOL_H
+
+#include <pthread.h>
+
+#include "ExtendArray.h"
+
+
+namespace spidir {
+
+
+// A fixed set of threads that repeatedly run the same kind of job.
+//
+// run() calls func(arg, i) once for every thread index i in [0, nthreads)
+// and returns when all calls have finished.  Index 0 is run by the calling
+// thread.  Jobs split their work by thread index, so the partition (and
+// therefore any reduction over it) only depends on nthreads.
+class ThreadPool
+{
+public:
+    typedef void (*Func)(void *arg, int thread);
+
+    ThreadPool(int nthreads);
+    ~ThreadPool();
+
+    void run(Func func, void *arg);
+
+    // [start, end) of the part of n items assigned to thread.  Parts are
+    // multiples of 'align' items (except the last).
+    void getRange(int n, int thread, int *start, int *end, int align=1) const;
+
+    int nthreads;
+
+protected:
+    static void *workerMain(void *pool);
+    void work(int thread);
+
+    pthread_t *threads;
+    pthread_mutex_t lock;
+    pthread_cond_t start_cond;
+    pthread_cond_t done_cond;
+
+    // current job
+    Func func;
+    void *arg;
+    int generation;   // incremented for each job
+    int pending;      // workers still running the current job
+    bool quit;
+};
+
+
+// Tasks whose dependencies form a forest: a task starts once all of its
+// children have finished.  Tasks are numbered so that children come before
+// their parent (e.g. the internal nodes of a tree in post-order).
+//
+// run() executes the tasks on a ThreadPool with work stealing.  Every
+// thread starts with a contiguous block of the tasks without children, so
+// that it works on neighbouring subtrees, and takes them from the front of
+// its queue.  A thread whose queue is empty steals from the back of the
+// queue of another thread.  The thread that finishes the last child of a
+// task runs the task next, while the rows of the children are still in its
+// cache.  A thread that finds every queue empty stops, since the tasks
+// left are run by the threads that finish their children.
+class TaskForest
+{
+public:
+    typedef void (*Func)(void *arg, int task);
+
+    TaskForest();
+    ~TaskForest();
+
+    // parents[i] is the parent of task i (greater than i, or -1)
+    void setTasks(int ntasks, const int *parents);
+
+    void run(ThreadPool *pool, Func func, void *arg);
+
+    int ntasks;
+
+protected:
+    static void workMain(void *forest, int thread);
+    void work(int thread);
+    int takeTask(int thread);
+
+    ExtendArray<int> parents;
+    ExtendArray<int> pending;     // children of each task not finished
+    ExtendArray<int> queue;       // tasks without children
+    ExtendArray<int> queueStart;  // [start, end) of the queue of a thread
+    ExtendArray<int> queueEnd;
+    pthread_mutex_t *queueLocks;
+    int nlocks;
+
+    // current run
+    int nthreads;
+    Func func;
+    void *arg;
+
+private:
+    // not copyable
+    TaskForest(const TaskForest &other);
+    TaskForest &operator=(const TaskForest &other);
+};
+
+
+// the pool used by the likelihood computations (one thread if never set)
+extern "C" void setLkThreads(int nthreads);
+ThreadPool *getLkThreadPool();
+
+
+} // namespace spidir
+
+#endif // SPIDIR_THREAD_POOL_H
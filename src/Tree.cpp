@@ -611,6 +611,11 @@ namespace spidir {
       tree->setDists(dists);
     }
     
+    void getTreeDists(Tree *tree, float *dists) 
+    {
+      tree->getDists(dists);
+    }
+    
   } // extern C
 
 
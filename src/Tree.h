@@ -448,6 +448,7 @@ void tree2ptree(Tree *tree, int *ptree);
 Tree *makeTree(int nnodes, int *ptree);
 void deleteTree(Tree *tree);
 void setTreeDists(Tree *tree, float *dists);
+void getTreeDists(Tree *tree, float *dists);
 
 }
 
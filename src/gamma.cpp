@@ -15,6 +15,7 @@
 #include <string.h>
 
 // gsl
+#include <gsl/gsl_cdf.h>
 #include <gsl/gsl_sf.h>
 #include <gsl/gsl_randist.h>
 
@@ -302,6 +303,27 @@ double gammaSumPdf(double y, int n, float *alpha, float *beta,
 }
 
 
+// The categories are split at the quantiles i/ncats of Gamma(alpha, 1/alpha).
+// The mean of x over [a, b) is given by the CDF of Gamma(alpha+1, 1/alpha),
+// since x * gammaPdf(x, alpha, 1/alpha) = gammaPdf(x, alpha+1, 1/alpha).
+void discreteGammaRates(float alpha, int ncats, float *rates)
+{
+    const double scale = 1.0 / alpha;
+    double lastcdf = 0.0;
+
+    for (int i=0; i<ncats; i++) {
+        double cdf = 1.0;
+        if (i < ncats - 1) {
+            const double cut = gsl_cdf_gamma_Pinv(double(i+1) / ncats, 
+                                                  alpha, scale);
+            cdf = gsl_cdf_gamma_P(cut, alpha + 1.0, scale);
+        }
+        rates[i] = (cdf - lastcdf) * ncats;
+        lastcdf = cdf;
+    }
+}
+
+
 
 
 /* =========================================================================
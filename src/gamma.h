@@ -56,6 +56,10 @@ inline float invgammavariate(float alpha, float beta)
 double gammaSumPdf(double y, int n, float *alpha, float *beta, 
 		   float tol);
 
+// Rates of ncats equally likely categories of a gamma distribution with
+// shape alpha and mean 1.  Each rate is the mean of its category (Yang 1994).
+void discreteGammaRates(float alpha, int ncats, float *rates);
+
 
 } // extern "C"
 
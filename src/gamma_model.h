@@ -0,0 +1,160 @@
+/*=============================================================================
+
+  SPIMAP
+  Copyright 2007-2013
+
+  Among-site rate variation with discrete gamma rate categories
+
+=============================================================================*/
+
+
+#ifndef SPIDIR_GAMMA_MODEL_H
+#define SPIDIR_GAMMA_MODEL_H
+
+#include <assert.h>
+#include <string.h>
+
+#include "gamma.h"
+#include "lk_kernels.h"
+
+
+namespace spidir {
+
+
+// Substitution model whose sites fall into ncats equally likely rate
+// categories (discreteGammaRates)
+//
+// A site in category r evolves under Model with its branch lengths
+// multiplied by rates[r], so a branch has one matrix per category,
+//   P_r(t) = P(rates[r] t)
+// and the derivatives of order n with respect to t are
+//   rates[r]^n P^(n)(rates[r] t).
+// getMatrix() returns the ncats matrices one after the other (the layout
+// of the rate category kernels in lk_kernels.h).  The matrices of all
+// categories and of all derivative orders are computed together with
+// Model::getMatrices() and cached by branch length.  Derivative models
+// returned by deriv() share the cache of the model they come from.
+template <class Model>
+class DiscreteGammaModel
+{
+public:
+    DiscreteGammaModel(Model *model, float alpha, int ncats) :
+        model(model),
+        alpha(alpha),
+        ncats(ncats),
+        order(0),
+        parent(this),
+        cacheMatrices(new float [CACHE_SIZE * 3 * 16 * ncats]),
+        nhits(0),
+        nmisses(0)
+    {
+        assert(ncats >= 1 && ncats <= LK_MAX_CATS);
+        if (ncats == 1)
+            rates[0] = 1.0;
+        else
+            discreteGammaRates(alpha, ncats, rates);
+        for (int i=0; i<CACHE_SIZE; i++)
+            cacheValid[i] = false;
+    }
+
+    ~DiscreteGammaModel()
+    {
+        delete [] cacheMatrices;
+    }
+
+    void getMatrix(float t, float *matrices)
+    {
+        const int n = 16 * ncats;
+        memcpy(matrices, parent->getCachedMatrices(t) + order * n,
+               n * sizeof(float));
+    }
+
+    typedef DiscreteGammaModel<Model> Deriv;
+    Deriv *deriv()
+    {
+        assert(order < 2);
+        return new Deriv(parent, order + 1);
+    }
+
+    // the matrices of all categories of P(t), P'(t) and P''(t), one after
+    // the other
+    const float *getCachedMatrices(float t)
+    {
+        unsigned int key;
+        memcpy(&key, &t, sizeof(key));
+        const unsigned int slot = ((key ^ (key >> 15)) * 2654435761u) >>
+            (32 - CACHE_BITS);
+        float *entry = &cacheMatrices[slot * 3 * 16 * ncats];
+
+        if (cacheValid[slot] && cacheKeys[slot] == key) {
+            nhits++;
+            return entry;
+        }
+        nmisses++;
+
+        float *m0 = entry, *m1 = entry + 16 * ncats, *m2 = entry + 32 * ncats;
+        for (int r=0; r<ncats; r++) {
+            const float rate = rates[r];
+            model->getMatrices(rate * t, &m0[16*r], &m1[16*r], &m2[16*r]);
+            for (int i=0; i<16; i++) {
+                m1[16*r + i] *= rate;
+                m2[16*r + i] *= rate * rate;
+            }
+        }
+        cacheKeys[slot] = key;
+        cacheValid[slot] = true;
+        return entry;
+    }
+
+    // weights of the partials of a site at the root (see calcLogLkRowCats)
+    void getRootFreqs(const float *bgfreq, float *freqs) const
+    {
+        for (int r=0; r<ncats; r++)
+            for (int k=0; k<4; k++)
+                freqs[4*r + k] = bgfreq[k] / ncats;
+    }
+
+    static const int CACHE_BITS = 4;
+    static const int CACHE_SIZE = 1 << CACHE_BITS;
+
+    Model *model;
+    float alpha;        // shape of the gamma distribution
+    int ncats;
+    float rates[LK_MAX_CATS];
+    int order;          // order of the derivative
+    DiscreteGammaModel *parent;   // owner of the cache
+
+    // direct-mapped cache keyed by the bits of the branch length
+    // (only used in the parent)
+    unsigned int cacheKeys[CACHE_SIZE];
+    bool cacheValid[CACHE_SIZE];
+    float *cacheMatrices;
+    int nhits;
+    int nmisses;
+
+protected:
+    // derivative of order 'order' of parent
+    DiscreteGammaModel(DiscreteGammaModel *parent, int order) :
+        model(parent->model),
+        alpha(parent->alpha),
+        ncats(parent->ncats),
+        order(order),
+        parent(parent),
+        cacheMatrices(NULL),
+        nhits(0),
+        nmisses(0)
+    {
+        for (int r=0; r<ncats; r++)
+            rates[r] = parent->rates[r];
+    }
+
+private:
+    // not copyable
+    DiscreteGammaModel(const DiscreteGammaModel &other);
+    DiscreteGammaModel &operator=(const DiscreteGammaModel &other);
+};
+
+
+} // namespace spidir
+
+#endif // SPIDIR_GAMMA_MODEL_H
@@ -0,0 +1,194 @@
+/*=============================================================================
+
+  SPIMAP
+  Copyright 2007-2013
+
+  General time-reversible substitution model
+
+=============================================================================*/
+
+
+#include <math.h>
+#include <string.h>
+
+#include <gsl/gsl_eigen.h>
+
+#include "common.h"
+#include "gtr.h"
+
+namespace spidir {
+
+
+// frequencies below this are raised to it, so that D^-1/2 exists
+static const float GTR_MIN_FREQ = 1e-10;
+
+
+GtrModel::GtrModel(const float *bgfreq, const float *rates) :
+    cacheMatrices(new float [CACHE_SIZE * 3 * NMATRIX]),
+    nhits(0),
+    nmisses(0)
+{
+    for (int i=0; i<4; i++)
+        pi[i] = max(bgfreq[i], GTR_MIN_FREQ);
+    for (int i=0; i<CACHE_SIZE; i++)
+        cacheValid[i] = false;
+
+    // off-diagonal rates and the expected substitution rate
+    double q[NMATRIX];
+    double mu = 0.0;
+    for (int i=0, r=0; i<4; i++) {
+        q[matind(4, i, i)] = 0.0;
+        for (int j=i+1; j<4; j++, r++) {
+            q[matind(4, i, j)] = rates[r] * pi[j];
+            q[matind(4, j, i)] = rates[r] * pi[i];
+            mu += 2.0 * pi[i] * rates[r] * pi[j];
+        }
+    }
+
+    // symmetric B = D^1/2 Q D^-1/2 / mu, whose diagonal is the diagonal
+    // of Q (minus the row sums)
+    gsl_matrix *b = gsl_matrix_alloc(4, 4);
+    for (int i=0; i<4; i++) {
+        double sum = 0.0;
+        for (int j=0; j<4; j++) {
+            sum += q[matind(4, i, j)];
+            if (j != i)
+                gsl_matrix_set(b, i, j, q[matind(4, i, j)] *
+                               sqrt(pi[i] / pi[j]) / mu);
+        }
+        gsl_matrix_set(b, i, i, -sum / mu);
+    }
+
+    // B = V diag(lambda) V^T, so U = D^-1/2 V and U^-1 = V^T D^1/2
+    gsl_vector *eval = gsl_vector_alloc(4);
+    gsl_matrix *evec = gsl_matrix_alloc(4, 4);
+    gsl_eigen_symmv_workspace *work = gsl_eigen_symmv_alloc(4);
+    gsl_eigen_symmv(b, eval, evec, work);
+
+    for (int k=0; k<4; k++) {
+        lambda[k] = gsl_vector_get(eval, k);
+        for (int i=0; i<4; i++) {
+            const double v = gsl_matrix_get(evec, i, k);
+            u[matind(4, i, k)] = v / sqrt(pi[i]);
+            uinv[matind(4, k, i)] = v * sqrt(pi[i]);
+        }
+    }
+
+    gsl_eigen_symmv_free(work);
+    gsl_matrix_free(evec);
+    gsl_vector_free(eval);
+    gsl_matrix_free(b);
+}
+
+
+GtrModel::~GtrModel()
+{
+    delete [] cacheMatrices;
+}
+
+
+// transition probability P(j | i, t)
+void GtrModel::getMatrix(float t, float *matrix)
+{
+    memcpy(matrix, getCachedMatrices(t), NMATRIX * sizeof(float));
+}
+
+
+// transition probabilities and their first and second derivatives
+//
+// Each entry is a sum over eigenvalues, so the three matrices share the
+// products of the eigenvectors.
+void GtrModel::getMatrices(float t, float *matrix, float *dmatrix, 
+                           float *d2matrix)
+{
+    double e0[4], e1[4], e2[4];
+    for (int k=0; k<4; k++) {
+        e0[k] = exp(lambda[k] * t);
+        e1[k] = lambda[k] * e0[k];
+        e2[k] = lambda[k] * e1[k];
+    }
+
+    for (int i=0; i<4; i++) {
+        double p0[4], p1[4], p2[4];
+        for (int j=0; j<4; j++)
+            p0[j] = p1[j] = p2[j] = 0.0;
+
+        for (int k=0; k<4; k++) {
+            const double uik = u[matind(4, i, k)];
+            const double f0 = uik * e0[k];
+            const double f1 = uik * e1[k];
+            const double f2 = uik * e2[k];
+            const double *row = &uinv[matind(4, k, 0)];
+            for (int j=0; j<4; j++) {
+                p0[j] += f0 * row[j];
+                p1[j] += f1 * row[j];
+                p2[j] += f2 * row[j];
+            }
+        }
+
+        // rounding can make tiny probabilities negative
+        for (int j=0; j<4; j++) {
+            matrix[matind(4, i, j)] = max(p0[j], 0.0);
+            if (dmatrix)
+                dmatrix[matind(4, i, j)] = p1[j];
+            if (d2matrix)
+                d2matrix[matind(4, i, j)] = p2[j];
+        }
+    }
+}
+
+
+const float *GtrModel::getCachedMatrices(float t)
+{
+    unsigned int key;
+    memcpy(&key, &t, sizeof(key));
+    const unsigned int slot = ((key ^ (key >> 15)) * 2654435761u) >>
+        (32 - CACHE_BITS);
+    float *entry = &cacheMatrices[slot * 3 * NMATRIX];
+
+    if (cacheValid[slot] && cacheKeys[slot] == key) {
+        nhits++;
+    } else {
+        nmisses++;
+        getMatrices(t, entry, entry + NMATRIX, entry + 2 * NMATRIX);
+        cacheKeys[slot] = key;
+        cacheValid[slot] = true;
+    }
+
+    return entry;
+}
+
+
+GtrModel::Deriv *GtrModel::deriv()
+{
+    return new Deriv(this, 1);
+}
+
+
+void GtrModelDeriv::getMatrix(float t, float *matrix)
+{
+    const int n = GtrModel::NMATRIX;
+    memcpy(matrix, parent->getCachedMatrices(t) + order * n,
+           n * sizeof(float));
+}
+
+
+GtrModelDeriv::Deriv *GtrModelDeriv::deriv()
+{
+    assert(order < 2);
+    return new Deriv(parent, order + 1);
+}
+
+
+extern "C" {
+
+void makeGtrMatrix(const float *bgfreq, const float *rates, float t,
+                   float *matrix)
+{
+    GtrModel model(bgfreq, rates);
+    model.getMatrix(t, matrix);
+}
+
+} // extern "C"
+
+} // namespace spidir
@@ -0,0 +1,103 @@
+/*=============================================================================
+
+  SPIMAP
+  Copyright 2007-2013
+
+  General time-reversible substitution model
+
+=============================================================================*/
+
+
+#ifndef SPIDIR_GTR_H
+#define SPIDIR_GTR_H
+
+
+namespace spidir {
+
+class GtrModelDeriv;
+
+
+// General time-reversible nucleotide model
+//
+// The rate of i -> j is rates[i,j] * pi[j] for symmetric exchangeabilities
+// rates, scaled to one expected substitution per unit of time.  Since
+// D^1/2 Q D^-1/2 (D = diag(pi)) is symmetric, the rate matrix has the
+// eigendecomposition Q = U diag(lambda) U^-1, which is computed once.
+// Then
+//   P(t)   = U diag(exp(lambda t)) U^-1
+//   P'(t)  = U diag(lambda exp(lambda t)) U^-1
+//   P''(t) = U diag(lambda^2 exp(lambda t)) U^-1
+// are computed together and cached by branch length, as in HkyModel.
+//
+// Matrices are 4 x 4 row-major with P[i,j] = P(j | i, t).
+class GtrModel
+{
+public:
+    // rates are the exchangeabilities of the pairs of states i < j in
+    // row order (AC, AG, AT, CG, CT, GT).  All frequencies must be 
+    // positive.
+    GtrModel(const float *bgfreq, const float *rates);
+    ~GtrModel();
+
+    void getMatrix(float t, float *matrix);
+    typedef GtrModelDeriv Deriv;
+    Deriv *deriv();
+
+    // compute P(t), P'(t) and P''(t) at once (dmatrix, d2matrix may be NULL)
+    void getMatrices(float t, float *matrix, float *dmatrix, float *d2matrix);
+
+    // cached P(t), P'(t) and P''(t), one after the other
+    const float *getCachedMatrices(float t);
+
+    static const int NMATRIX = 16;
+    static const int CACHE_BITS = 6;
+    static const int CACHE_SIZE = 1 << CACHE_BITS;
+
+    float pi[4];
+    double lambda[4];       // eigenvalues of Q
+    double u[NMATRIX];      // eigenvectors of Q (columns)
+    double uinv[NMATRIX];   // inverse of u
+
+    // direct-mapped cache keyed by the bits of the branch length
+    unsigned int cacheKeys[CACHE_SIZE];
+    bool cacheValid[CACHE_SIZE];
+    float *cacheMatrices;
+    int nhits;
+    int nmisses;
+
+private:
+    // not copyable
+    GtrModel(const GtrModel &other);
+    GtrModel &operator=(const GtrModel &other);
+};
+
+
+// Derivatives of the transition matrices of a GtrModel (order 1 or 2),
+// taken from the cache of the model
+class GtrModelDeriv
+{
+public:
+    GtrModelDeriv(GtrModel *parent, int order=1) :
+        parent(parent),
+        order(order)
+    {}
+
+    void getMatrix(float t, float *matrix);
+    typedef GtrModelDeriv Deriv;
+    Deriv *deriv();
+
+    GtrModel *parent;
+    int order;
+};
+
+
+extern "C" {
+
+void makeGtrMatrix(const float *bgfreq, const float *rates, float t,
+                   float *matrix);
+
+} // extern "C"
+
+} // namespace spidir
+
+#endif // SPIDIR_GTR_H
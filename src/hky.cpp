@@ -8,6 +8,8 @@
 =============================================================================*/
 
 
+#include <string.h>
+
 #include "hky.h"
 #include "common.h"
 #include "seq.h"
@@ -76,7 +78,9 @@ namespace spidir {
 */
 
 
-HkyModelDeriv2::HkyModelDeriv2(const float *bgfreq, float ratio_kappa)
+HkyModelDeriv2::HkyModelDeriv2(const float *bgfreq, float ratio_kappa,
+                               HkyModel *parent) :
+    parent(parent)
 {
     // set background base frequencies
     for (int i=0; i<4; i++)
@@ -104,6 +108,12 @@ HkyModelDeriv2::HkyModelDeriv2(const float *bgfreq, float ratio_kappa)
 // transition probability P(j | i, t)
 void HkyModelDeriv2::getMatrix(float t, float *matrix)
 {
+    if (parent) {
+        memcpy(matrix, parent->getCachedMatrices(t)->d2matrix, 
+               16 * sizeof(float));
+        return;
+    }
+
     for (int i=0; i<4; i++) {
         for (int j=0; j<4; j++) {
             // convenience variables
@@ -139,7 +149,9 @@ void HkyModelDeriv2::getMatrix(float t, float *matrix)
 
 //=============================================================================
 
-HkyModelDeriv::HkyModelDeriv(const float *bgfreq, float kappa) :
+HkyModelDeriv::HkyModelDeriv(const float *bgfreq, float kappa,
+                             HkyModel *parent) :
+    parent(parent),
     kappa(kappa)
 {
     // set background base frequencies
@@ -168,6 +180,12 @@ HkyModelDeriv::HkyModelDeriv(const float *bgfreq, float kappa) :
 // transition probability P(j | i, t)
 void HkyModelDeriv::getMatrix(float t, float *matrix)
 {
+    if (parent) {
+        memcpy(matrix, parent->getCachedMatrices(t)->dmatrix, 
+               16 * sizeof(float));
+        return;
+    }
+
     for (int i=0; i<4; i++) {
         for (int j=0; j<4; j++) {
             // convenience variables
@@ -203,7 +221,7 @@ void HkyModelDeriv::getMatrix(float t, float *matrix)
 
 HkyModelDeriv::Deriv *HkyModelDeriv::deriv()
 {
-    return new Deriv(pi, kappa);
+    return new Deriv(pi, kappa, parent);
 }
 
 
@@ -238,41 +256,80 @@ HkyModel::HkyModel(const float *bgfreq, float kappa) :
 // transition probability P(j | i, t)
 void HkyModel::getMatrix(float t, float *matrix)
 {
+    memcpy(matrix, getCachedMatrices(t)->matrix, 16 * sizeof(float));
+}
+
+
+// transition probabilities and their first and second derivatives
+//
+// The exponentials only depend on whether i is a purine or a pyrimidine,
+// so they are computed once per type.
+void HkyModel::getMatrices(float t, float *matrix, float *dmatrix, 
+                           float *d2matrix)
+{
+    // index 0 for purines, 1 for pyrimidines
+    const float a[2] = {a_r, a_y};
+    const float pi_ry[2] = {pi_r, pi_y};
+    float ait[2], ab[2], eabt[2];
+    for (int k=0; k<2; k++) {
+        ait[k] = expf(-a[k]*t);
+        ab[k] = a[k] + b;
+        eabt[k] = expf(-ab[k]*t);
+    }
+    const float ebt = expf(-b*t);
+
     for (int i=0; i<4; i++) {
+        const int type = int(dnatype[i] == DNA_PRYMIDINE);
         for (int j=0; j<4; j++) {
-            // convenience variables
-            // NOTE: it is ok to assign pi_ry, because it is only used when
-            // dnatype[i] == dnatype[j]
-            float a_i, pi_ry;
-            switch (dnatype[i]) {
-            case DNA_PURINE:
-                a_i = a_r;
-                pi_ry = pi_r;  
-                break;
-            case DNA_PRYMIDINE:
-                a_i = a_y;
-                pi_ry = pi_y;
-                break;
-            default:
-                assert(0);
-            }
             int delta_ij = int(i == j);
             int e_ij = int(dnatype[i] == dnatype[j]);
-        
-            // return transition probability
-            float ait = expf(-a_i*t);
-            float ebt = expf(-b*t);
-        
-            matrix[matind(4,i,j)] = ait*ebt * delta_ij + 
-                ebt * (1.0 - ait) * (pi[j]*e_ij/pi_ry) + 
+            
+            matrix[matind(4,i,j)] = ait[type]*ebt * delta_ij + 
+                ebt * (1.0 - ait[type]) * (pi[j]*e_ij/pi_ry[type]) + 
                 (1 - ebt) * pi[j];
+
+            if (dmatrix)
+                dmatrix[matind(4, i, j)] = 
+                    - delta_ij * ab[type] * eabt[type] +
+                    (pi[j] * e_ij / pi_ry[type]) * 
+                    (- b * ebt + ab[type] * eabt[type]) +
+                    pi[j] * b * ebt;
+
+            if (d2matrix)
+                d2matrix[matind(4, i, j)] = 
+                    delta_ij * ab[type]*ab[type] * eabt[type] +
+                    (pi[j] * e_ij / pi_ry[type]) * 
+                    (b*b*ebt - ab[type]*ab[type]*eabt[type]) -
+                    pi[j]*b*b*ebt;
         }
     }
 }
 
+
+const HkyMatrixCache::Entry *HkyModel::getCachedMatrices(float t)
+{
+    unsigned int key;
+    memcpy(&key, &t, sizeof(key));
+    const unsigned int slot = ((key ^ (key >> 15)) * 2654435761u) >> 
+        (32 - HkyMatrixCache::BITS);
+    HkyMatrixCache::Entry *entry = &cache.entries[slot];
+
+    if (entry->valid && entry->key == key) {
+        cache.nhits++;
+    } else {
+        cache.nmisses++;
+        getMatrices(t, entry->matrix, entry->dmatrix, entry->d2matrix);
+        entry->key = key;
+        entry->valid = true;
+    }
+
+    return entry;
+}
+
+
 HkyModel::Deriv *HkyModel::deriv()
 {
-    return new Deriv(pi, kappa);
+    return new Deriv(pi, kappa, this);
 }
 
 
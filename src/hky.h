@@ -16,13 +16,55 @@
 
 namespace spidir {
 
+class HkyModel;
+
+
+// Small direct-mapped cache of transition matrices keyed by the bits of
+// the branch length.  Each entry holds P(t), P'(t) and P''(t), which are
+// computed together on a miss.
+class HkyMatrixCache
+{
+public:
+    HkyMatrixCache() :
+        nhits(0),
+        nmisses(0)
+    {
+        clear();
+    }
+
+    struct Entry
+    {
+        unsigned int key;
+        bool valid;
+        float matrix[16];
+        float dmatrix[16];
+        float d2matrix[16];
+    };
+
+    void clear()
+    {
+        for (int i=0; i<SIZE; i++)
+            entries[i].valid = false;
+    }
+
+    static const int BITS = 6;
+    static const int SIZE = 1 << BITS;
+
+    Entry entries[SIZE];
+    int nhits;
+    int nmisses;
+};
+
 
 class HkyModelDeriv2
 {
 public:
-    HkyModelDeriv2(const float *bgfreq, float ratio_kappa);
+    HkyModelDeriv2(const float *bgfreq, float ratio_kappa, 
+                   HkyModel *parent=NULL);
     void getMatrix(float t, float *matrix);
     
+    HkyModel *parent;  // if set, matrices come from the parent's cache
+
     // parameters
     float ratio;
     float pi[4];
@@ -38,11 +80,13 @@ public:
 class HkyModelDeriv
 {
 public:
-    HkyModelDeriv(const float *bgfreq, float kappa);
+    HkyModelDeriv(const float *bgfreq, float kappa, HkyModel *parent=NULL);
     void getMatrix(float t, float *matrix);
     typedef HkyModelDeriv2 Deriv;
     Deriv *deriv();
 
+    HkyModel *parent;  // if set, matrices come from the parent's cache
+
     // parameters
     float kappa;
     float ratio;
@@ -64,6 +108,15 @@ public:
     typedef HkyModelDeriv Deriv;
     Deriv *deriv();
 
+    // compute P(t), P'(t) and P''(t) at once (dmatrix, d2matrix may be NULL)
+    void getMatrices(float t, float *matrix, float *dmatrix, float *d2matrix);
+
+    // cached P(t), P'(t) and P''(t)
+    const HkyMatrixCache::Entry *getCachedMatrices(float t);
+
+    // derivative models created by deriv() share this cache
+    HkyMatrixCache cache;
+
     // parameters
     float kappa;
     float ratio;
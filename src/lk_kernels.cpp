@@ -0,0 +1,1508 @@
+/*=============================================================================
+
+  SPIMAP
+  Copyright 2007-2013
+
+  Inner loops of the conditional likelihood recursion
+
+=============================================================================*/
+
+// c++ headers
+#include <float.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <new>
+#include <pthread.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+// spidir headers
+#include "common.h"
+#include "lk_kernels.h"
+
+
+// vectorized kernels are only compiled for x86 with gcc-compatible compilers
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__) && \
+    !defined(SPIDIR_NO_SIMD)
+#   define SPIDIR_X86_SIMD
+#   include <immintrin.h>
+#endif
+
+
+namespace spidir {
+
+
+//=============================================================================
+// scalar kernels
+//
+// Matrices are transposed first, so that the product with the partials of
+// a site is a sum of columns,
+//   sum_x P[.,x] a[x]
+// whose inner loop runs over contiguous states and vectorizes.  The terms
+// are added in the order of x, as in a row by row product.
+
+// 4x4 mat transposed into matT
+static inline void transposeMatrix(const floatlk *mat, floatlk *matT)
+{
+    for (int k=0; k<4; k++)
+        for (int x=0; x<4; x++)
+            matT[x*4 + k] = mat[k*4 + x];
+}
+
+
+// prob[k] = sum_x P[k,x] v[x] with matT the transpose of P
+static inline void matVec(const floatlk *matT, const floatlk *v,
+                          floatlk *prob)
+{
+    for (int k=0; k<4; k++)
+        prob[k] = 0.0;
+    for (int x=0; x<4; x++) {
+        const floatlk vx = v[x];
+        const floatlk *col = &matT[x*4];
+        for (int k=0; k<4; k++)
+            prob[k] += col[k] * vx;
+    }
+}
+
+
+static void calcLkRowScalar(int seqlen, const floatlk *amat, const floatlk *bmat,
+                            const floatlk *a, const floatlk *b, floatlk *c)
+{
+    floatlk amatT[16], bmatT[16];
+    floatlk prob1[4], prob2[4];
+    transposeMatrix(amat, amatT);
+    transposeMatrix(bmat, bmatT);
+
+    // iterate over sites
+    for (int j=0; j<seqlen; j++) {
+        // sum_x P(x|k, t_a) lktable[a][j,x]
+        matVec(amatT, &a[matind(4, j, 0)], prob1);
+
+        // sum_y P(y|k, t_b) lktable[b][j,y]
+        matVec(bmatT, &b[matind(4, j, 0)], prob2);
+
+        floatlk *row = &c[matind(4, j, 0)];
+        for (int k=0; k<4; k++)
+            row[k] = prob1[k] * prob2[k];
+    }
+}
+
+
+static void calcDerivLkRowScalar(int seqlen, const floatlk *bmat,
+                                 const floatlk *a, const floatlk *b,
+                                 floatlk *c)
+{
+    floatlk bmatT[16];
+    floatlk prob2[4];
+    transposeMatrix(bmat, bmatT);
+
+    // iterate over sites
+    for (int j=0; j<seqlen; j++) {
+        // sum_y P(y|k, t_b) lktable[b][j,y]
+        matVec(bmatT, &b[matind(4, j, 0)], prob2);
+
+        const floatlk *terma = &a[matind(4, j, 0)];
+        floatlk *row = &c[matind(4, j, 0)];
+        for (int k=0; k<4; k++)
+            row[k] = terma[k] * prob2[k];
+    }
+}
+
+
+static void calcLkTipRowScalar(int seqlen, const floatlk *alook, 
+                               const unsigned char *acodes,
+                               const floatlk *bmat, const floatlk *b, 
+                               floatlk *c)
+{
+    // iterate over sites
+    for (int j=0; j<seqlen; j++) {
+        const floatlk *terma = &alook[4 * acodes[j]];
+        const floatlk *termb = &b[matind(4, j, 0)];
+
+        for (int k=0; k<4; k++) {
+            const floatlk *bptr = &bmat[4*k];
+
+            // sum_y P(y|k, t_b) lktable[b][j,y]
+            const floatlk prob2 = bptr[0] * termb[0] +
+                                  bptr[1] * termb[1] +
+                                  bptr[2] * termb[2] +
+                                  bptr[3] * termb[3];
+
+            c[matind(4, j, k)] = terma[k] * prob2;
+        }
+    }
+}
+
+
+//=============================================================================
+// scalar kernels for rate categories
+//
+// Each category of a site is computed like a site of the kernels above,
+// so a category of rate one has the same partials as a row without
+// categories.
+
+static void calcLkRowCatsScalar(int seqlen, int ncats,
+                                const floatlk *amats, const floatlk *bmats,
+                                const floatlk *a, const floatlk *b, 
+                                floatlk *c)
+{
+    floatlk amatT[16*LK_MAX_CATS], bmatT[16*LK_MAX_CATS];
+    floatlk prob1[4], prob2[4];
+    for (int r=0; r<ncats; r++) {
+        transposeMatrix(&amats[16*r], &amatT[16*r]);
+        transposeMatrix(&bmats[16*r], &bmatT[16*r]);
+    }
+
+    // v indexes the categories of all sites
+    for (int j=0, v=0; j<seqlen; j++) {
+        for (int r=0; r<ncats; r++, v++) {
+            matVec(&amatT[16*r], &a[4*v], prob1);
+            matVec(&bmatT[16*r], &b[4*v], prob2);
+            for (int k=0; k<4; k++)
+                c[4*v + k] = prob1[k] * prob2[k];
+        }
+    }
+}
+
+
+static void calcDerivLkRowCatsScalar(int seqlen, int ncats, 
+                                     const floatlk *bmats,
+                                     const floatlk *a, const floatlk *b,
+                                     floatlk *c)
+{
+    floatlk bmatT[16*LK_MAX_CATS];
+    floatlk prob2[4];
+    for (int r=0; r<ncats; r++)
+        transposeMatrix(&bmats[16*r], &bmatT[16*r]);
+
+    for (int j=0, v=0; j<seqlen; j++) {
+        for (int r=0; r<ncats; r++, v++) {
+            matVec(&bmatT[16*r], &b[4*v], prob2);
+            for (int k=0; k<4; k++)
+                c[4*v + k] = a[4*v + k] * prob2[k];
+        }
+    }
+}
+
+
+static void calcLkTipRowCatsScalar(int seqlen, int ncats,
+                                   const floatlk *alook, 
+                                   const unsigned char *acodes,
+                                   const floatlk *bmats, const floatlk *b, 
+                                   floatlk *c)
+{
+    for (int j=0, v=0; j<seqlen; j++) {
+        const floatlk *terma = &alook[4 * ncats * acodes[j]];
+        for (int r=0; r<ncats; r++, v++) {
+            const floatlk *termb = &b[4*v];
+            for (int k=0; k<4; k++) {
+                const floatlk *bptr = &bmats[16*r + 4*k];
+                const floatlk prob2 = bptr[0] * termb[0] +
+                                      bptr[1] * termb[1] +
+                                      bptr[2] * termb[2] +
+                                      bptr[3] * termb[3];
+                c[4*v + k] = terma[4*r + k] * prob2;
+            }
+        }
+    }
+}
+
+
+// Terms of a branch with the matrices of mats[n] on the side of a.  A leaf
+// a uses the tip lookups of the three sets of matrices and a leaf b the
+// lookup of the identity (the indicator of the bases of a code).
+static void initBranchSumsCats(int ncats, const floatlk *const *mats,
+                               const unsigned char *acodes, floatlk *looks,
+                               floatlk *bits)
+{
+    const floatlk identity[16] = {1, 0, 0, 0,  0, 1, 0, 0,
+                                  0, 0, 1, 0,  0, 0, 0, 1};
+    calcLkTipLookup(identity, bits);
+    if (acodes)
+        for (int n=0; n<3; n++)
+            calcLkTipLookupCats(ncats, mats[n],
+                                &looks[n * 4*LK_NCODES*LK_MAX_CATS]);
+}
+
+
+static void calcBranchSumsCatsScalar(int seqlen, int ncats,
+                                     const floatlk *const *mats,
+                                     const float *freqs,
+                                     const floatlk *a,
+                                     const unsigned char *acodes,
+                                     const floatlk *b,
+                                     const unsigned char *bcodes,
+                                     floatlk *sums)
+{
+    floatlk matT[3][16*LK_MAX_CATS];
+    floatlk looks[3 * 4*LK_NCODES*LK_MAX_CATS];
+    floatlk bits[4*LK_NCODES];
+    initBranchSumsCats(ncats, mats, acodes, looks, bits);
+    for (int n=0; n<3; n++)
+        for (int r=0; r<ncats; r++)
+            transposeMatrix(&mats[n][16*r], &matT[n][16*r]);
+
+    for (int j=0, v=0; j<seqlen; j++) {
+        double sum[3] = {0.0, 0.0, 0.0};
+
+        for (int r=0; r<ncats; r++, v++) {
+            const floatlk *termb = bcodes ? &bits[4 * bcodes[j]] : &b[4*v];
+            floatlk fb[4];
+            for (int k=0; k<4; k++)
+                fb[k] = freqs[4*r + k] * termb[k];
+
+            for (int n=0; n<3; n++) {
+                floatlk prob[4];
+                const floatlk *terma = prob;
+                if (acodes)
+                    terma = &looks[n * 4*LK_NCODES*LK_MAX_CATS +
+                                   4*(ncats*acodes[j] + r)];
+                else
+                    matVec(&matT[n][16*r], &a[4*v], prob);
+
+                for (int k=0; k<4; k++)
+                    sum[n] += fb[k] * terma[k];
+            }
+        }
+
+        for (int n=0; n<3; n++)
+            sums[3*j + n] = sum[n];
+    }
+}
+
+
+#if defined(SPIDIR_X86_SIMD) && !defined(SPIDIR_SINGLE_LK)
+
+//=============================================================================
+// AVX2 kernels: one site (4 states) per register
+//
+// The matrix-vector product is computed by columns,
+//   P a = sum_x P[.,x] a[x]
+// so that each term is one broadcast and one fused multiply-add.
+
+#define SPIDIR_AVX2 __attribute__((target("avx2,fma")))
+
+SPIDIR_AVX2
+static inline void loadColumns256(const double *mat, __m256d *cols)
+{
+    for (int x=0; x<4; x++)
+        cols[x] = _mm256_set_pd(mat[matind(4, 3, x)], mat[matind(4, 2, x)],
+                                mat[matind(4, 1, x)], mat[matind(4, 0, x)]);
+}
+
+SPIDIR_AVX2
+static inline __m256d matVec256(const __m256d *cols, const floatlk *v)
+{
+    __m256d r = _mm256_mul_pd(cols[0], _mm256_broadcast_sd(&v[0]));
+    r = _mm256_fmadd_pd(cols[1], _mm256_broadcast_sd(&v[1]), r);
+    r = _mm256_fmadd_pd(cols[2], _mm256_broadcast_sd(&v[2]), r);
+    r = _mm256_fmadd_pd(cols[3], _mm256_broadcast_sd(&v[3]), r);
+    return r;
+}
+
+SPIDIR_AVX2
+static void calcLkRowAvx2(int seqlen, const double *amat, const double *bmat,
+                          const floatlk *a, const floatlk *b, floatlk *c)
+{
+    __m256d acols[4], bcols[4];
+    loadColumns256(amat, acols);
+    loadColumns256(bmat, bcols);
+
+    for (int j=0; j<seqlen; j++) {
+        const __m256d prob1 = matVec256(acols, &a[4*j]);
+        const __m256d prob2 = matVec256(bcols, &b[4*j]);
+        _mm256_storeu_pd(&c[4*j], _mm256_mul_pd(prob1, prob2));
+    }
+}
+
+SPIDIR_AVX2
+static void calcDerivLkRowAvx2(int seqlen, const double *bmat,
+                               const floatlk *a, const floatlk *b, floatlk *c)
+{
+    __m256d bcols[4];
+    loadColumns256(bmat, bcols);
+
+    for (int j=0; j<seqlen; j++) {
+        const __m256d prob2 = matVec256(bcols, &b[4*j]);
+        _mm256_storeu_pd(&c[4*j],
+                         _mm256_mul_pd(_mm256_loadu_pd(&a[4*j]), prob2));
+    }
+}
+
+SPIDIR_AVX2
+static void calcLkTipRowAvx2(int seqlen, const double *alook,
+                             const unsigned char *acodes,
+                             const double *bmat, const double *b, double *c)
+{
+    __m256d bcols[4];
+    loadColumns256(bmat, bcols);
+
+    for (int j=0; j<seqlen; j++) {
+        const __m256d prob2 = matVec256(bcols, &b[4*j]);
+        _mm256_storeu_pd(
+            &c[4*j],
+            _mm256_mul_pd(_mm256_loadu_pd(&alook[4 * acodes[j]]), prob2));
+    }
+}
+
+// rate categories: one category per register, with the columns of all
+// categories kept in an array
+SPIDIR_AVX2
+static void calcLkRowCatsAvx2(int seqlen, int ncats,
+                              const double *amats, const double *bmats,
+                              const floatlk *a, const floatlk *b, floatlk *c)
+{
+    __m256d acols[4*LK_MAX_CATS], bcols[4*LK_MAX_CATS];
+    for (int r=0; r<ncats; r++) {
+        loadColumns256(&amats[16*r], &acols[4*r]);
+        loadColumns256(&bmats[16*r], &bcols[4*r]);
+    }
+
+    for (int j=0, v=0; j<seqlen; j++) {
+        for (int r=0; r<ncats; r++, v++) {
+            const __m256d prob1 = matVec256(&acols[4*r], &a[4*v]);
+            const __m256d prob2 = matVec256(&bcols[4*r], &b[4*v]);
+            _mm256_storeu_pd(&c[4*v], _mm256_mul_pd(prob1, prob2));
+        }
+    }
+}
+
+SPIDIR_AVX2
+static void calcDerivLkRowCatsAvx2(int seqlen, int ncats, const double *bmats,
+                                   const floatlk *a, const floatlk *b,
+                                   floatlk *c)
+{
+    __m256d bcols[4*LK_MAX_CATS];
+    for (int r=0; r<ncats; r++)
+        loadColumns256(&bmats[16*r], &bcols[4*r]);
+
+    for (int j=0, v=0; j<seqlen; j++) {
+        for (int r=0; r<ncats; r++, v++) {
+            const __m256d prob2 = matVec256(&bcols[4*r], &b[4*v]);
+            _mm256_storeu_pd(&c[4*v],
+                             _mm256_mul_pd(_mm256_loadu_pd(&a[4*v]), prob2));
+        }
+    }
+}
+
+SPIDIR_AVX2
+static void calcLkTipRowCatsAvx2(int seqlen, int ncats, const double *alook,
+                                 const unsigned char *acodes,
+                                 const double *bmats, const double *b, 
+                                 double *c)
+{
+    __m256d bcols[4*LK_MAX_CATS];
+    for (int r=0; r<ncats; r++)
+        loadColumns256(&bmats[16*r], &bcols[4*r]);
+
+    for (int j=0, v=0; j<seqlen; j++) {
+        const double *terma = &alook[4 * ncats * acodes[j]];
+        for (int r=0; r<ncats; r++, v++) {
+            const __m256d prob2 = matVec256(&bcols[4*r], &b[4*v]);
+            _mm256_storeu_pd(
+                &c[4*v],
+                _mm256_mul_pd(_mm256_loadu_pd(&terma[4*r]), prob2));
+        }
+    }
+}
+
+
+// sum of the four lanes
+SPIDIR_AVX2
+static inline double sumLanes256(__m256d x)
+{
+    const __m128d half = _mm_add_pd(_mm256_castpd256_pd128(x),
+                                    _mm256_extractf128_pd(x, 1));
+    return _mm_cvtsd_f64(_mm_add_sd(half, _mm_unpackhi_pd(half, half)));
+}
+
+// the three matrix products of a category share the weights f_r b_r and
+// are summed in three registers (also used with the AVX-512 kernels)
+SPIDIR_AVX2
+static void calcBranchSumsCatsAvx2(int seqlen, int ncats,
+                                   const double *const *mats,
+                                   const float *freqs,
+                                   const double *a,
+                                   const unsigned char *acodes,
+                                   const double *b,
+                                   const unsigned char *bcodes,
+                                   double *sums)
+{
+    __m256d cols[3][4*LK_MAX_CATS];
+    __m256d fr[LK_MAX_CATS];
+    double looks[3 * 4*LK_NCODES*LK_MAX_CATS];
+    double bits[4*LK_NCODES];
+    initBranchSumsCats(ncats, mats, acodes, looks, bits);
+    for (int r=0; r<ncats; r++) {
+        for (int n=0; n<3; n++)
+            loadColumns256(&mats[n][16*r], &cols[n][4*r]);
+        fr[r] = _mm256_cvtps_pd(_mm_loadu_ps(&freqs[4*r]));
+    }
+
+    for (int j=0, v=0; j<seqlen; j++) {
+        __m256d sum[3] = {_mm256_setzero_pd(), _mm256_setzero_pd(),
+                          _mm256_setzero_pd()};
+
+        for (int r=0; r<ncats; r++, v++) {
+            const double *termb = bcodes ? &bits[4 * bcodes[j]] : &b[4*v];
+            const __m256d fb = _mm256_mul_pd(fr[r], _mm256_loadu_pd(termb));
+
+            for (int n=0; n<3; n++) {
+                const __m256d terma = acodes ?
+                    _mm256_loadu_pd(&looks[n * 4*LK_NCODES*LK_MAX_CATS +
+                                           4*(ncats*acodes[j] + r)]) :
+                    matVec256(&cols[n][4*r], &a[4*v]);
+                sum[n] = _mm256_fmadd_pd(fb, terma, sum[n]);
+            }
+        }
+
+        for (int n=0; n<3; n++)
+            sums[3*j + n] = sumLanes256(sum[n]);
+    }
+}
+
+//=============================================================================
+// AVX-512 kernels: two sites per register
+//
+// Each 256-bit half of a register holds one site.  The per-site
+// broadcast of state x is done with an in-lane permute.
+
+#define SPIDIR_AVX512 __attribute__((target("avx512f")))
+
+SPIDIR_AVX512
+static inline void loadColumns512(const double *mat, __m512d *cols)
+{
+    for (int x=0; x<4; x++) {
+        const double c0 = mat[matind(4, 0, x)], c1 = mat[matind(4, 1, x)],
+                     c2 = mat[matind(4, 2, x)], c3 = mat[matind(4, 3, x)];
+        cols[x] = _mm512_set_pd(c3, c2, c1, c0, c3, c2, c1, c0);
+    }
+}
+
+// The unmasked _mm512_permutexvar_pd passes an undefined register to its
+// builtin, which gcc reports as maybe uninitialized.  All lanes are
+// permuted here, so the masked form with v as the source is the same.
+SPIDIR_AVX512
+static inline __m512d broadcastState512(__m512i idx, __m512d v)
+{
+    return _mm512_mask_permutexvar_pd(v, 0xFF, idx, v);
+}
+
+SPIDIR_AVX512
+static inline __m512d matVec512(const __m512d *cols, const __m512i *idx,
+                                __m512d v)
+{
+    __m512d r = _mm512_mul_pd(cols[0], broadcastState512(idx[0], v));
+    r = _mm512_fmadd_pd(cols[1], broadcastState512(idx[1], v), r);
+    r = _mm512_fmadd_pd(cols[2], broadcastState512(idx[2], v), r);
+    r = _mm512_fmadd_pd(cols[3], broadcastState512(idx[3], v), r);
+    return r;
+}
+
+SPIDIR_AVX512
+static inline void loadBroadcastIndex512(__m512i *idx)
+{
+    for (int x=0; x<4; x++)
+        idx[x] = _mm512_set_epi64(4+x, 4+x, 4+x, 4+x, x, x, x, x);
+}
+
+SPIDIR_AVX512
+static void calcLkRowAvx512(int seqlen, const double *amat, const double *bmat,
+                            const floatlk *a, const floatlk *b, floatlk *c)
+{
+    __m512d acols[4], bcols[4];
+    __m512i idx[4];
+    loadColumns512(amat, acols);
+    loadColumns512(bmat, bcols);
+    loadBroadcastIndex512(idx);
+
+    int j = 0;
+    for (; j+1<seqlen; j+=2) {
+        const __m512d prob1 = matVec512(acols, idx, _mm512_loadu_pd(&a[4*j]));
+        const __m512d prob2 = matVec512(bcols, idx, _mm512_loadu_pd(&b[4*j]));
+        _mm512_storeu_pd(&c[4*j], _mm512_mul_pd(prob1, prob2));
+    }
+
+    // odd site
+    if (j < seqlen) {
+        const __mmask8 half = 0x0F;
+        const __m512d prob1 = matVec512(
+            acols, idx, _mm512_maskz_loadu_pd(half, &a[4*j]));
+        const __m512d prob2 = matVec512(
+            bcols, idx, _mm512_maskz_loadu_pd(half, &b[4*j]));
+        _mm512_mask_storeu_pd(&c[4*j], half, _mm512_mul_pd(prob1, prob2));
+    }
+}
+
+SPIDIR_AVX512
+static void calcDerivLkRowAvx512(int seqlen, const double *bmat,
+                                 const floatlk *a, const floatlk *b,
+                                 floatlk *c)
+{
+    __m512d bcols[4];
+    __m512i idx[4];
+    loadColumns512(bmat, bcols);
+    loadBroadcastIndex512(idx);
+
+    int j = 0;
+    for (; j+1<seqlen; j+=2) {
+        const __m512d prob2 = matVec512(bcols, idx, _mm512_loadu_pd(&b[4*j]));
+        _mm512_storeu_pd(&c[4*j],
+                         _mm512_mul_pd(_mm512_loadu_pd(&a[4*j]), prob2));
+    }
+
+    // odd site
+    if (j < seqlen) {
+        const __mmask8 half = 0x0F;
+        const __m512d prob2 = matVec512(
+            bcols, idx, _mm512_maskz_loadu_pd(half, &b[4*j]));
+        _mm512_mask_storeu_pd(
+            &c[4*j], half,
+            _mm512_mul_pd(_mm512_maskz_loadu_pd(half, &a[4*j]), prob2));
+    }
+}
+
+SPIDIR_AVX512
+static void calcLkTipRowAvx512(int seqlen, const double *alook,
+                               const unsigned char *acodes,
+                               const double *bmat, const double *b, 
+                               double *c)
+{
+    __m512d bcols[4];
+    __m512i idx[4];
+    loadColumns512(bmat, bcols);
+    loadBroadcastIndex512(idx);
+
+    int j = 0;
+    for (; j+1<seqlen; j+=2) {
+        const __m512d prob1 = _mm512_maskz_insertf64x4(
+            0xFF, 
+            _mm512_castpd256_pd512(_mm256_loadu_pd(&alook[4 * acodes[j]])),
+            _mm256_loadu_pd(&alook[4 * acodes[j+1]]), 1);
+        const __m512d prob2 = matVec512(bcols, idx, _mm512_loadu_pd(&b[4*j]));
+        _mm512_storeu_pd(&c[4*j], _mm512_mul_pd(prob1, prob2));
+    }
+
+    // odd site
+    if (j < seqlen) {
+        const __mmask8 half = 0x0F;
+        const __m512d prob1 = _mm512_maskz_loadu_pd(half, &alook[4*acodes[j]]);
+        const __m512d prob2 = matVec512(
+            bcols, idx, _mm512_maskz_loadu_pd(half, &b[4*j]));
+        _mm512_mask_storeu_pd(&c[4*j], half, _mm512_mul_pd(prob1, prob2));
+    }
+}
+
+
+// Rate categories: the categories of a site are taken two at a time, 
+// category 2p in the low half of a register and 2p+1 in the high half.
+// With an odd number of categories the last register is half full.
+
+// columns of the pairs of categories of mats
+SPIDIR_AVX512
+static inline void loadColumnPairs512(int ncats, const double *mats, 
+                                      __m512d *cols)
+{
+    for (int p=0; 2*p<ncats; p++) {
+        const double *lo = &mats[32*p];
+        const double *hi = (2*p+1 < ncats) ? lo + 16 : lo;
+        for (int x=0; x<4; x++)
+            cols[4*p + x] = _mm512_set_pd(
+                hi[matind(4, 3, x)], hi[matind(4, 2, x)],
+                hi[matind(4, 1, x)], hi[matind(4, 0, x)],
+                lo[matind(4, 3, x)], lo[matind(4, 2, x)],
+                lo[matind(4, 1, x)], lo[matind(4, 0, x)]);
+    }
+}
+
+SPIDIR_AVX512
+static void calcLkRowCatsAvx512(int seqlen, int ncats,
+                                const double *amats, const double *bmats,
+                                const floatlk *a, const floatlk *b, 
+                                floatlk *c)
+{
+    __m512d acols[2*LK_MAX_CATS], bcols[2*LK_MAX_CATS];
+    __m512i idx[4];
+    loadColumnPairs512(ncats, amats, acols);
+    loadColumnPairs512(ncats, bmats, bcols);
+    loadBroadcastIndex512(idx);
+    const int npairs = ncats / 2;
+    const __mmask8 half = 0x0F;
+
+    for (int j=0; j<seqlen; j++) {
+        const int s = 4 * ncats * j;
+        int p = 0;
+        for (; p<npairs; p++) {
+            const __m512d prob1 = matVec512(&acols[4*p], idx, 
+                                            _mm512_loadu_pd(&a[s + 8*p]));
+            const __m512d prob2 = matVec512(&bcols[4*p], idx, 
+                                            _mm512_loadu_pd(&b[s + 8*p]));
+            _mm512_storeu_pd(&c[s + 8*p], _mm512_mul_pd(prob1, prob2));
+        }
+
+        // odd category
+        if (2*p < ncats) {
+            const __m512d prob1 = matVec512(
+                &acols[4*p], idx, _mm512_maskz_loadu_pd(half, &a[s + 8*p]));
+            const __m512d prob2 = matVec512(
+                &bcols[4*p], idx, _mm512_maskz_loadu_pd(half, &b[s + 8*p]));
+            _mm512_mask_storeu_pd(&c[s + 8*p], half, 
+                                  _mm512_mul_pd(prob1, prob2));
+        }
+    }
+}
+
+SPIDIR_AVX512
+static void calcDerivLkRowCatsAvx512(int seqlen, int ncats, 
+                                     const double *bmats,
+                                     const floatlk *a, const floatlk *b,
+                                     floatlk *c)
+{
+    __m512d bcols[2*LK_MAX_CATS];
+    __m512i idx[4];
+    loadColumnPairs512(ncats, bmats, bcols);
+    loadBroadcastIndex512(idx);
+    const int npairs = ncats / 2;
+    const __mmask8 half = 0x0F;
+
+    for (int j=0; j<seqlen; j++) {
+        const int s = 4 * ncats * j;
+        int p = 0;
+        for (; p<npairs; p++) {
+            const __m512d prob2 = matVec512(&bcols[4*p], idx, 
+                                            _mm512_loadu_pd(&b[s + 8*p]));
+            _mm512_storeu_pd(
+                &c[s + 8*p],
+                _mm512_mul_pd(_mm512_loadu_pd(&a[s + 8*p]), prob2));
+        }
+
+        // odd category
+        if (2*p < ncats) {
+            const __m512d prob2 = matVec512(
+                &bcols[4*p], idx, _mm512_maskz_loadu_pd(half, &b[s + 8*p]));
+            _mm512_mask_storeu_pd(
+                &c[s + 8*p], half,
+                _mm512_mul_pd(_mm512_maskz_loadu_pd(half, &a[s + 8*p]), 
+                              prob2));
+        }
+    }
+}
+
+SPIDIR_AVX512
+static void calcLkTipRowCatsAvx512(int seqlen, int ncats, 
+                                   const double *alook,
+                                   const unsigned char *acodes,
+                                   const double *bmats, const double *b, 
+                                   double *c)
+{
+    __m512d bcols[2*LK_MAX_CATS];
+    __m512i idx[4];
+    loadColumnPairs512(ncats, bmats, bcols);
+    loadBroadcastIndex512(idx);
+    const int npairs = ncats / 2;
+    const __mmask8 half = 0x0F;
+
+    for (int j=0; j<seqlen; j++) {
+        const int s = 4 * ncats * j;
+        const double *terma = &alook[4 * ncats * acodes[j]];
+        int p = 0;
+        for (; p<npairs; p++) {
+            const __m512d prob2 = matVec512(&bcols[4*p], idx, 
+                                            _mm512_loadu_pd(&b[s + 8*p]));
+            _mm512_storeu_pd(
+                &c[s + 8*p],
+                _mm512_mul_pd(_mm512_loadu_pd(&terma[8*p]), prob2));
+        }
+
+        // odd category
+        if (2*p < ncats) {
+            const __m512d prob2 = matVec512(
+                &bcols[4*p], idx, _mm512_maskz_loadu_pd(half, &b[s + 8*p]));
+            _mm512_mask_storeu_pd(
+                &c[s + 8*p], half,
+                _mm512_mul_pd(_mm512_maskz_loadu_pd(half, &terma[8*p]), 
+                              prob2));
+        }
+    }
+}
+
+#endif // SPIDIR_X86_SIMD && !SPIDIR_SINGLE_LK
+
+
+#if defined(SPIDIR_X86_SIMD) && defined(SPIDIR_SINGLE_LK)
+
+//=============================================================================
+// single precision AVX2 kernels: two sites per register
+//
+// Each 128-bit lane holds one site, so the broadcast of state x within
+// a site is an in-lane shuffle.
+
+#define SPIDIR_AVX2 __attribute__((target("avx2,fma")))
+
+SPIDIR_AVX2
+static inline void loadColumns256(const float *mat, __m256 *cols)
+{
+    for (int x=0; x<4; x++) {
+        const float c0 = mat[matind(4, 0, x)], c1 = mat[matind(4, 1, x)],
+                    c2 = mat[matind(4, 2, x)], c3 = mat[matind(4, 3, x)];
+        cols[x] = _mm256_set_ps(c3, c2, c1, c0, c3, c2, c1, c0);
+    }
+}
+
+SPIDIR_AVX2
+static inline __m256 matVec256(const __m256 *cols, __m256 v)
+{
+    __m256 r = _mm256_mul_ps(cols[0], _mm256_permute_ps(v, 0x00));
+    r = _mm256_fmadd_ps(cols[1], _mm256_permute_ps(v, 0x55), r);
+    r = _mm256_fmadd_ps(cols[2], _mm256_permute_ps(v, 0xAA), r);
+    r = _mm256_fmadd_ps(cols[3], _mm256_permute_ps(v, 0xFF), r);
+    return r;
+}
+
+// load one site into the low lane
+SPIDIR_AVX2
+static inline __m256 loadSite256(const float *v)
+{
+    return _mm256_insertf128_ps(_mm256_setzero_ps(), _mm_loadu_ps(v), 0);
+}
+
+SPIDIR_AVX2
+static void calcLkRowAvx2(int seqlen, const float *amat, const float *bmat,
+                          const float *a, const float *b, float *c)
+{
+    __m256 acols[4], bcols[4];
+    loadColumns256(amat, acols);
+    loadColumns256(bmat, bcols);
+
+    int j = 0;
+    for (; j+1<seqlen; j+=2) {
+        const __m256 prob1 = matVec256(acols, _mm256_loadu_ps(&a[4*j]));
+        const __m256 prob2 = matVec256(bcols, _mm256_loadu_ps(&b[4*j]));
+        _mm256_storeu_ps(&c[4*j], _mm256_mul_ps(prob1, prob2));
+    }
+
+    // odd site
+    if (j < seqlen) {
+        const __m256 prob1 = matVec256(acols, loadSite256(&a[4*j]));
+        const __m256 prob2 = matVec256(bcols, loadSite256(&b[4*j]));
+        _mm_storeu_ps(&c[4*j], 
+                      _mm256_castps256_ps128(_mm256_mul_ps(prob1, prob2)));
+    }
+}
+
+SPIDIR_AVX2
+static void calcDerivLkRowAvx2(int seqlen, const float *bmat,
+                               const float *a, const float *b, float *c)
+{
+    __m256 bcols[4];
+    loadColumns256(bmat, bcols);
+
+    int j = 0;
+    for (; j+1<seqlen; j+=2) {
+        const __m256 prob2 = matVec256(bcols, _mm256_loadu_ps(&b[4*j]));
+        _mm256_storeu_ps(&c[4*j],
+                         _mm256_mul_ps(_mm256_loadu_ps(&a[4*j]), prob2));
+    }
+
+    // odd site
+    if (j < seqlen) {
+        const __m256 prob2 = matVec256(bcols, loadSite256(&b[4*j]));
+        _mm_storeu_ps(&c[4*j], 
+                      _mm_mul_ps(_mm_loadu_ps(&a[4*j]),
+                                 _mm256_castps256_ps128(prob2)));
+    }
+}
+
+SPIDIR_AVX2
+static void calcLkTipRowAvx2(int seqlen, const float *alook,
+                             const unsigned char *acodes,
+                             const float *bmat, const float *b, float *c)
+{
+    __m256 bcols[4];
+    loadColumns256(bmat, bcols);
+
+    int j = 0;
+    for (; j+1<seqlen; j+=2) {
+        const __m256 prob1 = _mm256_insertf128_ps(
+            _mm256_castps128_ps256(_mm_loadu_ps(&alook[4 * acodes[j]])),
+            _mm_loadu_ps(&alook[4 * acodes[j+1]]), 1);
+        const __m256 prob2 = matVec256(bcols, _mm256_loadu_ps(&b[4*j]));
+        _mm256_storeu_ps(&c[4*j], _mm256_mul_ps(prob1, prob2));
+    }
+
+    // odd site
+    if (j < seqlen) {
+        const __m256 prob2 = matVec256(bcols, loadSite256(&b[4*j]));
+        _mm_storeu_ps(&c[4*j], 
+                      _mm_mul_ps(_mm_loadu_ps(&alook[4 * acodes[j]]),
+                                 _mm256_castps256_ps128(prob2)));
+    }
+}
+
+
+//=============================================================================
+// single precision AVX-512 kernels: four sites per register
+
+#define SPIDIR_AVX512 __attribute__((target("avx512f")))
+
+// As in the double precision kernels, the masked forms of the permutes
+// (with every lane selected) avoid an undefined register.
+SPIDIR_AVX512
+static inline void loadColumns512(const float *mat, __m512 *cols)
+{
+    for (int x=0; x<4; x++)
+        cols[x] = _mm512_maskz_broadcast_f32x4(
+            0xFFFF,
+            _mm_set_ps(mat[matind(4, 3, x)], mat[matind(4, 2, x)],
+                       mat[matind(4, 1, x)], mat[matind(4, 0, x)]));
+}
+
+SPIDIR_AVX512
+static inline __m512 matVec512(const __m512 *cols, __m512 v)
+{
+    const __mmask16 all = 0xFFFF;
+    __m512 r = _mm512_mul_ps(cols[0], 
+                             _mm512_mask_permute_ps(v, all, v, 0x00));
+    r = _mm512_fmadd_ps(cols[1], _mm512_mask_permute_ps(v, all, v, 0x55), r);
+    r = _mm512_fmadd_ps(cols[2], _mm512_mask_permute_ps(v, all, v, 0xAA), r);
+    r = _mm512_fmadd_ps(cols[3], _mm512_mask_permute_ps(v, all, v, 0xFF), r);
+    return r;
+}
+
+SPIDIR_AVX512
+static void calcLkRowAvx512(int seqlen, const float *amat, const float *bmat,
+                            const float *a, const float *b, float *c)
+{
+    __m512 acols[4], bcols[4];
+    loadColumns512(amat, acols);
+    loadColumns512(bmat, bcols);
+
+    int j = 0;
+    for (; j+3<seqlen; j+=4) {
+        const __m512 prob1 = matVec512(acols, _mm512_loadu_ps(&a[4*j]));
+        const __m512 prob2 = matVec512(bcols, _mm512_loadu_ps(&b[4*j]));
+        _mm512_storeu_ps(&c[4*j], _mm512_mul_ps(prob1, prob2));
+    }
+
+    // remaining sites
+    if (j < seqlen) {
+        const __mmask16 rest = (1 << (4 * (seqlen - j))) - 1;
+        const __m512 prob1 = matVec512(
+            acols, _mm512_maskz_loadu_ps(rest, &a[4*j]));
+        const __m512 prob2 = matVec512(
+            bcols, _mm512_maskz_loadu_ps(rest, &b[4*j]));
+        _mm512_mask_storeu_ps(&c[4*j], rest, _mm512_mul_ps(prob1, prob2));
+    }
+}
+
+SPIDIR_AVX512
+static void calcDerivLkRowAvx512(int seqlen, const float *bmat,
+                                 const float *a, const float *b, float *c)
+{
+    __m512 bcols[4];
+    loadColumns512(bmat, bcols);
+
+    int j = 0;
+    for (; j+3<seqlen; j+=4) {
+        const __m512 prob2 = matVec512(bcols, _mm512_loadu_ps(&b[4*j]));
+        _mm512_storeu_ps(&c[4*j],
+                         _mm512_mul_ps(_mm512_loadu_ps(&a[4*j]), prob2));
+    }
+
+    // remaining sites
+    if (j < seqlen) {
+        const __mmask16 rest = (1 << (4 * (seqlen - j))) - 1;
+        const __m512 prob2 = matVec512(
+            bcols, _mm512_maskz_loadu_ps(rest, &b[4*j]));
+        _mm512_mask_storeu_ps(
+            &c[4*j], rest,
+            _mm512_mul_ps(_mm512_maskz_loadu_ps(rest, &a[4*j]), prob2));
+    }
+}
+
+SPIDIR_AVX512
+static void calcLkTipRowAvx512(int seqlen, const float *alook,
+                               const unsigned char *acodes,
+                               const float *bmat, const float *b, float *c)
+{
+    __m512 bcols[4];
+    loadColumns512(bmat, bcols);
+
+    int j = 0;
+    for (; j+3<seqlen; j+=4) {
+        __m512 prob1 = _mm512_castps128_ps512(
+            _mm_loadu_ps(&alook[4 * acodes[j]]));
+        prob1 = _mm512_maskz_insertf32x4(
+            0xFFFF, prob1, _mm_loadu_ps(&alook[4 * acodes[j+1]]), 1);
+        prob1 = _mm512_maskz_insertf32x4(
+            0xFFFF, prob1, _mm_loadu_ps(&alook[4 * acodes[j+2]]), 2);
+        prob1 = _mm512_maskz_insertf32x4(
+            0xFFFF, prob1, _mm_loadu_ps(&alook[4 * acodes[j+3]]), 3);
+        const __m512 prob2 = matVec512(bcols, _mm512_loadu_ps(&b[4*j]));
+        _mm512_storeu_ps(&c[4*j], _mm512_mul_ps(prob1, prob2));
+    }
+
+    // remaining sites
+    calcLkTipRowScalar(seqlen - j, alook, &acodes[j], bmat, &b[4*j], &c[4*j]);
+}
+
+#endif // SPIDIR_X86_SIMD && SPIDIR_SINGLE_LK
+
+
+//=============================================================================
+// tip lookups
+
+void calcLkTipLookup(const floatlk *mat, floatlk *look)
+{
+    for (int k=0; k<4; k++) {
+        const floatlk *row = &mat[4*k];
+
+        // sum in the same order as the full product, so that the result
+        // is the same as for the expanded leaf
+        for (int m=0; m<LK_NCODES; m++) {
+            floatlk sum = 0.0;
+            for (int x=0; x<4; x++)
+                if (m & (1 << x))
+                    sum += row[x];
+            look[4*m + k] = sum;
+        }
+    }
+}
+
+
+void calcLkTipTipRow(int seqlen, 
+                     const floatlk *alook, const unsigned char *acodes,
+                     const floatlk *blook, const unsigned char *bcodes,
+                     floatlk *c)
+{
+    for (int j=0; j<seqlen; j++) {
+        const floatlk *terma = &alook[4 * acodes[j]];
+        const floatlk *termb = &blook[4 * bcodes[j]];
+        for (int k=0; k<4; k++)
+            c[matind(4, j, k)] = terma[k] * termb[k];
+    }
+}
+
+
+void calcLkTipLookupCats(int ncats, const floatlk *mats, floatlk *look)
+{
+    if (ncats == 1) {
+        calcLkTipLookup(mats, look);
+        return;
+    }
+
+    floatlk catlook[4*LK_NCODES];
+    for (int r=0; r<ncats; r++) {
+        calcLkTipLookup(&mats[16*r], catlook);
+        for (int m=0; m<LK_NCODES; m++)
+            for (int k=0; k<4; k++)
+                look[4*(ncats*m + r) + k] = catlook[4*m + k];
+    }
+}
+
+
+void calcLkTipTipRowCats(int seqlen, int ncats,
+                         const floatlk *alook, const unsigned char *acodes,
+                         const floatlk *blook, const unsigned char *bcodes,
+                         floatlk *c)
+{
+    const int width = 4 * ncats;
+    for (int j=0; j<seqlen; j++) {
+        const floatlk *terma = &alook[width * acodes[j]];
+        const floatlk *termb = &blook[width * bcodes[j]];
+        floatlk *row = &c[matind(width, j, 0)];
+        for (int k=0; k<width; k++)
+            row[k] = terma[k] * termb[k];
+    }
+}
+
+
+//=============================================================================
+// scaling
+
+// largest partial of a site.  When the width is a multiple of 4 (rate
+// categories) there are four running maxima, which vectorize.
+static inline floatlk maxLkSite(const floatlk *row, int width)
+{
+    if (width % 4 != 0) {
+        floatlk top = row[0];
+        for (int k=1; k<width; k++)
+            if (row[k] > top)
+                top = row[k];
+        return top;
+    }
+
+    floatlk top[4] = {row[0], row[1], row[2], row[3]};
+    for (int k=4; k<width; k+=4)
+        for (int i=0; i<4; i++)
+            if (row[k + i] > top[i])
+                top[i] = row[k + i];
+    return max(max(top[0], top[1]), max(top[2], top[3]));
+}
+
+
+// rescale the sites of a row with width partials per site
+static inline void rescaleLkRowWidth(int seqlen, int width, floatlk *c, 
+                                     const int *scalea, const int *scaleb, 
+                                     int *scalec)
+{
+    const floatlk minval = ldexp(1.0, -LK_SCALE_EXP);
+    const floatlk factor = ldexp(1.0, LK_SCALE_EXP);
+
+    for (int j=0; j<seqlen; j++) {
+        floatlk *row = &c[matind(width, j, 0)];
+        int scale = scalea[j] + scaleb[j];
+
+        floatlk top = maxLkSite(row, width);
+
+        // multiplying by a power of two is exact
+        while (top < minval && top > 0.0) {
+            for (int k=0; k<width; k++)
+                row[k] *= factor;
+            top *= factor;
+            scale++;
+        }
+
+        scalec[j] = scale;
+    }
+}
+
+
+void rescaleLkRow(int seqlen, floatlk *c, 
+                  const int *scalea, const int *scaleb, int *scalec)
+{
+    rescaleLkRowWidth(seqlen, 4, c, scalea, scaleb, scalec);
+}
+
+
+void rescaleLkRowCats(int seqlen, int ncats, floatlk *c,
+                      const int *scalea, const int *scaleb, int *scalec)
+{
+    rescaleLkRowWidth(seqlen, 4 * ncats, c, scalea, scaleb, scalec);
+}
+
+
+//=============================================================================
+// log likelihood of a root row
+//
+// Instead of one log per site, the site probabilities are multiplied 
+// together.  Each probability is split into a mantissa in [0.5, 1) and a
+// power of two, and only the mantissas are multiplied.  The powers of two
+// (and the scale counts) are summed as integers.  A product of mantissas 
+// with total weight n is at least 2^-n, so the product only needs a log 
+// (and a restart) every LK_LOG_MAXPOW units of weight.
+
+// largest total weight of one product (2^-LK_LOG_MAXPOW is a normal double)
+const int LK_LOG_MAXPOW = 1000;
+
+
+// x = m * 2^e with m in [0.5, 1), for normal positive x
+static inline double splitExp(double x, int *e)
+{
+    unsigned long long bits;
+    memcpy(&bits, &x, sizeof(bits));
+    *e = int((bits >> 52) & 0x7ff) - 1022;
+    bits = (bits & ~(0x7ffULL << 52)) | (1022ULL << 52);
+    memcpy(&x, &bits, sizeof(bits));
+    return x;
+}
+
+
+// x^n for n >= 1
+static inline double powInt(double x, int n)
+{
+    double r = 1.0;
+    while (true) {
+        if (n & 1)
+            r *= x;
+        n >>= 1;
+        if (!n)
+            return r;
+        x *= x;
+    }
+}
+
+
+// log likelihood of a root row with width partials per site
+static inline double calcLogLkRowWidth(int seqlen, int width, 
+                                       const floatlk *c, const int *scalec,
+                                       const float *bgfreq, 
+                                       const int *weights)
+{
+    const double LOG2 = 0.69314718055994530942;
+    double logl = 0.0;
+    long long exps = 0;
+    double prod = 1.0;
+    int budget = 0;
+
+    for (int j=0; j<seqlen; j++) {
+        const floatlk *row = &c[matind(width, j, 0)];
+        double prob = 0.0;
+        for (int k=0; k<width; k++)
+            prob += bgfreq[k] * row[k];
+        const int w = weights ? weights[j] : 1;
+        if (w == 0)
+            continue;
+        if (scalec)
+            exps -= (long long) w * scalec[j] * LK_SCALE_EXP;
+
+        // zero, infinite, subnormal or heavy sites use log directly
+        if (!(prob >= DBL_MIN && prob <= DBL_MAX) || w > LK_LOG_MAXPOW) {
+            logl += w * log(prob);
+            continue;
+        }
+
+        if (budget + w > LK_LOG_MAXPOW) {
+            logl += log(prod);
+            prod = 1.0;
+            budget = 0;
+        }
+
+        // prob^w = m^w * 2^(e*w)
+        int e;
+        const double m = splitExp(prob, &e);
+        prod *= (w == 1) ? m : powInt(m, w);
+        exps += (long long) e * w;
+        budget += w;
+    }
+
+    return logl + log(prod) + exps * LOG2;
+}
+
+
+double calcLogLkRow(int seqlen, const floatlk *c, const int *scalec,
+                    const float *bgfreq, const int *weights)
+{
+    return calcLogLkRowWidth(seqlen, 4, c, scalec, bgfreq, weights);
+}
+
+
+double calcLogLkRowCats(int seqlen, int ncats, const floatlk *c,
+                        const int *scalec, const float *freqs,
+                        const int *weights)
+{
+    return calcLogLkRowWidth(seqlen, 4 * ncats, c, scalec, freqs, weights);
+}
+
+
+//=============================================================================
+// aligned buffers
+
+bool AlignedBuffer::useHugePages = false;
+
+static const size_t HUGE_PAGE_SIZE = 2 << 20;
+
+
+AlignedBuffer::~AlignedBuffer()
+{
+    free(data);
+}
+
+
+void *AlignedBuffer::reserve(size_t size)
+{
+    if (size <= capacity)
+        return data;
+
+    release();
+
+    size_t align = LK_ALIGN;
+    const bool huge = useHugePages && size >= HUGE_PAGE_SIZE;
+    if (huge) {
+        align = HUGE_PAGE_SIZE;
+        size = (size + HUGE_PAGE_SIZE - 1) / HUGE_PAGE_SIZE * HUGE_PAGE_SIZE;
+    }
+
+    if (posix_memalign(&data, align, size) != 0) {
+        data = NULL;
+        throw std::bad_alloc();
+    }
+#ifdef MADV_HUGEPAGE
+    if (huge)
+        madvise(data, size, MADV_HUGEPAGE);
+#endif
+    capacity = size;
+
+    return data;
+}
+
+
+void AlignedBuffer::release()
+{
+    free(data);
+    data = NULL;
+    capacity = 0;
+}
+
+
+static size_t detectL2CacheSize()
+{
+    size_t size = 0;
+#ifdef _SC_LEVEL2_CACHE_SIZE
+    long n = sysconf(_SC_LEVEL2_CACHE_SIZE);
+    if (n > 0)
+        size = n;
+#endif
+
+    // not reported by libc, ask the kernel
+    if (size == 0) {
+        FILE *infile =
+            fopen("/sys/devices/system/cpu/cpu0/cache/index2/size", "r");
+        if (infile) {
+            unsigned long kb;
+            if (fscanf(infile, "%luK", &kb) == 1)
+                size = kb << 10;
+            fclose(infile);
+        }
+    }
+
+    if (size == 0)
+        size = 256 << 10;
+    return size;
+}
+
+
+//=============================================================================
+// runtime dispatch
+
+typedef void (*LkRowFunc)(int seqlen, const floatlk *amat, const floatlk *bmat,
+                          const floatlk *a, const floatlk *b, floatlk *c);
+typedef void (*DerivLkRowFunc)(int seqlen, const floatlk *bmat,
+                               const floatlk *a, const floatlk *b,
+                               floatlk *c);
+typedef void (*LkTipRowFunc)(int seqlen, const floatlk *alook, 
+                             const unsigned char *acodes,
+                             const floatlk *bmat, const floatlk *b, 
+                             floatlk *c);
+
+typedef void (*LkRowCatsFunc)(int seqlen, int ncats, 
+                              const floatlk *amats, const floatlk *bmats,
+                              const floatlk *a, const floatlk *b, 
+                              floatlk *c);
+typedef void (*DerivLkRowCatsFunc)(int seqlen, int ncats, 
+                                   const floatlk *bmats,
+                                   const floatlk *a, const floatlk *b,
+                                   floatlk *c);
+typedef void (*LkTipRowCatsFunc)(int seqlen, int ncats, const floatlk *alook,
+                                 const unsigned char *acodes,
+                                 const floatlk *bmats, const floatlk *b, 
+                                 floatlk *c);
+typedef void (*BranchSumsCatsFunc)(int seqlen, int ncats,
+                                   const floatlk *const *mats,
+                                   const float *freqs,
+                                   const floatlk *a,
+                                   const unsigned char *acodes,
+                                   const floatlk *b,
+                                   const unsigned char *bcodes,
+                                   floatlk *sums);
+
+static const char *g_kernelNames[] = {"scalar", "avx2", "avx512"};
+static int g_kernel = LK_KERNEL_AUTO;
+static LkRowFunc g_lkRow = NULL;
+static DerivLkRowFunc g_derivLkRow = NULL;
+static LkTipRowFunc g_lkTipRow = NULL;
+static LkRowCatsFunc g_lkRowCats = NULL;
+static DerivLkRowCatsFunc g_derivLkRowCats = NULL;
+static LkTipRowCatsFunc g_lkTipRowCats = NULL;
+static BranchSumsCatsFunc g_branchSumsCats = NULL;
+static pthread_once_t g_kernelOnce = PTHREAD_ONCE_INIT;
+static size_t g_l2CacheSize = 0;
+
+
+static bool kernelSupported(int kernel)
+{
+    switch (kernel) {
+    case LK_KERNEL_SCALAR:
+        return true;
+#ifdef SPIDIR_X86_SIMD
+    case LK_KERNEL_AVX2:
+        return __builtin_cpu_supports("avx2") &&
+               __builtin_cpu_supports("fma");
+    case LK_KERNEL_AVX512:
+        return __builtin_cpu_supports("avx512f");
+#endif
+    default:
+        return false;
+    }
+}
+
+
+static bool assignLkKernel(int kernel)
+{
+    if (kernel == LK_KERNEL_AUTO) {
+        // choose fastest supported kernel
+        for (kernel = LK_KERNEL_AVX512; kernel > LK_KERNEL_SCALAR; kernel--)
+            if (kernelSupported(kernel))
+                break;
+    } else if (!kernelSupported(kernel)) {
+        return false;
+    }
+
+    switch (kernel) {
+#ifdef SPIDIR_X86_SIMD
+    case LK_KERNEL_AVX2:
+        g_lkRow = calcLkRowAvx2;
+        g_derivLkRow = calcDerivLkRowAvx2;
+        g_lkTipRow = calcLkTipRowAvx2;
+        break;
+    case LK_KERNEL_AVX512:
+        g_lkRow = calcLkRowAvx512;
+        g_derivLkRow = calcDerivLkRowAvx512;
+        g_lkTipRow = calcLkTipRowAvx512;
+        break;
+#endif
+    default:
+        g_lkRow = calcLkRowScalar;
+        g_derivLkRow = calcDerivLkRowScalar;
+        g_lkTipRow = calcLkTipRowScalar;
+    }
+
+    // rate categories (single precision only has the scalar kernels)
+    switch (kernel) {
+#if defined(SPIDIR_X86_SIMD) && !defined(SPIDIR_SINGLE_LK)
+    case LK_KERNEL_AVX2:
+        g_lkRowCats = calcLkRowCatsAvx2;
+        g_derivLkRowCats = calcDerivLkRowCatsAvx2;
+        g_lkTipRowCats = calcLkTipRowCatsAvx2;
+        g_branchSumsCats = calcBranchSumsCatsAvx2;
+        break;
+    case LK_KERNEL_AVX512:
+        g_lkRowCats = calcLkRowCatsAvx512;
+        g_derivLkRowCats = calcDerivLkRowCatsAvx512;
+        g_lkTipRowCats = calcLkTipRowCatsAvx512;
+        g_branchSumsCats = calcBranchSumsCatsAvx2;
+        break;
+#endif
+    default:
+        g_lkRowCats = calcLkRowCatsScalar;
+        g_derivLkRowCats = calcDerivLkRowCatsScalar;
+        g_lkTipRowCats = calcLkTipRowCatsScalar;
+        g_branchSumsCats = calcBranchSumsCatsScalar;
+    }
+    g_kernel = kernel;
+
+    return true;
+}
+
+
+static void initLkKernel()
+{
+    assignLkKernel(LK_KERNEL_AUTO);
+    g_l2CacheSize = detectL2CacheSize();
+}
+
+
+// The kernels are chosen (and the cache size used to tile sites is
+// detected) once, by the first thread that needs them (which may be a
+// thread of the pool).
+static inline void ensureLkKernel()
+{
+    pthread_once(&g_kernelOnce, initLkKernel);
+}
+
+
+extern "C" {
+
+bool setLkKernel(int kernel)
+{
+    ensureLkKernel();
+    return assignLkKernel(kernel);
+}
+
+
+const char *getLkKernelName()
+{
+    ensureLkKernel();
+    return g_kernelNames[g_kernel];
+}
+
+} // extern "C"
+
+
+size_t getL2CacheSize()
+{
+    ensureLkKernel();
+    return g_l2CacheSize;
+}
+
+
+void calcLkRow(int seqlen, const floatlk *amat, const floatlk *bmat,
+               const floatlk *a, const floatlk *b, floatlk *c)
+{
+    ensureLkKernel();
+    g_lkRow(seqlen, amat, bmat, a, b, c);
+}
+
+
+void calcDerivLkRow(int seqlen, const floatlk *bmat,
+                    const floatlk *a, const floatlk *b, floatlk *c)
+{
+    ensureLkKernel();
+    g_derivLkRow(seqlen, bmat, a, b, c);
+}
+
+
+void calcLkTipRow(int seqlen, const floatlk *alook, 
+                  const unsigned char *acodes,
+                  const floatlk *bmat, const floatlk *b, floatlk *c)
+{
+    ensureLkKernel();
+    g_lkTipRow(seqlen, alook, acodes, bmat, b, c);
+}
+
+
+void calcLkRowCats(int seqlen, int ncats,
+                   const floatlk *amats, const floatlk *bmats,
+                   const floatlk *a, const floatlk *b, floatlk *c)
+{
+    if (ncats == 1) {
+        calcLkRow(seqlen, amats, bmats, a, b, c);
+        return;
+    }
+    ensureLkKernel();
+    g_lkRowCats(seqlen, ncats, amats, bmats, a, b, c);
+}
+
+
+void calcDerivLkRowCats(int seqlen, int ncats, const floatlk *bmats,
+                        const floatlk *a, const floatlk *b, floatlk *c)
+{
+    if (ncats == 1) {
+        calcDerivLkRow(seqlen, bmats, a, b, c);
+        return;
+    }
+    ensureLkKernel();
+    g_derivLkRowCats(seqlen, ncats, bmats, a, b, c);
+}
+
+
+void calcLkTipRowCats(int seqlen, int ncats, const floatlk *alook,
+                      const unsigned char *acodes,
+                      const floatlk *bmats, const floatlk *b, floatlk *c)
+{
+    if (ncats == 1) {
+        calcLkTipRow(seqlen, alook, acodes, bmats, b, c);
+        return;
+    }
+    ensureLkKernel();
+    g_lkTipRowCats(seqlen, ncats, alook, acodes, bmats, b, c);
+}
+
+
+void calcBranchSumsCats(int seqlen, int ncats, const floatlk *mats,
+                        const floatlk *dmats, const floatlk *d2mats,
+                        const float *freqs,
+                        const floatlk *a, const unsigned char *acodes,
+                        const floatlk *b, const unsigned char *bcodes,
+                        floatlk *sums)
+{
+    const floatlk *allmats[3] = {mats, dmats, d2mats};
+    ensureLkKernel();
+    g_branchSumsCats(seqlen, ncats, allmats, freqs, a, acodes, b, bcodes,
+                     sums);
+}
+
+
+} // namespace spidir
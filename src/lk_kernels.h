@@ -0,0 +1,227 @@
+/*=============================================================================
+
+  SPIMAP
+  Copyright 2007-2013
+
+  Inner loops of the conditional likelihood recursion
+
+  Each kernel has a portable scalar version and explicitly vectorized
+  versions (AVX2, AVX-512).  The fastest version supported by the CPU is
+  chosen at runtime, so one binary runs on all machines.
+
+=============================================================================*/
+
+
+#ifndef SPIDIR_LK_KERNELS_H
+#define SPIDIR_LK_KERNELS_H
+
+#include <stddef.h>
+
+
+namespace spidir {
+
+// Type of the entries of conditional likelihood tables.  Building with
+// SPIDIR_SINGLE_LK (make SINGLE_LK=1) stores tables in single precision,
+// which halves memory traffic and doubles the SIMD width of the kernels.
+// Log-likelihoods are always accumulated in double precision.
+#ifdef SPIDIR_SINGLE_LK
+typedef float floatlk;
+#else
+typedef double floatlk;
+#endif
+
+
+// Per-site scaling of partial likelihoods
+//
+// When the largest entry of a site falls below 2^-LK_SCALE_EXP the site is
+// multiplied by 2^LK_SCALE_EXP.  Scale counts accumulate from the leaves,
+// so for the row of node c
+//   log(true partial) = log(stored partial) - scale[c][j] * LK_SCALE_LOG
+const int LK_SCALE_EXP = 32;
+const double LK_SCALE_LOG = LK_SCALE_EXP * 0.69314718055994530942;
+
+
+// Conditional likelihood of a parent from two children
+//   c[j,k] = (sum_x amat[k,x] a[j,x]) * (sum_y bmat[k,y] b[j,y])
+//
+//   amat, bmat: 4x4 row-major transition matrices
+//   a, b, c:    seqlen x 4 row-major tables
+void calcLkRow(int seqlen, const floatlk *amat, const floatlk *bmat,
+               const floatlk *a, const floatlk *b, floatlk *c);
+
+// Derivative of the conditional likelihood along branch b
+//   c[j,k] = a[j,k] * (sum_y bmat[k,y] b[j,y])
+void calcDerivLkRow(int seqlen, const floatlk *bmat,
+                    const floatlk *a, const floatlk *b, floatlk *c);
+
+// Leaves are stored as one 4-bit code per site instead of a row of
+// partials: the mask of the bases that are possible at the site (bit x
+// for base x, so IUPAC ambiguity codes are exact and gaps are 15).  The
+// tip kernels replace the product with the matrix of a leaf's branch by a
+// lookup of one of LK_NCODES precomputed vectors:
+//   look[4*m + k] = sum_{x in m} mat[k,x]
+const int LK_NCODES = 16;
+
+void calcLkTipLookup(const floatlk *mat, floatlk *look);
+
+// One leaf child a
+//   c[j,k] = alook[4*acodes[j] + k] * (sum_y bmat[k,y] b[j,y])
+void calcLkTipRow(int seqlen, const floatlk *alook, 
+                  const unsigned char *acodes,
+                  const floatlk *bmat, const floatlk *b, floatlk *c);
+
+// Two leaf children
+//   c[j,k] = alook[4*acodes[j] + k] * blook[4*bcodes[j] + k]
+void calcLkTipTipRow(int seqlen, 
+                     const floatlk *alook, const unsigned char *acodes,
+                     const floatlk *blook, const unsigned char *bcodes,
+                     floatlk *c);
+
+// Rescale the sites of row c that are close to underflow and set its
+// scale counts (scalec[j] = scalea[j] + scaleb[j] + rescalings of site j)
+void rescaleLkRow(int seqlen, floatlk *c, 
+                  const int *scalea, const int *scaleb, int *scalec);
+
+// Log likelihood of root row c
+//   sum_j weights[j] * (log(sum_k bgfreq[k] c[j,k]) - scalec[j] * LK_SCALE_LOG)
+// computed with about one log per thousand sites.  scalec and weights may be
+// NULL (no scaling, one per site).
+double calcLogLkRow(int seqlen, const floatlk *c, const int *scalec,
+                    const float *bgfreq, const int *weights);
+
+
+//=============================================================================
+// rate categories
+//
+// With among-site rate variation a site has the partials of ncats rate
+// categories, stored [site][category][state], so that the partials of a
+// site are contiguous and one pass over a row updates every category.
+// The matrices of a branch are ncats 4x4 matrices one after the other, and
+// the tip lookups of all categories of a code are together,
+//   look[4*(ncats*m + r) + k] = sum_{x in m} mat_r[k,x]
+// With ncats = 1 these are the kernels above.
+const int LK_MAX_CATS = 16;
+
+void calcLkRowCats(int seqlen, int ncats,
+                   const floatlk *amats, const floatlk *bmats,
+                   const floatlk *a, const floatlk *b, floatlk *c);
+
+void calcDerivLkRowCats(int seqlen, int ncats, const floatlk *bmats,
+                        const floatlk *a, const floatlk *b, floatlk *c);
+
+void calcLkTipLookupCats(int ncats, const floatlk *mats, floatlk *look);
+
+void calcLkTipRowCats(int seqlen, int ncats, const floatlk *alook,
+                      const unsigned char *acodes,
+                      const floatlk *bmats, const floatlk *b, floatlk *c);
+
+void calcLkTipTipRowCats(int seqlen, int ncats,
+                         const floatlk *alook, const unsigned char *acodes,
+                         const floatlk *blook, const unsigned char *bcodes,
+                         floatlk *c);
+
+// sites are rescaled as a whole (all of their categories)
+void rescaleLkRowCats(int seqlen, int ncats, floatlk *c,
+                      const int *scalea, const int *scaleb, int *scalec);
+
+// freqs are the weights of the 4*ncats partials of a site (the weight of
+// a category times bgfreq)
+double calcLogLkRowCats(int seqlen, int ncats, const floatlk *c,
+                        const int *scalec, const float *freqs,
+                        const int *weights);
+
+// Likelihood of each site given the partials a and b at the two ends of a
+// branch, and its first and second derivatives with respect to the branch
+// length, without storing the rows of the derivatives:
+//   sums[3j + n] = sum_{r,k} freqs[4r+k] b[j,r,k] (sum_x M_r[k,x] a[j,r,x])
+// where M is mats (P(t)) for n = 0, dmats for n = 1 and d2mats for n = 2.
+// A leaf a or b is given by its codes instead (acodes or bcodes not NULL).
+void calcBranchSumsCats(int seqlen, int ncats, const floatlk *mats,
+                        const floatlk *dmats, const floatlk *d2mats,
+                        const float *freqs,
+                        const floatlk *a, const unsigned char *acodes,
+                        const floatlk *b, const unsigned char *bcodes,
+                        floatlk *sums);
+
+
+//=============================================================================
+// memory for likelihood tables
+
+// alignment of table rows in bytes (one cache line)
+const int LK_ALIGN = 64;
+
+// number of floatlk between consecutive aligned rows of seqlen sites with
+// width partials per site (4 per rate category)
+inline int lkRowStride(int seqlen, int width=4)
+{
+    const int n = LK_ALIGN / sizeof(floatlk);
+    return (width * seqlen + n - 1) / n * n;
+}
+
+// round a size in bytes up to a multiple of LK_ALIGN
+inline size_t lkAlignSize(size_t size)
+{
+    return (size + LK_ALIGN - 1) / LK_ALIGN * LK_ALIGN;
+}
+
+
+// LK_ALIGN aligned block of memory that is reused between computations.
+// It only grows; the contents are not kept when it does.
+class AlignedBuffer
+{
+public:
+    AlignedBuffer() :
+        data(NULL),
+        capacity(0)
+    {}
+    ~AlignedBuffer();
+
+    // returns a block of at least size bytes
+    void *reserve(size_t size);
+
+    // free the block (the next reserve() allocates a new one)
+    void release();
+
+    void *data;
+    size_t capacity;
+
+    // back large buffers with transparent huge pages where available
+    static bool useHugePages;
+
+private:
+    // not copyable
+    AlignedBuffer(const AlignedBuffer &other);
+    AlignedBuffer &operator=(const AlignedBuffer &other);
+};
+
+
+// size of the L2 cache in bytes (detected once, 256 KB if unknown)
+size_t getL2CacheSize();
+
+
+//=============================================================================
+// kernel selection
+enum {
+    LK_KERNEL_AUTO = -1,
+    LK_KERNEL_SCALAR = 0,
+    LK_KERNEL_AVX2,
+    LK_KERNEL_AVX512
+};
+
+extern "C" {
+
+// Choose a kernel (LK_KERNEL_AUTO picks the best one the CPU supports).
+// Returns false if the requested kernel is not supported.  Without a call
+// the best kernel is chosen on first use.  Call it before any thread
+// computes likelihoods.
+bool setLkKernel(int kernel=LK_KERNEL_AUTO);
+
+// Returns the name of the kernel in use
+const char *getLkKernelName();
+
+} // extern "C"
+
+
+} // namespace spidir
+
+#endif // SPIDIR_LK_KERNELS_H
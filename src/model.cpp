@@ -168,20 +168,41 @@ double SpimapModel::topologyPrior()
 }
 
 
+void SpimapModel::accept()
+{
+    if (likelihoodFunc)
+        likelihoodFunc->accept();
+}
+
+
+void SpimapModel::reject()
+{
+    if (likelihoodFunc)
+        likelihoodFunc->reject();
+}
+
+
 //=============================================================================
 // HKY sequence likelihood
 
 HkySeqLikelihood::HkySeqLikelihood(int nseqs, int seqlen, char **seqs, 
                                    float *bgfreq, float tsvratio, int maxiter,
-                                   double minlen, double maxlen) :
+                                   double minlen, double maxlen,
+                                   LikelihoodWorkspace *workspace) :
+    engine(nseqs, seqlen, seqs, bgfreq, tsvratio),
+    branchCache(nseqs),
+    workspace(workspace ? workspace : &ownWorkspace),
     nseqs(nseqs),
     seqlen(seqlen),
     seqs(seqs),
     bgfreq(bgfreq),
     tsvratio(tsvratio),
+    alpha(1.0),
+    ncats(1),
     maxiter(maxiter),
     minlen(minlen),
-    maxlen(maxlen)
+    maxlen(maxlen),
+    memlimit(0)
 {}
 
 
@@ -191,8 +212,8 @@ double HkySeqLikelihood::findLengths(Tree *tree)
 
   //we only want the likelihood of the sequences given our tree 
   //no ML to find the branch lengths
-     return  calcSeqProbHky(tree,nseqs,seqs, 
-     		       bgfreq,tsvratio);
+  //only the rows affected by the last proposal are recomputed
+     return engine.calcSeqProb(tree);
 
 
 
@@ -204,11 +225,67 @@ double HkySeqLikelihood::findLengthsWithOptimization(Tree *tree)
 { 
 
 
-     return findMLBranchLengthsHky(tree, nseqs, seqs, bgfreq, 
-  				  tsvratio, maxiter, minlen, maxlen);
+     // start from the lengths of splits seen in earlier fits
+     int nseeded = branchCache.seed(tree);
+     double logl;
+     if (ncats > 1)
+         logl = findMLBranchLengthsHkyGamma(tree, engine.patterns, bgfreq,
+                                            tsvratio, alpha, ncats, maxiter,
+                                            minlen, maxlen, workspace);
+     else
+         logl = findMLBranchLengthsHky(tree, engine.patterns, bgfreq, 
+                                       tsvratio, maxiter, minlen, maxlen, 
+                                       workspace);
+     branchCache.store(tree);
+     printLog(LOG_HIGH, "branch cache: %d of %d branches seeded\n",
+              nseeded, tree->nnodes - 1);
+
+     // under a memory limit the full size fitting tables are not kept
+     // between fits
+     if (memlimit > 0)
+         workspace->release();
+     return logl;
+
+
+
+}
+
+
+void HkySeqLikelihood::setWeights(const int *weights)
+{
+    engine.setWeights(weights);
+
+    // lengths fitted under other weights are no longer a good start
+    branchCache.clear();
+}
+
+
+void HkySeqLikelihood::setGammaRates(float _alpha, int _ncats)
+{
+    alpha = _alpha;
+    ncats = _ncats;
+    engine.setGammaRates(alpha, ncats);
+}
+
+
+void HkySeqLikelihood::setMemoryLimit(size_t bytes)
+{
+    memlimit = bytes;
+    engine.setMemoryLimit(bytes);
+    if (memlimit > 0)
+        workspace->release();
+}
+
 
+void HkySeqLikelihood::accept()
+{
+    engine.accept();
+}
 
 
+void HkySeqLikelihood::reject()
+{
+    engine.reject();
 }
 
 
@@ -13,6 +13,7 @@
 
 #include "model_params.h"
 #include "newick.h"
+#include "seq_likelihood.h"
 #include <set>
 
 
@@ -30,6 +31,12 @@ public:
     virtual double findLengths(Tree *tree) {return 0.0;}
     virtual double findLengthsWithOptimization(Tree *tree) {return 0.0;}
 
+    // weigh the site patterns (NULL restores the column counts)
+    virtual void setWeights(const int *weights) {}
+
+    // the tree of the last findLengths() was accepted or rejected
+    virtual void accept() {}
+    virtual void reject() {}
 };
 
 
@@ -38,18 +45,44 @@ class HkySeqLikelihood : public SeqLikelihood
 public:
     HkySeqLikelihood(int nseqs, int seqlen, char **seqs, 
                      float *bgfreq, float tsvratio, int maxiter, 
-                     double minlen=0.0001, double maxlen=10.0);
+                     double minlen=0.0001, double maxlen=10.0,
+                     LikelihoodWorkspace *workspace=NULL);
     virtual double findLengths(Tree *tree);
     virtual double findLengthsWithOptimization(Tree *tree);
+    virtual void setWeights(const int *weights);
+    virtual void accept();
+    virtual void reject();
+
+    // use ncats discrete gamma rate categories of shape alpha (1 for a
+    // single rate)
+    void setGammaRates(float alpha, int ncats);
+
+    // keep at most about 'bytes' of engine rows (0: no limit).  With a
+    // limit the workspace tables of ML fitting are freed after each fit
+    // instead of being kept for the next one.
+    void setMemoryLimit(size_t bytes);
+
+    // persistent likelihood table, updated incrementally between proposals
+    LikelihoodEngine engine;
+
+    // ML branch lengths of earlier trees, used to start each fit
+    BranchLengthCache branchCache;
+
+    // memory reused by ML fitting (shared with the caller if given)
+    LikelihoodWorkspace ownWorkspace;
+    LikelihoodWorkspace *workspace;
 
     int nseqs;
     int seqlen;
     char **seqs;    
     float *bgfreq;
     float tsvratio;
+    float alpha;
+    int ncats;
     int maxiter;
     double minlen;
     double maxlen;
+    size_t memlimit;
 };
 
 
@@ -77,6 +110,10 @@ public:
     virtual double branchPrior() { return 0.0; }
     virtual double topologyPrior() { return 0.0; }
 
+    // the search accepted or rejected the last tree given to setTree()
+    virtual void accept() {}
+    virtual void reject() {}
+
     virtual SpeciesTree *getSpeciesTree() { return NULL; }
     virtual int *getGene2species() { return NULL; }
 
@@ -113,6 +150,8 @@ public:
 
     virtual double branchPrior();
     virtual double topologyPrior();
+    virtual void accept();
+    virtual void reject();
     
     SpeciesTree *getSpeciesTree() { return stree; }
 
@@ -3,7 +3,7 @@
   Matt Rasmussen
   Copyright 2007-2011
 
-  Simple root finding methods
+  Simple root finding and optimization methods
 
 =============================================================================*/
 
@@ -75,6 +75,85 @@ float bisectRoot(Func &f, float x0, float x1, const float err=.001)
 }
 
 
+// Find a maximum of a function f(x) in [a, b] using Brent's method
+// (golden section search accelerated by parabolic interpolation).
+// x is an initial estimate within [a, b] and err is the absolute error.
+template <class Func>
+float brentMax(Func &f, float a, float b, float x, const float err=.001,
+               int maxiter=100)
+{
+    const double golden = 0.381966011250105;
+
+    // minimize -f(x)
+    double v = x, w = x;
+    double fx = -f(x), fv = fx, fw = fx;
+    double d = 0.0, e = 0.0;
+
+    for (int i=0; i<maxiter; i++) {
+        const double m = 0.5 * (a + b);
+        const double tol2 = 2.0 * err;
+        if (fabs(x - m) <= tol2 - 0.5 * (b - a))
+            break;
+
+        bool parabolic = false;
+        if (fabs(e) > err) {
+            // parabola through x, v, w
+            double r = (x - w) * (fx - fv);
+            double q = (x - v) * (fx - fw);
+            double p = (x - v) * q - (x - w) * r;
+            q = 2.0 * (q - r);
+            if (q > 0.0)
+                p = -p;
+            else
+                q = -q;
+
+            if (fabs(p) < fabs(0.5 * q * e) && 
+                p > q * (a - x) && p < q * (b - x)) {
+                e = d;
+                d = p / q;
+                
+                // don't evaluate too close to the ends
+                const double u = x + d;
+                if (u - a < tol2 || b - u < tol2)
+                    d = (x < m) ? err : -err;
+                parabolic = true;
+            }
+        }
+        if (!parabolic) {
+            e = (x < m) ? b - x : a - x;
+            d = golden * e;
+        }
+
+        // don't evaluate too close to x
+        const double u = x + (fabs(d) >= err ? d : (d > 0 ? err : -err));
+        const double fu = -f(u);
+
+        if (fu <= fx) {
+            if (u < x)
+                b = x;
+            else
+                a = x;
+            v = w; fv = fw;
+            w = x; fw = fx;
+            x = u; fx = fu;
+        } else {
+            if (u < x)
+                a = u;
+            else
+                b = u;
+            if (fu <= fw || w == x) {
+                v = w; fv = fw;
+                w = u; fw = fu;
+            } else if (fu <= fv || v == x || v == w) {
+                v = u; fv = fu;
+            }
+        }
+    }
+
+    return x;
+}
+
+
 } // namespace spidir
 
 #endif // SPIDIR_ROOTS_H
@@ -981,6 +981,7 @@ Tree *TreeSearchClimb::search(Tree *initTree, string *genes,
     // calc probability of initial tree
     parsimony(tree, nseqs, seqs); // get initial branch lengths
     logp = prob.calcJoint(model, tree);
+    model->accept();
     seqlk=prob.seqlk;
     branchp=prob.branchp;
     topp=prob.topp;
@@ -1093,6 +1094,7 @@ Tree *TreeSearchClimb::search(Tree *initTree, string *genes,
 	branchp=nextbranchp;
 	topp=nexttopp;
 	    
+	model->accept();
 	delete toptree;
 	toptree = tree->copy();
 	      	    
@@ -1106,6 +1108,7 @@ Tree *TreeSearchClimb::search(Tree *initTree, string *genes,
             	  
 	nreject++;
 	proposer->accept(false); 	     	     
+	model->reject();
 
 	delete tree;
 	tree=toptree->copy();
@@ -1162,6 +1165,7 @@ Tree *TreeSearchClimb::search(Tree *initTree, string *genes,
 	    seqlk=nextseqlk;
 	    branchp=nextbranchp;
 	    
+	    model->accept();
             delete toptree;
 
 	    toptree = tree->copy();	   
@@ -1170,6 +1174,7 @@ Tree *TreeSearchClimb::search(Tree *initTree, string *genes,
 	  }else{	    
 
 	    nreject++;	    	    
+	    model->reject();
 	    delete tree;
 	    tree = toptree->copy();
 	    
@@ -1217,6 +1222,7 @@ Tree *TreeSearchClimb::search(Tree *initTree, string *genes,
 	  seqlk=nextseqlk;
 	  branchp=nextbranchp;
 	    
+	  model->accept();
 	  delete toptree;	  
 	  toptree = tree->copy();
 	   
@@ -1225,6 +1231,7 @@ Tree *TreeSearchClimb::search(Tree *initTree, string *genes,
 	}else{	    
 
 	  nreject++;	    
+	  model->reject();
 	  delete tree;
 	  tree = toptree->copy();
 	    
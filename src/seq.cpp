@@ -43,6 +43,36 @@ const int dna2int [256] =
     -1, -1, -1, -1, -1, -1                    // 255
 };
 
+const int dna2mask [256] = 
+{
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 9
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 19
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 29
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 39
+     0,  0,  0,  0,  0, 15,  0,  0,  0,  0,     // 49
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 59
+     0,  0,  0,  0,  0,  1, 14,  2, 13,  0,     // 69
+     0,  4, 11,  0,  0, 12,  0,  3, 15,  0,     // 79
+     0,  0,  5,  6,  8,  0,  7,  9,  0, 10,     // 89
+     0,  0,  0,  0,  0,  0,  0,  1, 14,  2,     // 99
+    13,  0,  0,  4, 11,  0,  0, 12,  0,  3,     // 109
+    15,  0,  0,  0,  5,  6,  8,  0,  7,  9,     // 119
+     0, 10,  0,  0,  0,  0,  0,  0,  0,  0,     // 129
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 139
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 149
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 159
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 169
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 179
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 189
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 199
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 209
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 219
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 229
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 239
+     0,  0,  0,  0,  0,  0,  0,  0,  0,  0,     // 249
+     0,  0,  0,  0,  0,  0                      // 255
+};
+
 const char *int2dna = "ACGT";
 
 int dnatype[] = { 
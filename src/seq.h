@@ -18,6 +18,11 @@ namespace spidir {
 // convert dna characters into standard numbers
 extern const int dna2int[256];
 
+// convert dna characters (including IUPAC ambiguity codes) into masks of
+// the possible bases (bit i set for base number i).  Gaps and N are 15
+// and characters that are not nucleotides are 0.
+extern const int dna2mask[256];
+
 // convert standard numbers to dna characters
 extern const char *int2dna;
 
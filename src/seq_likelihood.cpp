@@ -18,13 +18,19 @@
 
 // spidir headers
 #include "common.h"
+#include "gamma_model.h"
+#include "gtr.h"
+#include "HashTable.h"
 #include "hky.h"
+#include "lk_kernels.h"
 #include "logging.h"
 #include "Matrix.h"
 #include "parsimony.h"
 #include "roots.h"
 #include "seq.h"
 #include "seq_likelihood.h"
+#include "Sequences.h"
+#include "ThreadPool.h"
 #include "Tree.h"
 
 
@@ -34,44 +40,751 @@ namespace spidir {
 
 
 
-// prototype
+// prototypes
 template <class Model>
 void calcLkTableRow(int seqlen, Model &model,
 		    floatlk *lktablea, floatlk *lktableb, floatlk *lktablec, 
-		    float adist, float bdist);
+		    float adist, float bdist, const int *scalea=NULL,
+                    const int *scaleb=NULL, int *scalec=NULL);
+
+void calcLkTableRowMatrix(int seqlen, const floatlk *amat, const floatlk *bmat,
+                          const floatlk *lktablea, const floatlk *lktableb, 
+                          floatlk *lktablec, const int *scalea=NULL,
+                          const int *scaleb=NULL, int *scalec=NULL,
+                          const unsigned char *codesa=NULL,
+                          const unsigned char *codesb=NULL, int ncats=1);
+
+void calcLkTableRowLookup(int seqlen, const floatlk *amat, 
+                          const floatlk *bmat,
+                          const floatlk *alook, const floatlk *blook,
+                          const floatlk *lktablea, const floatlk *lktableb, 
+                          floatlk *lktablec, const int *scalea,
+                          const int *scaleb, int *scalec,
+                          const unsigned char *codesa,
+                          const unsigned char *codesb, int ncats=1);
+
+void calcDerivLkTableRow(int seqlen, const floatlk *bmat,
+                         const floatlk *lktablea, const floatlk *lktableb, 
+                         floatlk *lktablec,
+                         const unsigned char *codesa=NULL,
+                         const unsigned char *codesb=NULL, int ncats=1);
+
+
+// pointer to an offset within a row that may be NULL
+template <class T>
+inline T *offsetRow(T *row, int offset)
+{
+    return row ? row + offset : NULL;
+}
+
+
+// log likelihood of sites [start, end) given the root row
+// weights are the site pattern counts (NULL for one per site)
+// freqs are the weights of the partials of a site (bgfreq without rate
+// categories, see getLkRootFreqs)
+double getRootLikelihood(const floatlk *rootseq, const int *rootscale,
+                         int start, int end, const float *freqs,
+                         const int *weights, int ncats=1)
+{
+    // integrate over the background base frequency (see lk_kernels.h)
+    return calcLogLkRowCats(end - start, ncats, rootseq + 4*ncats*start, 
+                            offsetRow(rootscale, start), freqs, 
+                            offsetRow(weights, start));
+}
+
+
+// number of rate categories of the partials of a model (see gamma_model.h)
+template <class Model>
+inline int getLkCats(Model &model)
+{
+    return 1;
+}
+
+template <class Model>
+inline int getLkCats(DiscreteGammaModel<Model> &model)
+{
+    return model.ncats;
+}
+
+
+// weights of the 4 * getLkCats(model) partials of a site at the root
+template <class Model>
+inline void getLkRootFreqs(Model &model, const float *bgfreq, float *freqs)
+{
+    for (int k=0; k<4; k++)
+        freqs[k] = bgfreq[k];
+}
+
+template <class Model>
+inline void getLkRootFreqs(DiscreteGammaModel<Model> &model, 
+                           const float *bgfreq, float *freqs)
+{
+    model.getRootFreqs(bgfreq, freqs);
+}
+
+
+// transition matrices of model for time t in table precision (one per
+// rate category)
+template <class Model>
+void getLkMatrix(Model &model, float t, floatlk *matrix)
+{
+    const int n = 16 * getLkCats(model);
+    float transmat[16 * LK_MAX_CATS];
+    model.getMatrix(t, transmat);
+    for (int i=0; i<n; i++)
+        matrix[i] = transmat[i];
+}
+
+
+//=============================================================================
+// Site-parallel evaluation
+//
+// Sites are independent, so sums over sites are split into contiguous 
+// blocks, one per thread of the likelihood thread pool.  Each block is 
+// summed separately and the block sums are added in thread order, so 
+// results only depend on the number of threads.
+
+// number of sites per block is a multiple of this (keeps rows aligned)
+const int LK_SITE_ALIGN = 16;
+
+
+template <class T, class Sum>
+struct SiteSum
+{
+    T *obj;
+    int seqlen;
+    ThreadPool *pool;
+    Sum *partials;
+    Sum zero;
+
+    static void run(void *arg, int thread)
+    {
+        SiteSum *sum = (SiteSum*) arg;
+        int start, end;
+        sum->pool->getRange(sum->seqlen, thread, &start, &end, 
+                            LK_SITE_ALIGN);
+        sum->partials[thread] = (start < end) ? 
+            sum->obj->sumSites(start, end) : sum->zero;
+    }
+};
+
+
+// returns sum of obj->sumSites(start, end) over the blocks of [0, seqlen)
+// starting from zero
+template <class T, class Sum>
+Sum parallelSumSites(T *obj, int seqlen, Sum zero)
+{
+    ThreadPool *pool = getLkThreadPool();
+    if (pool->nthreads == 1)
+        return obj->sumSites(0, seqlen);
+
+    ExtendArray<Sum> partials(pool->nthreads);
+    SiteSum<T, Sum> sum;
+    sum.obj = obj;
+    sum.seqlen = seqlen;
+    sum.pool = pool;
+    sum.partials = partials;
+    sum.zero = zero;
+    pool->run(&SiteSum<T, Sum>::run, &sum);
+
+    Sum total = zero;
+    for (int i=0; i<pool->nthreads; i++)
+        total += partials[i];
+    return total;
+}
+
+
+//=============================================================================
+// Site tiling
+//
+// Automatic tiles are sized so that the rows of a traversal fill half of 
+// the L2 cache, leaving the rest for leaf codes, scale counts of leaves and
+// whatever else the caller is using.  Tiles are never smaller than 
+// LK_TILE_MIN_SITES, so that every row is still read in runs that are long
+// enough for the hardware prefetcher.
+
+const int LK_TILE_MIN_SITES = 256;
+
+static int g_lkTileSites = LK_TILE_AUTO;
+
+
+void setLkTileSites(int sites)
+{
+    g_lkTileSites = sites;
+}
+
+
+int getLkTileSites(int nrows, int seqlen, int ncats)
+{
+    if (g_lkTileSites == LK_TILE_OFF || nrows == 0)
+        return seqlen;
+
+    int sites = g_lkTileSites;
+    if (sites == LK_TILE_AUTO) {
+        const size_t sitebytes = 4 * ncats * sizeof(floatlk) + sizeof(int);
+        sites = getL2CacheSize() / 2 / (nrows * sitebytes);
+        if (sites < LK_TILE_MIN_SITES)
+            sites = LK_TILE_MIN_SITES;
+    }
+
+    // keep tiles aligned like the blocks of threads
+    sites = (sites + LK_SITE_ALIGN - 1) / LK_SITE_ALIGN * LK_SITE_ALIGN;
+    return sites < seqlen ? sites : seqlen;
+}
+
+
+//=============================================================================
+// Subtree tasks
+//
+// For large trees with many threads, the blocks of sites of each thread
+// are short while every thread still touches the row of every node.  The
+// rows can instead be divided among threads by subtrees: a row is one task
+// of a TaskForest, which runs after the rows of its children.  Each row is
+// computed over all sites either way, so the likelihood does not depend on
+// the split.
+
+// the automatic split uses subtree tasks for at least this many rows per
+// thread, if blocks of sites would be shorter than the smallest tile
+const int LK_SUBTREE_MIN_ROWS = 16;
+
+static int g_lkSplit = LK_SPLIT_AUTO;
+
+
+void setLkSplit(int split)
+{
+    g_lkSplit = split;
+}
+
+
+static bool useLkSubtreeTasks(int nrows, int seqlen, int nthreads)
+{
+    if (nthreads == 1 || nrows == 0 || g_lkSplit == LK_SPLIT_SITES)
+        return false;
+    if (g_lkSplit == LK_SPLIT_SUBTREES)
+        return true;
+    return nrows >= LK_SUBTREE_MIN_ROWS * nthreads &&
+        seqlen < LK_TILE_MIN_SITES * nthreads;
+}
+
+
+//=============================================================================
+
+// first and second derivative of a log likelihood
+struct LkDerivs
+{
+    LkDerivs(double d1=0.0, double d2=0.0) :
+        d1(d1), d2(d2)
+    {}
+
+    LkDerivs &operator+=(const LkDerivs &other)
+    {
+        d1 += other.d1;
+        d2 += other.d2;
+        return *this;
+    }
+
+    double d1;
+    double d2;
+};
+
+
+// Stretches of gaps shorter than this are computed like other sites
+const int LK_GAP_MIN_SITES = 16;
+
+
+// first site in [start, end) whose bit in mask is 'value' (end if none)
+inline int findGapBit(const unsigned int *mask, int start, int end, 
+                      bool value)
+{
+    int j = start;
+    while (j < end) {
+        unsigned int word = mask[j >> 5];
+        if (!value)
+            word = ~word;
+        word >>= (j & 31);
+        if (word) {
+            j += __builtin_ctz(word);
+            return j < end ? j : end;
+        }
+        j = (j | 31) + 1;
+    }
+    return end;
+}
+
+
+// Append to runs the [start, end) of the runs of sites whose bit in mask
+// is 'value' and return their number.  Runs separated by fewer than 
+// 'mingap' sites are joined.
+static int findGapRuns(const unsigned int *mask, int seqlen, bool value,
+                       int mingap, ExtendArray<int> *runs)
+{
+    int nruns = 0;
+    int start = findGapBit(mask, 0, seqlen, value);
+    while (start < seqlen) {
+        int end = findGapBit(mask, start, seqlen, !value);
+        while (end < seqlen) {
+            const int next = findGapBit(mask, end, seqlen, value);
+            if (next == seqlen || next - end >= mingap)
+                break;
+            end = findGapBit(mask, next, seqlen, !value);
+        }
+
+        runs->append(start);
+        runs->append(end);
+        nruns++;
+        start = findGapBit(mask, end, seqlen, value);
+    }
+    return nruns;
+}
+
+
+// clear the bits of sites [start, end) of mask
+inline void clearGapBits(unsigned int *mask, int start, int end)
+{
+    int j = start;
+    while (j < end) {
+        if ((j & 31) == 0 && j + 32 <= end) {
+            mask[j >> 5] = 0;
+            j += 32;
+        } else {
+            mask[j >> 5] &= ~(1u << (j & 31));
+            j++;
+        }
+    }
+}
+
+
+// index of the first of nruns runs that ends after site j
+inline int findFirstRun(const int *runs, int nruns, int j)
+{
+    int lo = 0, hi = nruns;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (runs[2*mid+1] <= j)
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+
+// A batch of conditional likelihood rows computed in order, optionally
+// followed by the log likelihood of a root row.  Every thread computes all
+// rows over its own block of sites, one tile of sites at a time (see
+// getLkTileSites).  The root is summed over the whole block afterwards, so
+// the result does not depend on the tile size.
+//
+// Children that are leaves are given by their codes (see lk_kernels.h).
+//
+// If the gap masks of a row and its children are given, the sites where
+// the subtree of the row is all gaps are found before the rows are
+// computed, and the row is only computed over the runs of the other sites.
+// (Short stretches of gaps between runs are computed anyway, since that is
+// cheaper than starting another run.)  The gap sites of a row must hold
+// ones.  The mask of a row records the sites that already do, so only the 
+// sites that have become gaps since the row was last computed are set.
+//
+// With ncats rate categories the rows hold the partials of all categories
+// of a site (see lk_kernels.h) and each branch has one matrix per category.
+//
+// Rows may instead be computed by subtree tasks (see setLkSplit) when every
+// row has its own output that no earlier row reads.
+class LkRowBatch
+{
+public:
+    LkRowBatch(int ncats=1) :
+        ncats(ncats),
+        bytasks(false),
+        root(NULL),
+        rootscale(NULL),
+        bgfreq(NULL),
+        weights(NULL)
+    {}
+
+    struct Row
+    {
+        int amat;       // offsets of the matrices in mats
+        int bmat;
+        int alook;      // offsets of the lookups of leaf children in looks
+        int blook;
+        const floatlk *a;
+        const floatlk *b;
+        floatlk *c;
+        const int *scalea;
+        const int *scaleb;
+        int *scalec;
+        const unsigned char *acodes;
+        const unsigned char *bcodes;
+        const unsigned int *gapsa;
+        const unsigned int *gapsb;
+        unsigned int *gapsc;
+        int runs;       // offset of the runs to compute in runlist
+        int nruns;      // number of runs (-1 to compute all sites)
+        int fills;      // offset of the runs to set to one in runlist
+        int nfills;
+    };
+
+    void clear()
+    {
+        rows.setSize(0);
+        mats.setSize(0);
+        looks.setSize(0);
+        runlist.setSize(0);
+        root = NULL;
+    }
+
+    // acodes and bcodes are the codes of leaf children (or NULL)
+    // gapsa, gapsb and gapsc are the gap masks of the children and the row
+    // (or NULL to compute every site)
+    void addRow(const floatlk *amat, const floatlk *bmat, 
+                const floatlk *a, const floatlk *b, floatlk *c,
+                const int *scalea, const int *scaleb, int *scalec,
+                const unsigned char *acodes=NULL, 
+                const unsigned char *bcodes=NULL,
+                const unsigned int *gapsa=NULL, 
+                const unsigned int *gapsb=NULL,
+                unsigned int *gapsc=NULL)
+    {
+        // keep a leaf child first
+        if (!acodes && bcodes) {
+            swap(amat, bmat);
+            swap(a, b);
+            swap(scalea, scaleb);
+            swap(acodes, bcodes);
+            swap(gapsa, gapsb);
+        }
+
+        rows.ensureSize(rows.size() + 1);
+        rows.setSize(rows.size() + 1);
+        Row &row = rows[rows.size() - 1];
+        row.amat = addMatrices(amat);
+        row.bmat = addMatrices(bmat);
+
+        // the lookups of leaves are computed once for all tiles
+        row.alook = acodes ? addLookup(amat) : -1;
+        row.blook = bcodes ? addLookup(bmat) : -1;
+
+        row.a = a;
+        row.b = b;
+        row.c = c;
+        row.scalea = scalea;
+        row.scaleb = scaleb;
+        row.scalec = scalec;
+        row.acodes = acodes;
+        row.bcodes = bcodes;
+        row.gapsa = gapsa;
+        row.gapsb = gapsb;
+        row.gapsc = (gapsa && gapsb) ? gapsc : NULL;
+        row.runs = 0;
+        row.nruns = -1;
+        row.fills = 0;
+        row.nfills = 0;
+    }
+
+    template <class Model>
+    void addRow(Model &model, float adist, float bdist,
+                const floatlk *a, const floatlk *b, floatlk *c,
+                const int *scalea, const int *scaleb, int *scalec,
+                const unsigned char *acodes=NULL, 
+                const unsigned char *bcodes=NULL,
+                const unsigned int *gapsa=NULL, 
+                const unsigned int *gapsb=NULL,
+                unsigned int *gapsc=NULL)
+    {
+        floatlk amat[16*LK_MAX_CATS], bmat[16*LK_MAX_CATS];
+        getLkMatrix(model, adist, amat);
+        getLkMatrix(model, bdist, bmat);
+        addRow(amat, bmat, a, b, c, scalea, scaleb, scalec, acodes, bcodes,
+               gapsa, gapsb, gapsc);
+    }
+
+    // with rate categories _bgfreq holds the weights of all partials of a
+    // site (see getLkRootFreqs)
+    void setRoot(const floatlk *_root, const int *_rootscale, 
+                 const float *_bgfreq, const int *_weights)
+    {
+        root = _root;
+        rootscale = _rootscale;
+        bgfreq = _bgfreq;
+        weights = _weights;
+    }
+
+    // compute rows and return the log likelihood of the root (if set)
+    double run(int seqlen)
+    {
+        findRuns(seqlen);
+
+        ThreadPool *pool = getLkThreadPool();
+        bytasks = useLkSubtreeTasks(rows.size(), seqlen, pool->nthreads) &&
+            findRowParents();
+        if (bytasks) {
+            taskSeqlen = seqlen;
+            tasks.setTasks(rows.size(), rowParents);
+            tasks.run(pool, &LkRowBatch::calcRowTask, this);
+            if (!root)
+                return 0.0;
+        }
+
+        return parallelSumSites(this, seqlen, 0.0);
+    }
+
+    double sumSites(int start, int end)
+    {
+        if (!bytasks) {
+            const int tile = getLkTileSites(rows.size(), end - start, ncats);
+            for (int j=start; j<end; j+=tile) {
+                const int tileend = (end - j < tile) ? end : j + tile;
+                for (int i=0; i<rows.size(); i++)
+                    calcRow(rows[i], j, tileend);
+            }
+        }
+
+        if (!root)
+            return 0.0;
+        return getRootLikelihood(root, rootscale, start, end, 
+                                 bgfreq, weights, ncats);
+    }
+
+    int ncats;
+    ExtendArray<Row> rows;
+    ExtendArray<floatlk> mats;      // transition matrices of the rows
+    ExtendArray<floatlk> looks;     // tip lookups (see lk_kernels.h)
+    ExtendArray<int> runlist;       // [start, end) of runs of sites
+    ExtendArray<unsigned int> newgaps;  // scratch gap mask
+    bool bytasks;                   // rows are computed by subtree tasks
+    TaskForest tasks;
+    ExtendArray<int> rowParents;    // row that reads each row (or -1)
+    ExtendArray<int> outputs;       // rows in the order of their outputs
+    int taskSeqlen;
+    const floatlk *root;
+    const int *rootscale;
+    const float *bgfreq;
+    const int *weights;
+
+protected:
+    static void calcRowTask(void *batch, int i)
+    {
+        LkRowBatch *b = (LkRowBatch*) batch;
+        b->calcRow(b->rows[i], 0, b->taskSeqlen);
+    }
+
+    // Find the row that reads each row.  Returns false if the rows do not
+    // form a forest whose rows can be computed in any order after their
+    // children (an output is shared, is read by two rows, or is read
+    // before it is written).
+    bool findRowParents()
+    {
+        const int n = rows.size();
+        outputs.setSize(0);
+        rowParents.setSize(0);
+        for (int i=0; i<n; i++) {
+            outputs.append(i);
+            rowParents.append(-1);
+        }
+        OutputLess less = {rows.get()};
+        sort(outputs.get(), outputs.get() + n, less);
+        for (int i=1; i<n; i++)
+            if (rows[outputs[i]].c == rows[outputs[i-1]].c)
+                return false;
+
+        for (int i=0; i<n; i++) {
+            const floatlk *inputs[2] = {rows[i].a, rows[i].b};
+            for (int k=0; k<2; k++) {
+                const int child = findOutput(inputs[k]);
+                if (child < 0)
+                    continue;
+                if (child >= i || rowParents[child] >= 0)
+                    return false;
+                rowParents[child] = i;
+            }
+        }
+        return true;
+    }
+
+    struct OutputLess
+    {
+        const Row *rows;
+        bool operator()(int i, int j) const { return rows[i].c < rows[j].c; }
+    };
+
+    // row whose output is c (or -1)
+    int findOutput(const floatlk *c) const
+    {
+        int lo = 0, hi = outputs.size();
+        while (lo < hi) {
+            const int mid = (lo + hi) / 2;
+            if (rows[outputs[mid]].c < c)
+                lo = mid + 1;
+            else
+                hi = mid;
+        }
+        return (lo < outputs.size() && rows[outputs[lo]].c == c) ? 
+            outputs[lo] : -1;
+    }
+
+    // compute sites [start, end) of row
+    void calcRow(const Row &row, int start, int end)
+    {
+        if (row.nruns < 0) {
+            calcSites(row, start, end);
+            return;
+        }
+
+        const int *runs = &runlist[row.runs];
+        for (int k=findFirstRun(runs, row.nruns, start); 
+             k<row.nruns && runs[2*k] < end; k++)
+        {
+            calcSites(row, max(runs[2*k], start), min(runs[2*k+1], end));
+        }
+
+        const int *fills = &runlist[row.fills];
+        for (int k=findFirstRun(fills, row.nfills, start); 
+             k<row.nfills && fills[2*k] < end; k++)
+        {
+            setGapSites(row, max(fills[2*k], start), 
+                        min(fills[2*k+1], end));
+        }
+    }
+
+    void calcSites(const Row &row, int start, int end)
+    {
+        const int width = 4 * ncats;
+        calcLkTableRowLookup(end - start, &mats[row.amat], &mats[row.bmat],
+                             getLookup(row.alook), getLookup(row.blook),
+                             offsetRow(row.a, width*start), 
+                             offsetRow(row.b, width*start), 
+                             row.c + width*start, 
+                             offsetRow(row.scalea, start),
+                             offsetRow(row.scaleb, start), 
+                             offsetRow(row.scalec, start),
+                             offsetRow(row.acodes, start),
+                             offsetRow(row.bcodes, start), ncats);
+    }
+
+    // sites where the subtree is all gaps
+    void setGapSites(const Row &row, int start, int end)
+    {
+        const int width = 4 * ncats;
+        for (int j=start; j<end; j++) {
+            floatlk *c = row.c + width*j;
+            for (int k=0; k<width; k++)
+                c[k] = 1.0;
+        }
+        if (row.scalec)
+            for (int j=start; j<end; j++)
+                row.scalec[j] = 0;
+    }
+
+    // find the runs of sites to compute and to set to one in each row
+    void findRuns(int seqlen)
+    {
+        const int nwords = gapMaskWords(seqlen);
+        runlist.setSize(0);
+        newgaps.ensureSize(nwords);
+        newgaps.setSize(nwords);
+
+        for (int i=0; i<rows.size(); i++) {
+            Row &row = rows[i];
+            if (!row.gapsc)
+                continue;
+
+            for (int w=0; w<nwords; w++)
+                newgaps[w] = row.gapsa[w] & row.gapsb[w];
+            row.runs = runlist.size();
+            row.nruns = findGapRuns(newgaps, seqlen, false, 
+                                    LK_GAP_MIN_SITES, &runlist);
+
+            // gaps inside runs are computed like other sites
+            for (int k=0; k<row.nruns; k++) {
+                const int *run = &runlist[row.runs + 2*k];
+                clearGapBits(newgaps, run[0], run[1]);
+            }
+
+            // sites that do not hold ones yet
+            for (int w=0; w<nwords; w++) {
+                const unsigned int old = row.gapsc[w];
+                row.gapsc[w] = newgaps[w];
+                newgaps[w] &= ~old;
+            }
+            row.fills = runlist.size();
+            row.nfills = findGapRuns(newgaps, seqlen, true, 0, &runlist);
+        }
+    }
+
+    // appends the matrices of a branch and returns their offset
+    int addMatrices(const floatlk *mat)
+    {
+        const int offset = mats.size();
+        const int n = 16 * ncats;
+        mats.ensureSize(offset + n);
+        mats.setSize(offset + n);
+        for (int i=0; i<n; i++)
+            mats[offset + i] = mat[i];
+        return offset;
+    }
+
+    // appends the tip lookup of mat and returns its offset
+    int addLookup(const floatlk *mat)
+    {
+        const int offset = looks.size();
+        const int n = 4 * LK_NCODES * ncats;
+        looks.ensureSize(offset + n);
+        looks.setSize(offset + n);
+        calcLkTipLookupCats(ncats, mat, &looks[offset]);
+        return offset;
+    }
+
+    const floatlk *getLookup(int offset) const
+    {
+        return offset >= 0 ? &looks[offset] : NULL;
+    }
+};
 
 
 //=============================================================================
 
 
+// rows is optional scratch space of 2 rows of 
+// lkRowStride(seqlen, 4 * getLkCats(*model))
 template <class Model, class DModel>
 class DistLikelihoodDeriv
 {
 public:
     DistLikelihoodDeriv(int seqlen, 
-			Model *model, DModel *dmodel) :
+			Model *model, DModel *dmodel, floatlk *rows=NULL) :
         probs1(NULL),
         probs2(NULL),
         seqlen(seqlen),
+        ncats(getLkCats(*model)),
         bgfreq(NULL),
+        weights(NULL),
+        codes1(NULL),
+        codes2(NULL),
         model(model),
 	dmodel(dmodel)
     {
-	probs3 = new floatlk [seqlen*4];
-	probs4 = new floatlk [seqlen*4];
-    }
-    
-    ~DistLikelihoodDeriv()
-    {
-	delete [] probs3;
-	delete [] probs4;
+        const int stride = lkRowStride(seqlen, 4 * ncats);
+        if (!rows)
+            rows = (floatlk*) ownrows.reserve(2 * stride * sizeof(floatlk));
+	probs3 = rows;
+	probs4 = rows + stride;
     }
 
-    void set_params(floatlk *_probs1, floatlk *_probs2, const float *_bgfreq)
+    // weights are the site pattern counts (NULL for one per site)
+    // codes1 and codes2 are the codes of probs1 and probs2 if they are leaves
+    void set_params(floatlk *_probs1, floatlk *_probs2, const float *_bgfreq,
+                    const int *_weights=NULL, 
+                    const unsigned char *_codes1=NULL,
+                    const unsigned char *_codes2=NULL)
     {
         probs1 = _probs1;
         probs2 = _probs2;
-        bgfreq = _bgfreq;
+        bgfreq = freqs;
+        weights = _weights;
+        codes1 = _codes1;
+        codes2 = _codes2;
+        getLkRootFreqs(*model, _bgfreq, freqs);
     }
 
     double operator()(float t)
@@ -80,23 +793,53 @@ public:
         if (t < 0)
             return INFINITY;
 	
+        // transition matrices of g(t, j) and g'(t, j)
+        getLkMatrix(*model, t, amat);
+        getLkMatrix(*model, 0, bmat);
+        getLkMatrix(*dmodel, t, dmat);
+
+	// interate over sequence
+        return parallelSumSites(this, seqlen, 0.0);
+    }
+
+    // derivative of the log likelihood over sites [start, end)
+    double sumSites(int start, int end)
+    {
+        const int n = end - start;
+        const int width = 4 * ncats;
+
+        const floatlk *a = offsetRow(probs1, width*start);
+        const floatlk *b = offsetRow(probs2, width*start);
+        const unsigned char *acodes = offsetRow(codes1, start);
+        const unsigned char *bcodes = offsetRow(codes2, start);
 
 	// g(t, j)
-	calcLkTableRow(seqlen, *model, probs1, probs2, probs3, t, 0);
+	calcLkTableRowMatrix(n, amat, bmat, a, b, probs3 + width*start,
+                             NULL, NULL, NULL, acodes, bcodes, ncats);
 
 	// g'(t, j)
-	calcDerivLkTableRow(seqlen, *dmodel, probs1, probs2, probs4, t);
+	calcDerivLkTableRow(n, dmat, a, b, probs4 + width*start, 
+                            acodes, bcodes, ncats);
 
-
-	// interate over sequence
 	double dlogl = 0.0;
-	for (int j=0; j<seqlen; j++) {
+	for (int j=start; j<end; j++) {
 	    double sum1 = 0.0, sum2 = 0.0;
-	    for (int k=0; k<4; k++) {
-		sum1 += bgfreq[k] * probs3[matind(4,j,k)];
-		sum2 += bgfreq[k] * probs4[matind(4,j,k)];
-	    }
-	    dlogl += sum2 / sum1;
+            const floatlk *row3 = &probs3[matind(width,j,0)];
+            const floatlk *row4 = &probs4[matind(width,j,0)];
+
+            // categories are summed separately, so that their sums
+            // are independent chains of additions
+            for (int r=0; r<width; r+=4) {
+                double cat1 = 0.0, cat2 = 0.0;
+                for (int k=r; k<r+4; k++) {
+                    cat1 += bgfreq[k] * row3[k];
+                    cat2 += bgfreq[k] * row4[k];
+                }
+                sum1 += cat1;
+                sum2 += cat2;
+            }
+	    const double w = weights ? weights[j] : 1.0;
+	    dlogl += w * sum2 / sum1;
 	}
         
 	return dlogl;
@@ -107,41 +850,62 @@ public:
     floatlk *probs3;
     floatlk *probs4;
     int seqlen;
-    const float *bgfreq;
+    int ncats;
+    const float *bgfreq;    // weights of the partials of a site
+    const int *weights;
+    const unsigned char *codes1;
+    const unsigned char *codes2;
     Model *model;
     DModel *dmodel;
+    AlignedBuffer ownrows;
+    float freqs[4*LK_MAX_CATS];
+    floatlk amat[16*LK_MAX_CATS];
+    floatlk bmat[16*LK_MAX_CATS];
+    floatlk dmat[16*LK_MAX_CATS];
 };
 
 
 
+// rows is optional scratch space of 3 rows of
+// lkRowStride(seqlen, 4 * getLkCats(*model))
 template <class Model, class DModel, class D2Model>
 class DistLikelihoodDeriv2
 {
 public:
     DistLikelihoodDeriv2(int seqlen, 			
-                         Model *model, DModel *dmodel, D2Model *d2model) :
+                         Model *model, DModel *dmodel, D2Model *d2model,
+                         floatlk *rows=NULL) :
         seqlen(seqlen),
+        ncats(getLkCats(*model)),
+        weights(NULL),
+        codes1(NULL),
+        codes2(NULL),
         model(model),
 	dmodel(dmodel),
         d2model(d2model)
     {
-	probs3 = new floatlk [seqlen*4];
-	probs4 = new floatlk [seqlen*4];
-        probs5 = new floatlk [seqlen*4];
-    }
-    
-    ~DistLikelihoodDeriv2()
-    {
-	delete [] probs3;
-	delete [] probs4;
-        delete [] probs5;
+        const int stride = lkRowStride(seqlen, 4 * ncats);
+        if (!rows)
+            rows = (floatlk*) ownrows.reserve(3 * stride * sizeof(floatlk));
+	probs3 = rows;
+	probs4 = rows + stride;
+        probs5 = rows + 2 * stride;
     }
 
-    void set_params(floatlk *_probs1, floatlk *_probs2, const float *_bgfreq)
+    // weights are the site pattern counts (NULL for one per site)
+    // codes1 and codes2 are the codes of probs1 and probs2 if they are leaves
+    void set_params(floatlk *_probs1, floatlk *_probs2, const float *_bgfreq,
+                    const int *_weights=NULL, 
+                    const unsigned char *_codes1=NULL,
+                    const unsigned char *_codes2=NULL)
     {
         probs1 = _probs1;
         probs2 = _probs2;
-        bgfreq = _bgfreq;
+        bgfreq = freqs;
+        weights = _weights;
+        codes1 = _codes1;
+        codes2 = _codes2;
+        getLkRootFreqs(*model, _bgfreq, freqs);
     }
 
 
@@ -151,30 +915,95 @@ public:
         if (t < 0)
             return -INFINITY;
 	
+        return derivs(t).d2;
+    }
+
+    // first and second derivative of the log likelihood in one pass
+    LkDerivs derivs(float t)
+    {
+        // transition matrices of g(t, j), g'(t, j) and g''(t, j)
+        getLkMatrix(*model, t, amat);
+        getLkMatrix(*model, 0, bmat);
+        getLkMatrix(*dmodel, t, dmat);
+        getLkMatrix(*d2model, t, d2mat);
+
+	// interate over sequence
+        return parallelSumSites(this, seqlen, LkDerivs());
+    }
+
+    // derivatives of the log likelihood over sites [start, end)
+    LkDerivs sumSites(int start, int end)
+    {
+        const int n = end - start;
+        const int width = 4 * ncats;
+
+        const floatlk *a = offsetRow(probs1, width*start);
+        const floatlk *b = offsetRow(probs2, width*start);
+        const unsigned char *acodes = offsetRow(codes1, start);
+        const unsigned char *bcodes = offsetRow(codes2, start);
+
+        // with rate categories g, g' and g'' of a site are summed directly,
+        // without the rows of the derivatives
+        if (ncats > 1)
+            return sumBranchSites(start, end, a, acodes, b, bcodes);
 
 	// g(t, j)
-	calcLkTableRow(seqlen, *model, probs1, probs2, probs3, t, 0);
+	calcLkTableRowMatrix(n, amat, bmat, a, b, probs3 + width*start,
+                             NULL, NULL, NULL, acodes, bcodes, ncats);
 
 	// g'(t, j)
-	calcDerivLkTableRow(seqlen, *dmodel, probs1, probs2, probs4, t);
+	calcDerivLkTableRow(n, dmat, a, b, probs4 + width*start, 
+                            acodes, bcodes, ncats);
 
 	// g''(t, j)
-	calcDerivLkTableRow(seqlen, *d2model, probs1, probs2, probs5, t);
-
+	calcDerivLkTableRow(n, d2mat, a, b, probs5 + width*start, 
+                            acodes, bcodes, ncats);
 
-	// interate over sequence
-	double d2logl = 0.0;
-	for (int j=0; j<seqlen; j++) {
+	double dlogl = 0.0, d2logl = 0.0;
+	for (int j=start; j<end; j++) {
 	    double g = 0.0, dg = 0.0, d2g = 0.0;
-	    for (int k=0; k<4; k++) {
-		g += bgfreq[k] * probs3[matind(4,j,k)];
-		dg += bgfreq[k] * probs4[matind(4,j,k)];
-                d2g += bgfreq[k] * probs5[matind(4,j,k)];
-	    }
-	    d2logl += - dg*dg/(g*g) + d2g/g;
+            const floatlk *row3 = &probs3[matind(width,j,0)];
+            const floatlk *row4 = &probs4[matind(width,j,0)];
+            const floatlk *row5 = &probs5[matind(width,j,0)];
+
+            // categories are summed separately (see DistLikelihoodDeriv)
+            for (int r=0; r<width; r+=4) {
+                double cat = 0.0, dcat = 0.0, d2cat = 0.0;
+                for (int k=r; k<r+4; k++) {
+                    cat += bgfreq[k] * row3[k];
+                    dcat += bgfreq[k] * row4[k];
+                    d2cat += bgfreq[k] * row5[k];
+                }
+                g += cat;
+                dg += dcat;
+                d2g += d2cat;
+            }
+	    const double w = weights ? weights[j] : 1.0;
+            dlogl += w * dg / g;
+	    d2logl += w * (- dg*dg/(g*g) + d2g/g);
 	}
         
-	return d2logl;
+	return LkDerivs(dlogl, d2logl);
+    }
+
+    LkDerivs sumBranchSites(int start, int end,
+                            const floatlk *a, const unsigned char *acodes,
+                            const floatlk *b, const unsigned char *bcodes)
+    {
+        // the sums fit in the scratch row of g(t, j)
+        floatlk *sums = probs3 + 4*ncats*start;
+        calcBranchSumsCats(end - start, ncats, amat, dmat, d2mat, bgfreq,
+                           a, acodes, b, bcodes, sums);
+
+	double dlogl = 0.0, d2logl = 0.0;
+	for (int j=start, i=0; j<end; j++, i+=3) {
+            const double g = sums[i], dg = sums[i+1], d2g = sums[i+2];
+	    const double w = weights ? weights[j] : 1.0;
+            dlogl += w * dg / g;
+	    d2logl += w * (- dg*dg/(g*g) + d2g/g);
+	}
+
+	return LkDerivs(dlogl, d2logl);
     }
     
     floatlk *probs1;
@@ -183,10 +1012,20 @@ public:
     floatlk *probs4;
     floatlk *probs5;
     int seqlen;
-    const float *bgfreq;
+    int ncats;
+    const float *bgfreq;    // weights of the partials of a site
+    const int *weights;
+    const unsigned char *codes1;
+    const unsigned char *codes2;
     Model *model;
     DModel *dmodel;
     D2Model *d2model;
+    AlignedBuffer ownrows;
+    float freqs[4*LK_MAX_CATS];
+    floatlk amat[16*LK_MAX_CATS];
+    floatlk bmat[16*LK_MAX_CATS];
+    floatlk dmat[16*LK_MAX_CATS];
+    floatlk d2mat[16*LK_MAX_CATS];
 };
 
 
@@ -220,8 +1059,8 @@ extern "C" {
                                 (sum_y P(y|k, t_b) lktable[b][j,y])
 
  */
-floatlk branchLikelihoodHky(floatlk *probs1, floatlk *probs2, int seqlen, 
-                            const float *bgfreq, float kappa, float t)
+double branchLikelihoodHky(floatlk *probs1, floatlk *probs2, int seqlen, 
+                           const float *bgfreq, float kappa, float t)
 {
 
     HkyModel hky(bgfreq, kappa);
@@ -231,15 +1070,8 @@ floatlk branchLikelihoodHky(floatlk *probs1, floatlk *probs2, int seqlen,
     
     calcLkTableRow(seqlen, hky, probs1, probs2, probs3, 0, t);
 
-    floatlk logl = 0.0;
-
     // interate over sequence
-    for (int j=0; j<seqlen; j++) {
-	floatlk sum = 0.0;
-	for (int k=0; k<4; k++)
-	    sum += bgfreq[k] * probs3[matind(4,j,k)];
-	logl += log(sum);
-    }
+    double logl = calcLogLkRow(seqlen, probs3, NULL, bgfreq, NULL);
 
     // free probability table
     delete [] probs3;
@@ -248,8 +1080,8 @@ floatlk branchLikelihoodHky(floatlk *probs1, floatlk *probs2, int seqlen,
 }
 
 
-floatlk branchLikelihoodHkyDeriv(floatlk *probs1, floatlk *probs2, int seqlen, 
-                                 const float *bgfreq, float kappa, float t)
+double branchLikelihoodHkyDeriv(floatlk *probs1, floatlk *probs2, int seqlen, 
+                                const float *bgfreq, float kappa, float t)
 {
     HkyModel hky(bgfreq, kappa);
     HkyModelDeriv dhky(bgfreq, kappa);
@@ -258,9 +1090,9 @@ floatlk branchLikelihoodHkyDeriv(floatlk *probs1, floatlk *probs2, int seqlen,
     return df(t);
 }
 
-floatlk branchLikelihoodHkyDeriv2(floatlk *probs1, floatlk *probs2, 
-                                  int seqlen, 
-                                  const float *bgfreq, float kappa, float t)
+double branchLikelihoodHkyDeriv2(floatlk *probs1, floatlk *probs2, 
+                                 int seqlen, 
+                                 const float *bgfreq, float kappa, float t)
 {
     HkyModel hky(bgfreq, kappa);
     HkyModelDeriv dhky(bgfreq, kappa);
@@ -287,38 +1119,209 @@ floatlk mleDistanceHky(floatlk *probs1, floatlk *probs2, int seqlen,
 
 
 //=============================================================================
-// Dynamic programming of conditional likelihood
+// Site pattern compression
 
 
-class LikelihoodTable 
+// code of a leaf character (see lk_kernels.h).  Characters that are not
+// nucleotides are treated as gaps.
+static inline unsigned char getLeafCode(char c)
 {
-public:
+    const int mask = dna2mask[(int) (unsigned char) c];
+    return mask ? mask : LK_NCODES - 1;
+}
 
-    LikelihoodTable(int nnodes, int seqlen) :
-        nnodes(nnodes),
-        seqlen(seqlen)
-    {
-        // allocate conditional likelihood dynamic programming table
-        lktable = new floatlk* [nnodes];
-        for (int i=0; i<nnodes; i++)
-            lktable[i] = new floatlk [4 * seqlen];
-    }
 
-    ~LikelihoodTable()
-    {
-        // cleanup
-        for (int i=0; i<nnodes; i++)
-            delete [] lktable[i];
-        delete [] lktable;
+SitePatterns::SitePatterns(int nseqs, int seqlen, char **alnseqs) :
+    nseqs(nseqs),
+    seqlen(seqlen),
+    npatterns(0)
+{
+    site2pattern = new int [seqlen];
+
+    // Columns are compared by the leaf codes of their characters, so gaps
+    // and Ns are the same.  Columns are hashed in sequence order to keep 
+    // memory access sequential.
+    ExtendArray<unsigned int> hashes(seqlen);
+    for (int j=0; j<seqlen; j++)
+        hashes[j] = 0;
+    for (int i=0; i<nseqs; i++) {
+        const char *seq = alnseqs[i];
+        for (int j=0; j<seqlen; j++)
+            hashes[j] = hashes[j] * 31 + getLeafCode(seq[j]);
     }
 
-    floatlk **lktable;
-
-    int nnodes;
-    int seqlen;
-    
-};
-
+    // open addressing table of first sites of each pattern
+    int tablesize = 1;
+    while (tablesize < 2 * seqlen)
+        tablesize *= 2;
+    ExtendArray<int> table(tablesize);
+    for (int k=0; k<tablesize; k++)
+        table[k] = -1;
+    ExtendArray<int> firstSite(0, seqlen);
+
+    for (int j=0; j<seqlen; j++) {
+        int pattern = -1;
+        for (int h=hashes[j] & (tablesize - 1); ; h = (h + 1) & (tablesize - 1)) {
+            const int k = table[h];
+            if (k == -1) {
+                // new pattern
+                pattern = npatterns++;
+                table[h] = pattern;
+                firstSite.append(j);
+                break;
+            }
+
+            // compare columns
+            const int j2 = firstSite[k];
+            if (hashes[j2] != hashes[j])
+                continue;
+            bool same = true;
+            for (int i=0; i<nseqs && same; i++)
+                same = (getLeafCode(alnseqs[i][j]) == 
+                        getLeafCode(alnseqs[i][j2]));
+            if (same) {
+                pattern = k;
+                break;
+            }
+        }
+        site2pattern[j] = pattern;
+    }
+
+    // build pattern sequences and weights
+    counts = new int [npatterns];
+    weights = new int [npatterns];
+    for (int k=0; k<npatterns; k++)
+        counts[k] = 0;
+    for (int j=0; j<seqlen; j++)
+        counts[site2pattern[j]]++;
+    setWeights(NULL);
+
+    seqs = new char* [nseqs];
+    codes = new unsigned char* [nseqs];
+    for (int i=0; i<nseqs; i++) {
+        seqs[i] = new char [npatterns + 1];
+        codes[i] = new unsigned char [npatterns];
+        for (int k=0; k<npatterns; k++) {
+            seqs[i][k] = alnseqs[i][firstSite[k]];
+            codes[i][k] = getLeafCode(seqs[i][k]);
+        }
+        seqs[i][npatterns] = '\0';
+    }
+
+    const int nwords = gapMaskWords(npatterns);
+    gaps = new unsigned int* [nseqs];
+    for (int i=0; i<nseqs; i++) {
+        gaps[i] = new unsigned int [nwords];
+        for (int w=0; w<nwords; w++)
+            gaps[i][w] = 0;
+        for (int k=0; k<npatterns; k++)
+            if (codes[i][k] == LK_NCODES - 1)
+                gaps[i][k >> 5] |= 1u << (k & 31);
+    }
+    
+    printLog(LOG_HIGH, "site patterns: %d columns, %d patterns\n", 
+             seqlen, npatterns);
+}
+
+
+SitePatterns::~SitePatterns()
+{
+    for (int i=0; i<nseqs; i++) {
+        delete [] seqs[i];
+        delete [] codes[i];
+        delete [] gaps[i];
+    }
+    delete [] seqs;
+    delete [] codes;
+    delete [] gaps;
+    delete [] weights;
+    delete [] counts;
+    delete [] site2pattern;
+}
+
+
+void SitePatterns::setWeights(const int *_weights)
+{
+    if (!_weights)
+        _weights = counts;
+    for (int k=0; k<npatterns; k++)
+        weights[k] = _weights[k];
+}
+
+
+// Draw a bootstrap replicate of the alignment as weights over its site 
+// patterns.  This is the same as resampling seqlen columns with 
+// replacement (see resampleAlign) without building the new alignment.
+void sampleBootstrapWeights(const SitePatterns &patterns, int *weights)
+{
+    for (int k=0; k<patterns.npatterns; k++)
+        weights[k] = 0;
+    for (int j=0; j<patterns.seqlen; j++)
+        weights[patterns.site2pattern[irand(patterns.seqlen)]]++;
+}
+
+
+//=============================================================================
+// Likelihood tables
+
+
+LikelihoodTable::LikelihoodTable(int nnodes, int seqlen, 
+                                 AlignedBuffer *buffer, int nleaves,
+                                 int ncats) :
+    nnodes(nnodes),
+    seqlen(seqlen),
+    ncats(ncats)
+{
+    // slab layout: row pointers, scale pointers, gap pointers, rows, 
+    // scale rows, gap masks
+    // (leaves have no row or gap mask and share one scale row)
+    const int nrows = nnodes - nleaves;
+    const int nscales = nrows + (nleaves > 0);
+    const size_t ptrsize = lkAlignSize(nnodes * sizeof(floatlk*));
+    const size_t scaleptrsize = lkAlignSize(nnodes * sizeof(int*));
+    const size_t gapptrsize = lkAlignSize(nnodes * sizeof(unsigned int*));
+    const size_t rowsize = lkRowStride(seqlen, 4 * ncats) * sizeof(floatlk);
+    const size_t scalesize = lkAlignSize(seqlen * sizeof(int));
+    const size_t gapsize = lkAlignSize(gapMaskWords(seqlen) * 
+                                       sizeof(unsigned int));
+
+    if (!buffer)
+        buffer = &ownbuffer;
+    char *slab = (char*) buffer->reserve(ptrsize + scaleptrsize + 
+                                         gapptrsize + nrows * rowsize + 
+                                         nscales * scalesize +
+                                         nrows * gapsize);
+
+    lktable = (floatlk**) slab;
+    scale = (int**) (slab + ptrsize);
+    gaps = (unsigned int**) (slab + ptrsize + scaleptrsize);
+    char *rows = slab + ptrsize + scaleptrsize + gapptrsize;
+    char *scalerows = rows + nrows * rowsize;
+    char *gaprows = scalerows + nscales * scalesize;
+    for (int i=0; i<nleaves; i++) {
+        lktable[i] = NULL;
+        scale[i] = (int*) scalerows;
+        gaps[i] = NULL;
+    }
+    for (int i=nleaves; i<nnodes; i++) {
+        lktable[i] = (floatlk*) (rows + (i - nleaves) * rowsize);
+        scale[i] = (int*) (scalerows + (i - nleaves + (nleaves > 0)) * 
+                           scalesize);
+        gaps[i] = (unsigned int*) (gaprows + (i - nleaves) * gapsize);
+    }
+
+    // leaves are never rescaled
+    if (nleaves > 0)
+        for (int j=0; j<seqlen; j++)
+            scale[0][j] = 0;
+
+    // no row holds the partials of gaps yet (see LkRowBatch)
+    memset(gaprows, 0, nrows * gapsize);
+}
+
+
+//=============================================================================
+// Dynamic programming of conditional likelihood
 
 
 /*
@@ -337,218 +1340,1192 @@ public:
 */
 
 
+// conditional likelihood recurrence from transition matrices
+//
+// Children that are leaves are given by their codes (codesa, codesb) 
+// instead of rows.  If scale counts are given, sites of the new row that 
+// are close to underflow are rescaled (see lk_kernels.h).  With ncats rate
+// categories amat and bmat are the matrices of all categories.
+void calcLkTableRowMatrix(int seqlen, const floatlk *amat, const floatlk *bmat,
+                          const floatlk *lktablea, const floatlk *lktableb, 
+                          floatlk *lktablec, const int *scalea,
+                          const int *scaleb, int *scalec,
+                          const unsigned char *codesa,
+                          const unsigned char *codesb, int ncats)
+{
+    // keep a leaf child first
+    if (!codesa && codesb) {
+        swap(amat, bmat);
+        swap(lktablea, lktableb);
+        swap(scalea, scaleb);
+        swap(codesa, codesb);
+    }
+
+    floatlk alook[4*LK_NCODES*LK_MAX_CATS], blook[4*LK_NCODES*LK_MAX_CATS];
+    if (codesa)
+        calcLkTipLookupCats(ncats, amat, alook);
+    if (codesb)
+        calcLkTipLookupCats(ncats, bmat, blook);
+
+    calcLkTableRowLookup(seqlen, amat, bmat, alook, blook,
+                         lktablea, lktableb, lktablec, 
+                         scalea, scaleb, scalec, codesa, codesb, ncats);
+}
+
+
+// calcLkTableRowMatrix with the tip lookups of leaf children already 
+// computed.  A leaf child must come first.
+void calcLkTableRowLookup(int seqlen, const floatlk *amat, 
+                          const floatlk *bmat,
+                          const floatlk *alook, const floatlk *blook,
+                          const floatlk *lktablea, const floatlk *lktableb, 
+                          floatlk *lktablec, const int *scalea,
+                          const int *scaleb, int *scalec,
+                          const unsigned char *codesa,
+                          const unsigned char *codesb, int ncats)
+{
+    // iterate over sites (see lk_kernels.h)
+    if (!codesa)
+        calcLkRowCats(seqlen, ncats, amat, bmat, 
+                      lktablea, lktableb, lktablec);
+    else if (codesb)
+        calcLkTipTipRowCats(seqlen, ncats, alook, codesa, blook, codesb, 
+                            lktablec);
+    else
+        calcLkTipRowCats(seqlen, ncats, alook, codesa, bmat, 
+                         lktableb, lktablec);
+
+    if (scalec)
+        rescaleLkRowCats(seqlen, ncats, lktablec, scalea, scaleb, scalec);
+}
+
+
+// lookup table of the leaf partials themselves (the same in every 
+// category)
+//   look[4*(ncats*m + r) + k] = 1 if base k is in mask m
+static void calcLkLeafLookup(int ncats, floatlk *look)
+{
+    for (int m=0; m<LK_NCODES; m++)
+        for (int r=0; r<ncats; r++)
+            for (int k=0; k<4; k++)
+                look[4*(ncats*m + r) + k] = (m >> k) & 1;
+}
+
+
+// derivative of the conditional likelihood along branch b
+//   c[j,k] = a[j,k] * (sum_y bmat[k,y] b[j,y])
+//
+// When only b is a leaf the branch is taken from the other side, 
+//   c[j,k] = b[j,k] * (sum_x bmat[k,x] a[j,x])
+// which only differs in how the terms of sum_k bgfreq[k] c[j,k] are 
+// grouped, since bmat is the derivative of a reversible model.
+void calcDerivLkTableRow(int seqlen, const floatlk *bmat,
+                         const floatlk *lktablea, const floatlk *lktableb, 
+                         floatlk *lktablec,
+                         const unsigned char *codesa,
+                         const unsigned char *codesb, int ncats)
+{
+    if (!codesa && !codesb) {
+        calcDerivLkRowCats(seqlen, ncats, bmat, lktablea, lktableb, lktablec);
+        return;
+    }
+
+    floatlk leaflook[4*LK_NCODES*LK_MAX_CATS];
+    calcLkLeafLookup(ncats, leaflook);
+
+    if (!codesb) {
+        calcLkTipRowCats(seqlen, ncats, leaflook, codesa, bmat, 
+                         lktableb, lktablec);
+    } else if (!codesa) {
+        calcLkTipRowCats(seqlen, ncats, leaflook, codesb, bmat, 
+                         lktablea, lktablec);
+    } else {
+        floatlk blook[4*LK_NCODES*LK_MAX_CATS];
+        calcLkTipLookupCats(ncats, bmat, blook);
+        calcLkTipTipRowCats(seqlen, ncats, leaflook, codesa, blook, codesb, 
+                            lktablec);
+    }
+}
+
+
 // conditional likelihood recurrence
 template <class Model>
 void calcLkTableRow(int seqlen, Model &model,
 		    floatlk *lktablea, floatlk *lktableb, floatlk *lktablec, 
-		    float adist, float bdist)
+		    float adist, float bdist, const int *scalea,
+                    const int *scaleb, int *scalec)
 {
-    float atransmat[16];
-    float btransmat[16];
+    floatlk amat[16*LK_MAX_CATS];
+    floatlk bmat[16*LK_MAX_CATS];
     
     // build transition matrices
-    model.getMatrix(adist, atransmat);
-    model.getMatrix(bdist, btransmat);
+    getLkMatrix(model, adist, amat);
+    getLkMatrix(model, bdist, bmat);
     
-    // iterate over sites
-    for (int j=0; j<seqlen; j++) {
-        const floatlk *terma = &lktablea[matind(4, j, 0)];
-        const floatlk *termb = &lktableb[matind(4, j, 0)];
-        
-        for (int k=0; k<4; k++) {
-            const float *aptr = &atransmat[4*k];
-            const float *bptr = &btransmat[4*k];
-            
-            // sum_x P(x|k, t_a) lktable[a][j,x]
-            const floatlk prob1 = aptr[0] * terma[0] +
-                                  aptr[1] * terma[1] +
-                                  aptr[2] * terma[2] +
-                                  aptr[3] * terma[3];
-
-            // sum_y P(y|k, t_b) lktable[b][j,y]
-            const floatlk prob2 = bptr[0] * termb[0] +
-                                  bptr[1] * termb[1] +
-                                  bptr[2] * termb[2] +
-                                  bptr[3] * termb[3];
-            
+    calcLkTableRowMatrix(seqlen, amat, bmat, lktablea, lktableb, lktablec,
+                         scalea, scaleb, scalec, NULL, NULL, 
+                         getLkCats(model));
+}
 
-            lktablec[matind(4, j, k)] = prob1 * prob2;
-        }
-    }
+
+// base codes of a leaf (NULL for internal nodes)
+inline const unsigned char *getLeafCodes(SitePatterns &patterns, Node *node)
+{
+    return node->isLeaf() ? patterns.codes[node->name] : NULL;
 }
 
 
-// conditional likelihood recurrence
-template <class DModel>
-void calcDerivLkTableRow(int seqlen, DModel &dmodel,
-			 floatlk *lktablea, floatlk *lktableb, 
-                         floatlk *lktablec, 
-			 float adist)
+// gap mask of row r of a table whose first rows are the leaves
+inline unsigned int *getRowGaps(SitePatterns &patterns, unsigned int **gaps,
+                                int r)
 {
-    float btransmat[16];
-    
-    // build transition matrix
-    dmodel.getMatrix(adist, btransmat);
-    
-    // iterate over sites
-    for (int j=0; j<seqlen; j++) {
-        const floatlk *terma = &lktablea[matind(4, j, 0)];
-        const floatlk *termb = &lktableb[matind(4, j, 0)];
-        
-        for (int k=0; k<4; k++) {
-            //float *aptr = &atransmat[4*k];
-            const float *bptr = &btransmat[4*k];
-            
-            // sum_y P(y|k, t_b) lktable[b][j,y]
-            const floatlk prob2 = bptr[0] * termb[0] +
-                                  bptr[1] * termb[1] +
-                                  bptr[2] * termb[2] +
-                                  bptr[3] * termb[3];
-            
-            lktablec[matind(4, j, k)] = terma[k] * prob2;
-        }
+    return r < patterns.nseqs ? patterns.gaps[r] : gaps[r];
+}
+
+
+// find the nodes whose rows must be computed when the rows of the highest
+// cached subtrees are copied from cache
+static bool *findCachedRows(floatlk** lktable, int **scale, 
+                            unsigned int **gaps, Tree *tree, 
+                            ExtendArray<Node*> &nodes, 
+                            SubtreeRowCache *cache, SubtreeRowKey *keys)
+{
+    const int nnodes = tree->nnodes;
+    bool *compute = new bool [nnodes];
+    bool *needed = new bool [nnodes];
+    for (int i=0; i<nnodes; i++)
+        compute[i] = needed[i] = false;
+    needed[tree->root->name] = true;
+
+    SubtreeRowCache::getKeys(tree, keys);
+    for (int l=nodes.size()-1; l>=0; l--) {
+        Node *node = nodes[l];
+        const int i = node->name;
+        if (node->isLeaf() || !needed[i] ||
+            cache->get(keys[i], lktable[i], scale[i], gaps[i]))
+            continue;
+        compute[i] = true;
+        needed[node->children[0]->name] = true;
+        needed[node->children[1]->name] = true;
     }
+
+    delete [] needed;
+    return compute;
 }
 
 
 // initialize the condition likelihood table
+//
+// With a cache, the rows of cached subtrees are copied and the rows that
+// are computed are added to the cache.
 template <class Model>
-void calcLkTable(floatlk** lktable, Tree *tree, 
-                 int nseqs, int seqlen, char **seqs, Model &model)
+void calcLkTable(floatlk** lktable, int **scale, unsigned int **gaps,
+                 Tree *tree, SitePatterns &patterns, Model &model,
+                 SubtreeRowCache *cache=NULL)
 {
+    const int seqlen = patterns.npatterns;
+
     // recursively calculate cond. lk. of internal nodes
     ExtendArray<Node*> nodes(0, tree->nnodes);
     getTreePostOrder(tree, &nodes);
+    LkRowBatch batch(getLkCats(model));
+
+    SubtreeRowKey *keys = NULL;
+    bool *compute = NULL;
+    if (cache) {
+        assert(cache->npatterns == seqlen && 
+               cache->ncats == getLkCats(model));
+        keys = new SubtreeRowKey [tree->nnodes];
+        compute = findCachedRows(lktable, scale, gaps, tree, nodes, 
+                                 cache, keys);
+    }
     
     for (int l=0; l<nodes.size(); l++) {
         Node *node = nodes[l];
-        int i = node->name;
-        
-        if (node->isLeaf()) {
-            // initialize leaves from sequence
         
-            // iterate over sites
-            for (int j=0; j<seqlen; j++) {
-                int base = dna2int[int(seqs[i][j])];
-
-                if (base == -1) {
-                    // handle gaps
-                    lktable[i][matind(4, j, 0)] = 1.0;
-                    lktable[i][matind(4, j, 1)] = 1.0;
-                    lktable[i][matind(4, j, 2)] = 1.0;
-                    lktable[i][matind(4, j, 3)] = 1.0;
-                } else {
-                    // initialize base
-                    lktable[i][matind(4, j, 0)] = 0.0;
-                    lktable[i][matind(4, j, 1)] = 0.0;
-                    lktable[i][matind(4, j, 2)] = 0.0;
-                    lktable[i][matind(4, j, 3)] = 0.0;
-
-                    lktable[i][matind(4, j, base)] = 1.0;
-                }
-            }
-        } else {
+        if (!node->isLeaf() && (!compute || compute[node->name])) {
             // compute internal nodes from children
             Node *node1 = node->children[0];
             Node *node2 = node->children[1];
             
-            calcLkTableRow(seqlen, model, 
-                           lktable[node1->name], 
-			   lktable[node2->name], 
-			   lktable[node->name],
-                           node1->dist, node2->dist);
+            batch.addRow(model, node1->dist, node2->dist,
+                         lktable[node1->name], 
+                         lktable[node2->name], 
+                         lktable[node->name],
+                         scale[node1->name], scale[node2->name],
+                         scale[node->name],
+                         getLeafCodes(patterns, node1),
+                         getLeafCodes(patterns, node2),
+                         getRowGaps(patterns, gaps, node1->name),
+                         getRowGaps(patterns, gaps, node2->name),
+                         gaps[node->name]);
         }
     }
+
+    batch.run(seqlen);
+
+    if (cache) {
+        for (int l=0; l<nodes.size(); l++) {
+            const int i = nodes[l]->name;
+            if (compute[i])
+                cache->put(keys[i], lktable[i], scale[i], gaps[i]);
+        }
+        delete [] keys;
+        delete [] compute;
+    }
 }
 
 
 // calculate log(P(D | T, B))
+// weights are the site pattern counts (NULL for one per site)
 template <class Model>
-floatlk getTotalLikelihood(floatlk** lktable, Tree *tree, 
-                           int seqlen, Model &model, const float *bgfreq)
+double getTotalLikelihood(floatlk** lktable, int **scale, Tree *tree, 
+                          int seqlen, Model &model, const float *bgfreq,
+                          const int *weights=NULL)
 {
-    // integrate over the background base frequency
-    const floatlk *rootseq = lktable[tree->root->name];
-    floatlk lk = 0.0;
-    for (int k=0; k<seqlen; k++) {
-        floatlk prob = 0.0;
-        for (int x=0; x<4; x++)
-            prob += bgfreq[x] * rootseq[matind(4, k, x)];
-        lk += log(prob);
-    }
-
-    // return log likelihood
-    return lk;
+    float freqs[4*LK_MAX_CATS];
+    getLkRootFreqs(model, bgfreq, freqs);
+    LkRowBatch batch(getLkCats(model));
+    batch.setRoot(lktable[tree->root->name], scale[tree->root->name],
+                  freqs, weights);
+    return batch.run(seqlen);
 }
 
 
 
 template <class Model>
-floatlk calcSeqProb(Tree *tree, int nseqs, char **seqs, 
-                    const float *bgfreq, Model &model)
+double calcSeqProb(Tree *tree, SitePatterns &patterns,
+                   const float *bgfreq, Model &model,
+                   LikelihoodWorkspace *workspace=NULL,
+                   SubtreeRowCache *cache=NULL)
 {
-    int seqlen = strlen(seqs[0]);
+    const int npatterns = patterns.npatterns;
     
-    LikelihoodTable table(tree->nnodes, seqlen);
-    calcLkTable(table.lktable, tree, nseqs, seqlen, seqs, model);
-    floatlk logl = getTotalLikelihood(table.lktable, tree, seqlen, 
-                                      model, bgfreq);
+    LikelihoodTable table(tree->nnodes, npatterns, 
+                          workspace ? &workspace->table : NULL, 
+                          patterns.nseqs, getLkCats(model));
+    calcLkTable(table.lktable, table.scale, table.gaps, tree, patterns, 
+                model, cache);
+    double logl = getTotalLikelihood(table.lktable, table.scale, tree, 
+                                     npatterns, model, bgfreq, 
+                                     patterns.weights);
     
     return logl;
 }
 
+
+double calcSeqProbHky(Tree *tree, SitePatterns &patterns,
+                      const float *bgfreq, float ratio,
+                      LikelihoodWorkspace *workspace)
+{
+    HkyModel hky(bgfreq, ratio);
+    return calcSeqProb(tree, patterns, bgfreq, hky, workspace);
+}
+
+
+double calcSeqProbHky(Tree *tree, SitePatterns &patterns,
+                      const float *bgfreq, float ratio,
+                      SubtreeRowCache *cache, LikelihoodWorkspace *workspace)
+{
+    const float params[5] = {bgfreq[0], bgfreq[1], bgfreq[2], bgfreq[3], 
+                             ratio};
+    cache->setModel(params, 5);
+
+    HkyModel hky(bgfreq, ratio);
+    return calcSeqProb(tree, patterns, bgfreq, hky, workspace, cache);
+}
+
+
+double calcSeqProbGtr(Tree *tree, SitePatterns &patterns,
+                      const float *bgfreq, const float *rates,
+                      LikelihoodWorkspace *workspace)
+{
+    GtrModel gtr(bgfreq, rates);
+    return calcSeqProb(tree, patterns, bgfreq, gtr, workspace);
+}
+
+
+double calcSeqProbHkyGamma(Tree *tree, SitePatterns &patterns,
+                           const float *bgfreq, float kappa,
+                           float alpha, int ncats,
+                           LikelihoodWorkspace *workspace)
+{
+    HkyModel hky(bgfreq, kappa);
+    DiscreteGammaModel<HkyModel> model(&hky, alpha, ncats);
+    return calcSeqProb(tree, patterns, bgfreq, model, workspace);
+}
+
+
+void calcSeqProbHky(Tree *tree, SitePatterns &patterns,
+                    const float *bgfreq, const float *kappas, int nkappas, 
+                    double *logls, LikelihoodWorkspace *workspace)
+{
+    const int npatterns = patterns.npatterns;
+    const int nnodes = tree->nnodes;
+    
+    ExtendArray<Node*> nodes(0, nnodes);
+    getTreePostOrder(tree, &nodes);
+
+    // The first kappa uses the usual rows (indexed by node name).  The
+    // others only need their own rows for the internal nodes, which
+    // follow in blocks of ninternal rows.
+    ExtendArray<int> internal(nnodes);
+    int ninternal = 0;
+    for (int i=0; i<nodes.size(); i++)
+        internal[nodes[i]->name] = nodes[i]->isLeaf() ? -1 : ninternal++;
+    
+    LikelihoodTable table(nnodes + (nkappas - 1) * ninternal, npatterns,
+                          workspace ? &workspace->kappa : NULL, 
+                          patterns.nseqs);
+    ExtendArray<int> rows(nkappas * nnodes);
+    for (int k=0; k<nkappas; k++) {
+        for (int i=0; i<nnodes; i++) {
+            if (k == 0 || internal[i] == -1)
+                rows[k*nnodes + i] = i;
+            else
+                rows[k*nnodes + i] = nnodes + (k-1) * ninternal + internal[i];
+        }
+    }
+    floatlk **lktable = table.lktable;
+    int **scale = table.scale;
+    unsigned int **gaps = table.gaps;
+    
+    // one pass over the tree computes the rows of all kappas
+    ExtendArray<HkyModel*> models(nkappas);
+    for (int k=0; k<nkappas; k++)
+        models[k] = new HkyModel(bgfreq, kappas[k]);
+
+    LkRowBatch batch;
+    for (int l=0; l<nodes.size(); l++) {
+        Node *node = nodes[l];
+        
+        if (node->isLeaf())
+            continue;
+
+        Node *node1 = node->children[0];
+        Node *node2 = node->children[1];
+        for (int k=0; k<nkappas; k++) {
+            const int *r = &rows[k*nnodes];
+            batch.addRow(*models[k], node1->dist, node2->dist,
+                         lktable[r[node1->name]], 
+                         lktable[r[node2->name]], 
+                         lktable[r[node->name]],
+                         scale[r[node1->name]], scale[r[node2->name]],
+                         scale[r[node->name]],
+                         getLeafCodes(patterns, node1),
+                         getLeafCodes(patterns, node2),
+                         getRowGaps(patterns, gaps, r[node1->name]),
+                         getRowGaps(patterns, gaps, r[node2->name]),
+                         gaps[r[node->name]]);
+        }
+    }
+    batch.run(npatterns);
+
+    for (int k=0; k<nkappas; k++) {
+        const int root = rows[k*nnodes + tree->root->name];
+        batch.clear();
+        batch.setRoot(lktable[root], scale[root], bgfreq, patterns.weights);
+        logls[k] = batch.run(npatterns);
+        delete models[k];
+    }
+}
+
+
+// A subtree is identified by its two child subtrees (ordered by id) and
+// the lengths of the branches to them.  Leaf i has id i.
+struct SubtreeKey
+{
+    // lengths are compared by their bits, as HashSubtreeKey hashes them
+    // (so 0.0 and -0.0 are different subtrees)
+    bool operator==(const SubtreeKey &other) const
+    {
+        return child1 == other.child1 && child2 == other.child2 &&
+            memcmp(&dist1, &other.dist1, sizeof(dist1)) == 0 &&
+            memcmp(&dist2, &other.dist2, sizeof(dist2)) == 0;
+    }
+
+    int child1;
+    int child2;
+    float dist1;
+    float dist2;
+};
+
+struct HashSubtreeKey {
+    static unsigned int hash(const SubtreeKey &key)
+    {
+        unsigned int d1, d2;
+        memcpy(&d1, &key.dist1, sizeof(d1));
+        memcpy(&d2, &key.dist2, sizeof(d2));
+        return ((key.child1 * 31 + key.child2) * 31 + d1) * 31 + d2;
+    }
+};
+
+
+void calcSeqProbHky(Tree **trees, int ntrees, SitePatterns &patterns,
+                    const float *bgfreq, float kappa, 
+                    double *logls, LikelihoodWorkspace *workspace)
+{
+    const int npatterns = patterns.npatterns;
+    const int nseqs = patterns.nseqs;
+
+    // give every distinct subtree of all trees an id.  Children get their
+    // ids before their parents, so rows can be computed in id order.
+    int maxnodes = 0;
+    for (int t=0; t<ntrees; t++)
+        maxnodes += trees[t]->nnodes;
+    HashTable<SubtreeKey, int, HashSubtreeKey> ids(2 * maxnodes + 1, -1);
+    ExtendArray<SubtreeKey> subtrees(0, maxnodes);
+    ExtendArray<int> roots(ntrees);
+    ExtendArray<int> nodeids(0, maxnodes);
+    ExtendArray<Node*> nodes(0, maxnodes);
+
+    for (int t=0; t<ntrees; t++) {
+        Tree *tree = trees[t];
+        nodeids.ensureSize(tree->nnodes);
+        nodeids.setSize(tree->nnodes);
+        nodes.clear();
+        getTreePostOrder(tree, &nodes);
+
+        for (int l=0; l<nodes.size(); l++) {
+            Node *node = nodes[l];
+            if (node->isLeaf()) {
+                nodeids[node->name] = node->name;
+                continue;
+            }
+
+            Node *node1 = node->children[0];
+            Node *node2 = node->children[1];
+            if (nodeids[node1->name] > nodeids[node2->name])
+                swap(node1, node2);
+            SubtreeKey key;
+            key.child1 = nodeids[node1->name];
+            key.child2 = nodeids[node2->name];
+            key.dist1 = node1->dist;
+            key.dist2 = node2->dist;
+
+            int id = ids.get(key);
+            if (id == -1) {
+                id = nseqs + subtrees.size();
+                ids.insert(key, id);
+                subtrees.append(key);
+            }
+            nodeids[node->name] = id;
+        }
+        roots[t] = nodeids[tree->root->name];
+    }
+
+    printLog(LOG_HIGH, "seqlikelihood: %d trees, %d distinct subtrees\n",
+             ntrees, subtrees.size());
+
+    // compute the rows of all distinct subtrees in one pass
+    LikelihoodTable table(nseqs + subtrees.size(), npatterns,
+                          workspace ? &workspace->table : NULL, nseqs);
+    floatlk **lktable = table.lktable;
+    int **scale = table.scale;
+    HkyModel hky(bgfreq, kappa);
+    
+    LkRowBatch batch;
+    for (int i=0; i<subtrees.size(); i++) {
+        const SubtreeKey &key = subtrees[i];
+        const int c1 = key.child1;
+        const int c2 = key.child2;
+        batch.addRow(hky, key.dist1, key.dist2,
+                     lktable[c1], lktable[c2], lktable[nseqs + i],
+                     scale[c1], scale[c2], scale[nseqs + i],
+                     c1 < nseqs ? patterns.codes[c1] : NULL,
+                     c2 < nseqs ? patterns.codes[c2] : NULL,
+                     getRowGaps(patterns, table.gaps, c1),
+                     getRowGaps(patterns, table.gaps, c2),
+                     table.gaps[nseqs + i]);
+    }
+    batch.run(npatterns);
+
+    for (int t=0; t<ntrees; t++) {
+        batch.clear();
+        batch.setRoot(lktable[roots[t]], scale[roots[t]], bgfreq, 
+                      patterns.weights);
+        logls[t] = batch.run(npatterns);
+    }
+}
+
+
 extern "C" {
 
-floatlk calcSeqProbHky(Tree *tree, int nseqs, char **seqs, 
+double calcSeqProbHky(Tree *tree, int nseqs, char **seqs, 
                       const float *bgfreq, float ratio)
 {
-    HkyModel hky(bgfreq, ratio);
-    return calcSeqProb(tree, nseqs, seqs, bgfreq, hky);
+    SitePatterns patterns(nseqs, strlen(seqs[0]), seqs);
+    return calcSeqProbHky(tree, patterns, bgfreq, ratio);
+}
+
+
+double calcSeqProbGtr(Tree *tree, int nseqs, char **seqs, 
+                      const float *bgfreq, const float *rates)
+{
+    SitePatterns patterns(nseqs, strlen(seqs[0]), seqs);
+    return calcSeqProbGtr(tree, patterns, bgfreq, rates);
+}
+
+
+double findMLBranchLengthsGtr(Tree *tree, int nseqs, char **seqs, 
+                              const float *bgfreq, const float *rates,
+                              int maxiter)
+{
+    gsl_set_error_handler_off();
+    SitePatterns patterns(nseqs, strlen(seqs[0]), seqs);
+    return findMLBranchLengthsGtr(tree, patterns, bgfreq, rates, maxiter);
+}
+
+
+void calcSeqProbHkyTrees(Tree **trees, int ntrees, int nseqs, char **seqs, 
+                         const float *bgfreq, float ratio, double *logls)
+{
+    SitePatterns patterns(nseqs, strlen(seqs[0]), seqs);
+    calcSeqProbHky(trees, ntrees, patterns, bgfreq, ratio, logls);
 }
 
 } // extern "C"
 
 
 //=============================================================================
-// find MLE branch lengths
+// Persistent likelihood engine
+
+
+LikelihoodEngine::LikelihoodEngine(int nseqs, int seqlen, char **seqs, 
+                                   const float *_bgfreq, float kappa) :
+    nseqs(nseqs),
+    seqlen(seqlen),
+    seqs(seqs),
+    patterns(nseqs, seqlen, seqs),
+    model(_bgfreq, kappa),
+    gammaModel(NULL),
+    ncats(1),
+    nrows_computed(0),
+    nrows_reused(0),
+    nrows_recomputed(0),
+    ncheckpoints(0),
+    maxchain(0),
+    nrows_cached(0),
+    rowCache(NULL),
+    nnodes(0),
+    memlimit(0),
+    maxcheckpoints(0),
+    nscratch(0),
+    table(NULL),
+    batch(new LkRowBatch()),
+    rowKeys(NULL)
+{
+    for (int i=0; i<4; i++)
+        bgfreq[i] = _bgfreq[i];
+}
+
+
+LikelihoodEngine::~LikelihoodEngine()
+{
+    delete table;
+    delete batch;
+    delete gammaModel;
+    delete rowCache;
+    delete [] rowKeys;
+}
 
 
-// rootings are stored as edges (node1, node2).  A root order is 
-// a concatenation of rooting pairs.
-void getRootOrder(Tree *tree, ExtendArray<Node*> *nodes, Node *node=NULL)
+// allocate the state of a tree with 'nnodes' nodes
+void LikelihoodEngine::init(int _nnodes)
 {
-    if (!node) {
-        // start at tree root (but don't include root)
-        getRootOrder(tree, nodes, tree->root->children[0]);
-        getRootOrder(tree, nodes, tree->root->children[1]);
+    nnodes = _nnodes;
+    const int nrows = 2 * nnodes - nseqs;
+
+    valid.setSize(0);
+    child1.setSize(0);
+    child2.setSize(0);
+    dist1.setSize(0);
+    dist2.setSize(0);
+    tablerow.setSize(0);
+    kept.setSize(0);
+    for (int r=0; r<nrows; r++) {
+        valid.append(false);
+        child1.append(-1);
+        child2.append(-1);
+        dist1.append(0.0);
+        dist2.append(0.0);
+
+        // leaves are always available
+        tablerow.append(r < nseqs ? r : -1);
+        kept.append(r < nseqs);
+    }
+
+    dirty.setSize(0);
+    slot.setSize(0);
+    shadowed.setSize(0);
+    changed.setSize(0);
+    checkpoint.setSize(0);
+    cost.setSize(0);
+    location.setSize(0);
+    matrixDist.setSize(0);
+    for (int i=0; i<nnodes; i++) {
+        dirty.append(false);
+        slot.append(0);
+        shadowed.append(false);
+        checkpoint.append(false);
+        cost.append(0);
+        location.append(-1);
+        matrixDist.append(NAN);  // NAN never equals a branch length
+    }
+    matrices.ensureSize(16 * ncats * nnodes);
+    matrices.setSize(16 * ncats * nnodes);
+
+    delete [] rowKeys;
+    rowKeys = new SubtreeRowKey [nnodes];
+
+    nscratch = 0;
+    allocTable();
+}
+
+
+// Allocate the table: one row per leaf (unused), two rows per checkpoint
+// and the scratch rows.  No internal row is kept afterwards.
+void LikelihoodEngine::allocTable()
+{
+    const int ninternal = nnodes - nseqs;
+    const int npatterns = patterns.npatterns;
+    const size_t rowsize = 
+        lkRowStride(npatterns, 4 * ncats) * sizeof(floatlk) +
+        lkAlignSize(npatterns * sizeof(int)) +
+        lkAlignSize(gapMaskWords(npatterns) * sizeof(unsigned int));
+
+    maxcheckpoints = ninternal;
+    if (memlimit > 0 && memlimit / rowsize < (size_t) 2 * ninternal) {
+        const int maxrows = memlimit / rowsize;
+        maxcheckpoints = max(0, (maxrows - nscratch) / 2);
+    } else {
+        nscratch = 0;
+    }
+
+    delete table;
+    table = new LikelihoodTable(nseqs + 2 * maxcheckpoints + nscratch, 
+                                npatterns, NULL, nseqs, ncats);
+
+    for (int r=nseqs; r<tablerow.size(); r++) {
+        tablerow[r] = -1;
+        kept[r] = false;
+    }
+    for (int i=0; i<nnodes; i++)
+        checkpoint[i] = false;
+    ncheckpoints = 0;
+    maxchain = 0;
+
+    freerows.setSize(0);
+    for (int k=2*maxcheckpoints-1; k>=0; k--)
+        freerows.append(nseqs + k);
+
+    // without a limit every internal node is a checkpoint
+    if (maxcheckpoints == ninternal) {
+        for (int i=nseqs; i<nnodes; i++)
+            setCheckpoint(i, true);
     } else {
-        // record pre-process
-        if (node->parent == tree->root) {
-            nodes->append(tree->root->children[0]);
-            nodes->append(tree->root->children[1]);
+        printLog(LOG_MEDIUM, "likelihood memory: rows of %d of %d nodes "
+                 "kept, %d scratch rows (%d KB per row)\n", 
+                 maxcheckpoints, ninternal, nscratch, (int) (rowsize >> 10));
+    }
+}
+
+
+// table row of node in the given slot (leaves only have slot 0)
+inline int LikelihoodEngine::getRow(int node, int s) const
+{
+    return s == 0 ? node : nnodes + node - nseqs;
+}
+
+
+// give internal node i the table rows of a checkpoint, or take them back
+void LikelihoodEngine::setCheckpoint(int i, bool set)
+{
+    if (checkpoint[i] == set)
+        return;
+    checkpoint[i] = set;
+    ncheckpoints += set ? 1 : -1;
+
+    for (int s=0; s<2; s++) {
+        const int r = getRow(i, s);
+        if (set) {
+            tablerow[r] = freerows.pop();
         } else {
-            nodes->append(node);
-            nodes->append(node->parent);
+            freerows.append(tablerow[r]);
+            tablerow[r] = -1;
         }
+        kept[r] = false;
+    }
+}
+
+
+// Number of checkpoints needed so that recomputing a row takes at most
+// 'chain' rows.  Nodes are made checkpoints bottom up once the rows below 
+// them that are not kept exceed the chain.  Afterwards cost[i] is the 
+// number of rows needed to recompute node i, 0 for checkpoints.
+int LikelihoodEngine::countCheckpoints(int chain)
+{
+    int n = 0;
+
+    for (int l=0; l<postorder.size(); l++) {
+        Node *node = postorder[l];
+        const int i = node->name;
+
+        if (node->isLeaf()) {
+            cost[i] = 0;
+            continue;
+        }
+
+        cost[i] = 1 + cost[node->children[0]->name] + 
+                  cost[node->children[1]->name];
+
+        // the root row is needed by every call
+        if (cost[i] > chain || (!node->parent && maxcheckpoints > 0)) {
+            cost[i] = 0;
+            n++;
+        }
+    }
+
+    return n;
+}
+
+
+// choose the checkpoints of the tree in postorder
+void LikelihoodEngine::chooseCheckpoints()
+{
+    // smallest chain whose checkpoints fit (with a chain of nnodes at 
+    // most the root is a checkpoint)
+    int lo = 0, hi = nnodes;
+    while (lo < hi) {
+        const int mid = (lo + hi) / 2;
+        if (countCheckpoints(mid) <= maxcheckpoints)
+            hi = mid;
+        else
+            lo = mid + 1;
+    }
+    maxchain = lo;
+    countCheckpoints(maxchain);
+
+    // free the rows of old checkpoints before taking rows for new ones
+    for (int l=0; l<postorder.size(); l++) {
+        const int i = postorder[l]->name;
+        if (i >= nseqs && cost[i] > 0)
+            setCheckpoint(i, false);
+    }
+    for (int l=0; l<postorder.size(); l++) {
+        const int i = postorder[l]->name;
+        if (i >= nseqs && cost[i] == 0)
+            setCheckpoint(i, true);
+    }
+}
+
+
+// Decide which rows to compute and where.  A row is computed if it is not
+// kept and it is needed by the root or by another computed row.  Rows of
+// checkpoints go to their own table rows, the others to scratch rows that
+// are free again once their parent is computed (the rows of a batch are
+// computed in this order on every tile).  Returns the number of scratch 
+// rows needed.
+int LikelihoodEngine::assignRows(Node *root)
+{
+    // needed rows, top down
+    for (int l=0; l<postorder.size(); l++)
+        location[postorder[l]->name] = -1;
+    location[root->name] = 0;
+    for (int l=postorder.size()-1; l>=0; l--) {
+        Node *node = postorder[l];
+        const int i = node->name;
+        if (location[i] < 0 || kept[getRow(i, slot[i])])
+            continue;
+        location[node->children[0]->name] = 0;
+        location[node->children[1]->name] = 0;
+    }
+
+    // table rows, bottom up
+    const int scratch = nseqs + 2 * maxcheckpoints;
+    int nused = 0;
+    freescratch.setSize(0);
+    for (int l=0; l<postorder.size(); l++) {
+        Node *node = postorder[l];
+        const int i = node->name;
+        const int r = getRow(i, slot[i]);
+
+        if (kept[r]) {
+            location[i] = tablerow[r];
+            continue;
+        }
+        if (location[i] < 0)
+            continue;
+
+        if (tablerow[r] >= 0)
+            location[i] = tablerow[r];
+        else if (freescratch.size() > 0)
+            location[i] = freescratch.pop();
+        else
+            location[i] = scratch + nused++;
+
+        for (int k=0; k<2; k++) {
+            const int c = location[node->children[k]->name];
+            if (c >= scratch)
+                freescratch.append(c);
+        }
+    }
+
+    return nused;
+}
+
 
-        // recurse
-        for (int i=0; i<node->nchildren; i++)
-            getRootOrder(tree, nodes, node->children[i]);
+void LikelihoodEngine::accept()
+{
+    for (int k=0; k<changed.size(); k++)
+        shadowed[changed[k]] = false;
+    changed.setSize(0);
+}
+
+
+void LikelihoodEngine::reject()
+{
+    for (int k=0; k<changed.size(); k++) {
+        const int i = changed[k];
+        slot[i] = 1 - slot[i];
+        shadowed[i] = false;
     }
+    changed.setSize(0);
+}
+
+
+void LikelihoodWorkspace::release()
+{
+    table.release();
+    mltable.release();
+    outside.release();
+    deriv.release();
+    kappa.release();
+}
+
+
+void LikelihoodEngine::setMemoryLimit(size_t bytes)
+{
+    memlimit = bytes;
+    invalidate();
 }
 
+
+void LikelihoodEngine::setRowCache(int maxrows)
+{
+    delete rowCache;
+    rowCache = NULL;
+    if (maxrows > 0)
+        rowCache = new SubtreeRowCache(patterns.npatterns, maxrows, ncats);
+}
+
+
+// transition matrices for the branch above node, rebuilt only if the
+// branch length has changed
+const floatlk *LikelihoodEngine::getNodeMatrix(Node *node)
+{
+    const int i = node->name;
+    floatlk *matrix = &matrices[16 * ncats * i];
+
+    if (matrixDist[i] != node->dist) {
+        if (gammaModel)
+            getLkMatrix(*gammaModel, node->dist, matrix);
+        else
+            getLkMatrix(model, node->dist, matrix);
+        matrixDist[i] = node->dist;
+    }
+
+    return matrix;
+}
+
+
+void LikelihoodEngine::invalidate()
+{
+    delete table;
+    table = NULL;
+}
+
+
+void LikelihoodEngine::setGammaRates(float alpha, int _ncats)
+{
+    delete gammaModel;
+    gammaModel = NULL;
+    if (_ncats > 1)
+        gammaModel = new DiscreteGammaModel<HkyModel>(&model, alpha, _ncats);
+    ncats = _ncats;
+
+    delete batch;
+    batch = new LkRowBatch(ncats);
+    invalidate();
+
+    // cached rows belong to the old rates
+    if (rowCache)
+        setRowCache(rowCache->maxrows);
+}
+
+
+// the weights only enter at the root, so all rows stay valid
+void LikelihoodEngine::setWeights(const int *weights)
+{
+    patterns.setWeights(weights);
+}
+
+
+double LikelihoodEngine::calcSeqProb(Tree *tree)
+{
+    if (!table || nnodes != tree->nnodes)
+        init(tree->nnodes);
+
+    postorder.setSize(0);
+    getTreePostOrder(tree, &postorder);
+    batch->clear();
+
+    // a row changes if its children, their branch lengths, or the rows of
+    // its children have changed since it was last computed
+    for (int l=0; l<postorder.size(); l++) {
+        Node *node = postorder[l];
+        int i = node->name;
+        
+        if (node->isLeaf()) {
+            dirty[i] = false;
+            continue;
+        }
+
+        Node *node1 = node->children[0];
+        Node *node2 = node->children[1];
+        int r = getRow(i, slot[i]);
+
+        if (valid[r] && 
+            child1[r] == node1->name && child2[r] == node2->name &&
+            dist1[r] == node1->dist && dist2[r] == node2->dist &&
+            !dirty[node1->name] && !dirty[node2->name])
+        {
+            dirty[i] = false;
+            nrows_reused++;
+            continue;
+        }
+
+        // the row in use since the last accept() is kept for reject()
+        if (!shadowed[i]) {
+            slot[i] = 1 - slot[i];
+            shadowed[i] = true;
+            changed.append(i);
+            r = getRow(i, slot[i]);
+        }
+
+        valid[r] = true;
+        kept[r] = false;
+        dirty[i] = true;
+        child1[r] = node1->name;
+        child2[r] = node2->name;
+        dist1[r] = node1->dist;
+        dist2[r] = node2->dist;
+    }
+
+    // without a memory limit every row has its own table row, into which 
+    // a cached row can be copied
+    const bool useCache = rowCache && maxcheckpoints == nnodes - nseqs;
+    if (useCache)
+        lookupCachedRows(tree);
+
+    // with a memory limit, recomputing rows that are not kept may need
+    // more scratch rows than the table has
+    if (maxcheckpoints < nnodes - nseqs)
+        chooseCheckpoints();
+    int nused;
+    while ((nused = assignRows(tree->root)) > nscratch) {
+        nscratch = nused;
+        allocTable();
+        chooseCheckpoints();
+    }
+
+    floatlk **lktable = table->lktable;
+    int **scale = table->scale;
+    unsigned int **gaps = table->gaps;
+
+    newrows.setSize(0);
+    for (int l=0; l<postorder.size(); l++) {
+        Node *node = postorder[l];
+        const int i = node->name;
+        const int r = getRow(i, slot[i]);
+        if (node->isLeaf() || kept[r] || location[i] < 0)
+            continue;
+        if (useCache)
+            newrows.append(i);
+
+        Node *node1 = node->children[0];
+        Node *node2 = node->children[1];
+        const int a = location[node1->name];
+        const int b = location[node2->name];
+        const int c = location[i];
+        batch->addRow(getNodeMatrix(node1), getNodeMatrix(node2),
+                      lktable[a], lktable[b], lktable[c],
+                      scale[a], scale[b], scale[c],
+                      getLeafCodes(patterns, node1),
+                      getLeafCodes(patterns, node2),
+                      getRowGaps(patterns, gaps, a),
+                      getRowGaps(patterns, gaps, b),
+                      gaps[c]);
+        if (tablerow[r] >= 0)
+            kept[r] = true;
+        if (dirty[i])
+            nrows_computed++;
+        else
+            nrows_recomputed++;
+    }
+
+    // compute the rows and the total likelihood in one pass
+    const int root = location[tree->root->name];
+    float freqs[4*LK_MAX_CATS];
+    if (gammaModel)
+        getLkRootFreqs(*gammaModel, bgfreq, freqs);
+    else
+        getLkRootFreqs(model, bgfreq, freqs);
+    batch->setRoot(lktable[root], scale[root], freqs, patterns.weights);
+    const double logl = batch->run(patterns.npatterns);
+
+    for (int k=0; k<newrows.size(); k++) {
+        const int c = location[newrows[k]];
+        rowCache->put(rowKeys[newrows[k]], lktable[c], scale[c], gaps[c]);
+    }
+
+    return logl;
+}
+
+
+// Copy the rows that must be computed from the row cache where possible,
+// top down, so that the rows below a cached row are not needed
+void LikelihoodEngine::lookupCachedRows(Tree *tree)
+{
+    SubtreeRowCache::getKeys(tree, rowKeys);
+
+    for (int l=0; l<postorder.size(); l++)
+        location[postorder[l]->name] = -1;
+    location[tree->root->name] = 0;
+
+    for (int l=postorder.size()-1; l>=0; l--) {
+        Node *node = postorder[l];
+        const int i = node->name;
+        const int r = getRow(i, slot[i]);
+        if (node->isLeaf() || location[i] < 0 || kept[r])
+            continue;
+
+        const int row = tablerow[r];
+        if (rowCache->get(rowKeys[i], table->lktable[row], table->scale[row],
+                          table->gaps[row])) 
+        {
+            kept[r] = true;
+            nrows_cached++;
+            continue;
+        }
+        location[node->children[0]->name] = 0;
+        location[node->children[1]->name] = 0;
+    }
+}
+
+
+extern "C" {
+
+LikelihoodEngine *allocLikelihoodEngine(int nseqs, int seqlen, char **seqs,
+                                        const float *bgfreq, float kappa)
+{
+    return new LikelihoodEngine(nseqs, seqlen, seqs, bgfreq, kappa);
+}
+
+
+void freeLikelihoodEngine(LikelihoodEngine *engine)
+{
+    delete engine;
+}
+
+
+double LikelihoodEngine_calcSeqProb(LikelihoodEngine *engine, Tree *tree)
+{
+    return engine->calcSeqProb(tree);
+}
+
+
+void LikelihoodEngine_accept(LikelihoodEngine *engine)
+{
+    engine->accept();
+}
+
+
+void LikelihoodEngine_reject(LikelihoodEngine *engine)
+{
+    engine->reject();
+}
+
+
+int LikelihoodEngine_getRowsComputed(LikelihoodEngine *engine)
+{
+    return engine->nrows_computed;
+}
+
+
+void LikelihoodEngine_setMemoryLimit(LikelihoodEngine *engine, size_t bytes)
+{
+    engine->setMemoryLimit(bytes);
+}
+
+
+int LikelihoodEngine_getCheckpoints(LikelihoodEngine *engine)
+{
+    return engine->ncheckpoints;
+}
+
+
+void LikelihoodEngine_setRowCache(LikelihoodEngine *engine, int maxrows)
+{
+    engine->setRowCache(maxrows);
+}
+
+
+SubtreeRowCache *LikelihoodEngine_getRowCache(LikelihoodEngine *engine)
+{
+    return engine->rowCache;
+}
+
+
+void LikelihoodEngine_setGammaRates(LikelihoodEngine *engine, float alpha,
+                                    int ncats)
+{
+    engine->setGammaRates(alpha, ncats);
+}
+
+} // extern "C"
+
+
+//=============================================================================
+// find MLE branch lengths
+
+
 template <class Model>
 class MLBranchAlgorithm
 {
 public:
 
-    MLBranchAlgorithm(Tree *tree, int seqlen, Model *model) :
-	table(tree->nnodes, seqlen),
+    // if a workspace is given, all tables are taken from it
+    MLBranchAlgorithm(Tree *tree, int seqlen, Model *model,
+                      LikelihoodWorkspace *workspace=NULL) :
+	table(tree->nnodes, seqlen, workspace ? &workspace->mltable : NULL,
+              (tree->nnodes + 1) / 2, getLkCats(*model)),
+        outside(tree->nnodes, seqlen, workspace ? &workspace->outside : NULL,
+                0, getLkCats(*model)),
+        seqlen(seqlen),
+        rootname(tree->root->name),
+        patterns(NULL),
+        weights(NULL),
         model(model),
         dmodel(model->deriv()),
         d2model(dmodel->deriv()),
-        lk_deriv(seqlen, model, dmodel),
-	lk_deriv2(seqlen, model, dmodel, d2model)
+        derivrows(workspace ? 
+                  (floatlk*) workspace->deriv.reserve(
+                      3 * lkRowStride(seqlen, 4 * getLkCats(*model)) * 
+                      sizeof(floatlk)) : NULL),
+        batch(getLkCats(*model)),
+        lk_deriv(seqlen, model, dmodel, derivrows),
+	lk_deriv2(seqlen, model, dmodel, d2model, derivrows)
     {
 
         minx = 0.00001;
@@ -596,47 +2573,50 @@ public:
         return dy;
     }
 
+    // computes both derivatives with one pass over the sites
     static void branch_fdf(double x, void *params, 
                            double *f, double *df)
     {
-        *f = branch_f(x, params);
-        *df = branch_df(x, params);
+        MLBranchAlgorithm *p = (MLBranchAlgorithm*) params;
+        if (x < p->minx || x > p->maxx) {
+            *f = p->lk_deriv(p->minx);
+            *df = *f / (x - p->minx);
+        } else {
+            LkDerivs derivs = p->lk_deriv2.derivs(x);
+            *f = derivs.d1;
+            *df = derivs.d2;
+        }
     }
 
 
     // slower more stable branch fitting
-    float fitBranch2(Tree *tree, const float *bgfreq, float initdist)
+    float fitBranch2(floatlk *probs1, floatlk *probs2, 
+                     const float *bgfreq, float initdist,
+                     const unsigned char *codes1=NULL,
+                     const unsigned char *codes2=NULL)
     {
-        Node *node1 = tree->root->children[0];
-        Node *node2 = tree->root->children[1];
-
-        lk_deriv.set_params(table.lktable[node1->name], 
-                            table.lktable[node2->name], 
-                            bgfreq);
+        lk_deriv.set_params(probs1, probs2, bgfreq, weights, codes1, codes2);
 
         return bisectRoot(lk_deriv, 0.0,
                           max(initdist*10.0, 0.01), .0001);
 
     }
 
-    float fitBranch(Tree *tree, const float *bgfreq, float initdist)
+    // find the MLE length of a branch with partials probs1 and probs2
+    // on either side (codes1 and codes2 are the codes of leaves or NULL)
+    float fitBranch(floatlk *probs1, floatlk *probs2, 
+                    const float *bgfreq, float initdist,
+                    const unsigned char *codes1=NULL,
+                    const unsigned char *codes2=NULL)
     {
         double r = initdist, r0 = initdist;
         const double esp = 1e-3;
 
         if (initdist < minx)
             initdist = minx;
-
-        Node *node1 = tree->root->children[0];
-        Node *node2 = tree->root->children[1];
-        
-        lk_deriv.set_params(table.lktable[node1->name], 
-                            table.lktable[node2->name], 
-                            bgfreq);
         
-        lk_deriv2.set_params(table.lktable[node1->name], 
-                             table.lktable[node2->name], 
-                             bgfreq);
+        lk_deriv.set_params(probs1, probs2, bgfreq, weights, codes1, codes2);
+        lk_deriv2.set_params(probs1, probs2, bgfreq, weights, codes1, codes2);
 
         gsl_root_fdfsolver_set(opt, &opt_func, initdist);
 
@@ -657,7 +2637,7 @@ public:
         //printf("root done iters=%d r=%f\n", iter, r);
 
         if (iter == maxiter || status != GSL_SUCCESS) {
-            r = fitBranch2(tree, bgfreq, initdist);
+            r = fitBranch2(probs1, probs2, bgfreq, initdist, codes1, codes2);
         }
 
         //printf("bisect: %f\n\n", r);
@@ -665,117 +2645,212 @@ public:
         // return final branch length
         return r;
     }
+
+
+    // log likelihood of the tree when the branch between partials
+    // probs1 and probs2 has length dist
+    // (codes1 and codes2 are the codes of leaves or NULL)
+    double branchLikelihood(floatlk *probs1, int *scale1, 
+                            const unsigned char *codes1,
+                            floatlk *probs2, int *scale2,
+                            const unsigned char *codes2,
+                            float dist, const float *bgfreq)
+    {
+        // the outside row of the root is never used, so it serves as
+        // scratch space
+        floatlk *row = outside.lktable[rootname];
+        int *rowscale = outside.scale[rootname];
+
+        batch.clear();
+        batch.addRow(*model, dist, 0.0, probs1, probs2, row, 
+                     scale1, scale2, rowscale, codes1, codes2);
+        batch.setRoot(row, rowscale, rootfreqs, weights);
+        return batch.run(seqlen);
+    }
+
+
+    // Fit one branch and return its new length.  A new length is not 
+    // accepted if it lowers the total likelihood.  Since all partials are
+    // up to date, the likelihood before the change is the current total
+    // logl, which is updated.
+    float fitBranch(floatlk *probs1, int *scale1, 
+                    const unsigned char *codes1,
+                    floatlk *probs2, int *scale2,
+                    const unsigned char *codes2,
+                    float dist, const float *bgfreq, double *logl)
+    {
+        // find new MLE branch length
+        float mle = fitBranch(probs1, probs2, bgfreq, dist, codes1, codes2);
+
+        // get total probability after branch change    
+        double loglAfter = branchLikelihood(probs1, scale1, codes1, 
+                                            probs2, scale2, codes2,
+                                            mle, bgfreq);
         
+        // don't accept a new branch length if it lowers total likelihood
+        if (loglAfter < *logl)
+            return dist;
+        *logl = loglAfter;
+        return mle;
+    }
 
 
+    // Get the partials on the far side of the branch above node and the
+    // length of that branch.  The two branches below the root are treated
+    // as one branch.
+    void getOutside(Node *node, floatlk **probs, int **scale, 
+                    const unsigned char **codes, float *dist)
+    {
+        Node *parent = node->parent;
+        if (parent->parent == NULL) {
+            Node *sib = (parent->children[0] == node) ? 
+                parent->children[1] : parent->children[0];
+            *probs = table.lktable[sib->name];
+            *scale = table.scale[sib->name];
+            *codes = getLeafCodes(*patterns, sib);
+            *dist = node->dist + sib->dist;
+        } else {
+            *probs = outside.lktable[node->name];
+            *scale = outside.scale[node->name];
+            *codes = NULL;
+            *dist = node->dist;
+        }
+    }
+
 
-    floatlk fitBranches(Tree *tree, int nseqs, int seqlen, char **seqs, 
-		      const float *bgfreq, 
-		      ExtendArray<Node*> &rootingOrder)
+    // Fit the branches below node in pre-order.  Before a branch is fit
+    // the outside partials of its child are computed from the outside 
+    // partials of the parent and the (current) inside partials of the 
+    // sibling.  After the subtree is done, the inside row of node is
+    // recomputed from its new branch lengths.
+    void fitSubtree(Node *node, const float *bgfreq, double *logl)
     {
-	float logl = -INFINITY;
-	floatlk **lktable = table.lktable;
+        if (node->isLeaf())
+            return;
+
+        floatlk **lktable = table.lktable;
+        int **scale = table.scale;
+
+        for (int i=0; i<2; i++) {
+            Node *child = node->children[i];
+            Node *sib = node->children[1-i];
+
+            // outside partials of child
+            floatlk *up;
+            int *upscale;
+            const unsigned char *upcodes;
+            float updist;
+            getOutside(node, &up, &upscale, &upcodes, &updist);
+
+            batch.clear();
+            batch.addRow(*model, sib->dist, updist, 
+                         lktable[sib->name], up, 
+                         outside.lktable[child->name],
+                         scale[sib->name], upscale, 
+                         outside.scale[child->name],
+                         getLeafCodes(*patterns, sib), upcodes);
+            batch.run(seqlen);
+
+            // fit branch above child, then its subtree
+            child->dist = fitBranch(lktable[child->name], scale[child->name],
+                                    getLeafCodes(*patterns, child),
+                                    outside.lktable[child->name],
+                                    outside.scale[child->name], NULL,
+                                    child->dist, bgfreq, logl);
+            fitSubtree(child, bgfreq, logl);
+        }
 
-	for (int i=0; i<rootingOrder.size(); i+=2) {
-	    // remembering old children of root
-	    Node *oldnode1 = tree->root->children[0];
-	    Node *oldnode2 = tree->root->children[1];
-
-	    // choose new root
-	    tree->reroot(rootingOrder[i], rootingOrder[i+1]);
-	    if (tree->root->children[0] == oldnode1 &&
-		tree->root->children[1] == oldnode2)
-		continue;	    
-
-	    // rebuild invaild likelihood values
-	    // determine starting node to rebuild
-	    Node *ptr;
-	    if (oldnode1->parent == oldnode2)
-		ptr = oldnode1;
-	    else if (oldnode2->parent == oldnode1)
-		ptr = oldnode2;
-	    else
-		assert(0);
-
-	    // walk up to root of tree, rebuilding conditional likelihoods
-	    for (; ptr; ptr = ptr->parent) {
-		if (!ptr->isLeaf())
-		    calcLkTableRow(seqlen, *model, 
-				   lktable[ptr->children[0]->name], 
-				   lktable[ptr->children[1]->name], 
-				   lktable[ptr->name],
-				   ptr->children[0]->dist, 
-				   ptr->children[1]->dist);
-	    }
-
-	    // get total probability before branch length change
-	    floatlk loglBefore = getTotalLikelihood(lktable, tree, 
-                                                    seqlen, *model, bgfreq);
-
-            Node *node1 = tree->root->children[0];
-            Node *node2 = tree->root->children[1];
-            float initdist = node1->dist + node2->dist;
-
-            // find new MLE branch length for root branch
-            float mle = fitBranch(tree, bgfreq, initdist);
-	    node1->dist = mle / 2.0;
-	    node2->dist = mle / 2.0;
-	
+        // branch lengths below node have changed
+        batch.clear();
+        batch.addRow(*model, node->children[0]->dist, node->children[1]->dist,
+                     lktable[node->children[0]->name], 
+                     lktable[node->children[1]->name], 
+                     lktable[node->name],
+                     scale[node->children[0]->name], 
+                     scale[node->children[1]->name], 
+                     scale[node->name],
+                     getLeafCodes(*patterns, node->children[0]),
+                     getLeafCodes(*patterns, node->children[1]),
+                     getRowGaps(*patterns, table.gaps, 
+                                node->children[0]->name),
+                     getRowGaps(*patterns, table.gaps, 
+                                node->children[1]->name),
+                     table.gaps[node->name]);
+        batch.run(seqlen);
+    }
 
-	    // recompute the root node row in lktable
-	    calcLkTableRow(seqlen, *model, 
-			   lktable[node1->name], 
-			   lktable[node2->name], 
-			   lktable[tree->root->name],
-			   node1->dist, 
-			   node2->dist);
-	
-	    // get total probability after branch change    
-	    logl = getTotalLikelihood(lktable, tree, 
-				      seqlen, *model, bgfreq);
-	
-	    // don't accept a new branch length if it lowers total likelihood
-	    if (logl < loglBefore) {
-	         // revert
-	    	 node1->dist = initdist / 2.0;
-	    	 node2->dist = initdist / 2.0;
-	    	 logl = loglBefore;
-	    	 //assert(0);
-	    }
-        
-	    printLog(LOG_HIGH, "hky: lk=%f\n", logl);        
-	}
 
+    // Fit every branch once.  The inside table must be up to date and 
+    // logl is the current log likelihood.
+    double fitBranches(Tree *tree, const float *bgfreq, double logl)
+    {
+	floatlk **lktable = table.lktable;
+        int **scale = table.scale;
+        Node *node1 = tree->root->children[0];
+        Node *node2 = tree->root->children[1];
+        rootname = tree->root->name;
+
+        // root branch
+        float dist = fitBranch(lktable[node1->name], scale[node1->name],
+                               getLeafCodes(*patterns, node1),
+                               lktable[node2->name], scale[node2->name],
+                               getLeafCodes(*patterns, node2),
+                               node1->dist + node2->dist, bgfreq, &logl);
+        node1->dist = dist / 2.0;
+        node2->dist = dist / 2.0;
+
+        // all other branches
+        fitSubtree(node1, bgfreq, &logl);
+        fitSubtree(node2, bgfreq, &logl);
+
+        // total likelihood with the new branch lengths
+        batch.clear();
+        batch.addRow(*model, node1->dist, node2->dist,
+                     lktable[node1->name], lktable[node2->name], 
+                     lktable[rootname],
+                     scale[node1->name], scale[node2->name], 
+                     scale[rootname],
+                     getLeafCodes(*patterns, node1),
+                     getLeafCodes(*patterns, node2),
+                     getRowGaps(*patterns, table.gaps, node1->name),
+                     getRowGaps(*patterns, table.gaps, node2->name),
+                     table.gaps[rootname]);
+        batch.setRoot(lktable[rootname], scale[rootname], rootfreqs, weights);
+        logl = batch.run(seqlen);
+
+        printLog(LOG_HIGH, "hky: lk=%f\n", logl);
 	return logl;
     }
 
 
-    floatlk fitBranchesConverge(Tree *tree, int nseqs, char **seqs, 
-                                const float *bgfreq,
-                                ExtendArray<Node*> &rootingOrder,
-                                int maxiter=10)
+    double fitBranchesConverge(Tree *tree, SitePatterns &patterns,
+                               const float *bgfreq, int maxiter=10)
     {
-        floatlk lastLogl = -INFINITY, logl = -INFINITY;
-        const floatlk converge = logf(1.002);
+        double lastLogl = -INFINITY, logl = -INFINITY;
+        const double converge = logf(1.002);
     
         // initialize the condition likelihood table
-        int seqlen = strlen(seqs[0]);
-        calcLkTable(table.lktable, tree, nseqs, seqlen, seqs, *model);
-
-
-        // remember original rooting for restoring later
-        Node *origroot1 = tree->root->children[0];
-        Node *origroot2 = tree->root->children[1];
+        this->patterns = &patterns;
+        seqlen = patterns.npatterns;
+        weights = patterns.weights;
+        getLkRootFreqs(*model, bgfreq, rootfreqs);
+        calcLkTable(table.lktable, table.scale, table.gaps, tree, patterns,
+                    *model);
+        logl = getTotalLikelihood(table.lktable, table.scale, tree, seqlen,
+                                  *model, bgfreq, weights);
+
+        // starting lengths that are already near the optimum (e.g. from a
+        // BranchLengthCache) converge in one sweep
+        lastLogl = logl;
     
         // iterate over branches improving each likelihood
         for (int j=0; j<maxiter; j++) {
             printLog(LOG_HIGH, "hky: iter %d\n", j);  
 
-            logl = fitBranches(tree, nseqs, seqlen, seqs, bgfreq, 
-                               rootingOrder);
+            logl = fitBranches(tree, bgfreq, logl);
         
             // determine whether logl has converged
-            floatlk diff = fabs(logl - lastLogl);
+            double diff = fabs(logl - lastLogl);
             if (diff < converge) {
                 //printf("conv %d %f %f\n", j, logl, lastLogl);
                 printLog(LOG_HIGH, "hky: diff = %f < %f\n", diff, converge);
@@ -785,9 +2860,84 @@ public:
             }
             lastLogl = logl;
         }
-    
-        // restore original rooting
-        tree->reroot(origroot1, origroot2);
+
+        return logl;
+    }
+
+
+    // first and second derivative of the log likelihood with respect to
+    // the length of the branch between partials probs1 and probs2
+    LkDerivs branchDerivs(floatlk *probs1, const unsigned char *codes1,
+                          floatlk *probs2, const unsigned char *codes2,
+                          float dist, const float *bgfreq)
+    {
+        lk_deriv2.set_params(probs1, probs2, bgfreq, weights, codes1, codes2);
+        return lk_deriv2.derivs(dist);
+    }
+
+
+    // Add the derivatives of the branches below node to derivs, computing
+    // the outside partials in pre-order as in fitSubtree()
+    void addSubtreeDerivs(Node *node, const float *bgfreq, LkDerivs *derivs)
+    {
+        if (node->isLeaf())
+            return;
+
+        floatlk **lktable = table.lktable;
+        int **scale = table.scale;
+
+        for (int i=0; i<2; i++) {
+            Node *child = node->children[i];
+            Node *sib = node->children[1-i];
+
+            floatlk *up;
+            int *upscale;
+            const unsigned char *upcodes;
+            float updist;
+            getOutside(node, &up, &upscale, &upcodes, &updist);
+
+            batch.clear();
+            batch.addRow(*model, sib->dist, updist, 
+                         lktable[sib->name], up, 
+                         outside.lktable[child->name],
+                         scale[sib->name], upscale, 
+                         outside.scale[child->name],
+                         getLeafCodes(*patterns, sib), upcodes);
+            batch.run(seqlen);
+
+            derivs[child->name] += branchDerivs(
+                lktable[child->name], getLeafCodes(*patterns, child),
+                outside.lktable[child->name], NULL, child->dist, bgfreq);
+            addSubtreeDerivs(child, bgfreq, derivs);
+        }
+    }
+
+
+    // Return the log likelihood of the tree and add to derivs[i] the 
+    // derivatives with respect to the length of the branch above node i.
+    // The two branches below the root are one branch, whose derivatives 
+    // are given to the first child of the root.
+    double calcBranchDerivs(Tree *tree, SitePatterns &patterns,
+                            const float *bgfreq, LkDerivs *derivs)
+    {
+        this->patterns = &patterns;
+        seqlen = patterns.npatterns;
+        weights = patterns.weights;
+        rootname = tree->root->name;
+        getLkRootFreqs(*model, bgfreq, rootfreqs);
+        calcLkTable(table.lktable, table.scale, table.gaps, tree, patterns,
+                    *model);
+        double logl = getTotalLikelihood(table.lktable, table.scale, tree, 
+                                         seqlen, *model, bgfreq, weights);
+
+        Node *node1 = tree->root->children[0];
+        Node *node2 = tree->root->children[1];
+        derivs[node1->name] += branchDerivs(
+            table.lktable[node1->name], getLeafCodes(patterns, node1),
+            table.lktable[node2->name], getLeafCodes(patterns, node2),
+            node1->dist + node2->dist, bgfreq);
+        addSubtreeDerivs(node1, bgfreq, derivs);
+        addSubtreeDerivs(node2, bgfreq, derivs);
 
         return logl;
     }
@@ -806,10 +2956,22 @@ public:
     gsl_root_fdfsolver *opt;
     gsl_function_fdf opt_func;
 
-    LikelihoodTable table;
+    LikelihoodTable table;    // inside partials
+    LikelihoodTable outside;  // partials of everything outside a subtree
+    int seqlen;
+    int rootname;
+    SitePatterns *patterns;
+    const int *weights;
+    float rootfreqs[4*LK_MAX_CATS];   // see getLkRootFreqs
     Model *model;
     typename Model::Deriv *dmodel;
     typename Model::Deriv::Deriv *d2model;
+
+    // lk_deriv and lk_deriv2 are never evaluated at the same time, so
+    // they can share their scratch rows
+    floatlk *derivrows;
+
+    LkRowBatch batch;
     
     DistLikelihoodDeriv<Model, typename Model::Deriv> lk_deriv;
     DistLikelihoodDeriv2<Model, typename Model::Deriv, 
@@ -820,29 +2982,25 @@ public:
 
 // NOTE: assumes binary Tree
 template <class Model>
-floatlk findMLBranchLengths(Tree *tree, int nseqs, char **seqs, 
-                            const float *bgfreq, Model &model,
-                            int maxiter=10, 
-                            double minlen=0.0, double maxlen=10.0)
+double findMLBranchLengths(Tree *tree, SitePatterns &patterns,
+                           const float *bgfreq, Model &model,
+                           int maxiter=10, 
+                           double minlen=0.0, double maxlen=10.0,
+                           LikelihoodWorkspace *workspace=NULL)
 {
     // timing
     Timer timer;
     
 
-    int seqlen = strlen(seqs[0]);
     Timer timer2;
-    MLBranchAlgorithm<Model> mlalg(tree, seqlen, &model);
+    MLBranchAlgorithm<Model> mlalg(tree, patterns.npatterns, &model, 
+                                   workspace);
     mlalg.setBranchRange(minlen, maxlen);
     printLog(LOG_MEDIUM, "mlalloc time: %f\n", timer2.time());
     
     
-    // determine rooting order
-    ExtendArray<Node*> rootingOrder(0, 2*tree->nnodes);
-    getRootOrder(tree, &rootingOrder);
-    
     // perform fitting
-    floatlk logl = mlalg.fitBranchesConverge(tree, nseqs, seqs, bgfreq,
-                                             rootingOrder, maxiter);
+    double logl = mlalg.fitBranchesConverge(tree, patterns, bgfreq, maxiter);
     
     
     printLog(LOG_MEDIUM, "mldist time: %f\n",  timer.time());
@@ -851,48 +3009,695 @@ floatlk findMLBranchLengths(Tree *tree, int nseqs, char **seqs,
 }
 
 
+double findMLBranchLengthsHky(Tree *tree, SitePatterns &patterns,
+                              const float *bgfreq, float kappa, int maxiter,
+                              double minlen, double maxlen,
+                              LikelihoodWorkspace *workspace)
+{
+    HkyModel hky(bgfreq, kappa);
+    return findMLBranchLengths(tree, patterns, bgfreq, hky, maxiter,
+                               minlen, maxlen, workspace);
+}
+
+
+double findMLBranchLengthsGtr(Tree *tree, SitePatterns &patterns,
+                              const float *bgfreq, const float *rates,
+                              int maxiter, double minlen, double maxlen,
+                              LikelihoodWorkspace *workspace)
+{
+    GtrModel gtr(bgfreq, rates);
+    return findMLBranchLengths(tree, patterns, bgfreq, gtr, maxiter,
+                               minlen, maxlen, workspace);
+}
+
+
+double findMLBranchLengthsHkyGamma(Tree *tree, SitePatterns &patterns,
+                                   const float *bgfreq, float kappa,
+                                   float alpha, int ncats, int maxiter, 
+                                   double minlen, double maxlen,
+                                   LikelihoodWorkspace *workspace)
+{
+    HkyModel hky(bgfreq, kappa);
+    DiscreteGammaModel<HkyModel> model(&hky, alpha, ncats);
+    return findMLBranchLengths(tree, patterns, bgfreq, model, maxiter,
+                               minlen, maxlen, workspace);
+}
+
+
 double findMLBranchLengthsHky(Tree *tree, int nseqs, char **seqs, 
                               const float *bgfreq, float kappa, int maxiter,
                               double minlen, double maxlen)
+{
+    SitePatterns patterns(nseqs, strlen(seqs[0]), seqs);
+    return findMLBranchLengthsHky(tree, patterns, bgfreq, kappa, maxiter,
+                                  minlen, maxlen);
+}
+
+
+
+//=============================================================================
+// streaming likelihood
+
+
+// Reads a column file in chunks of columns and compresses each chunk into
+// site patterns
+class AlignmentChunks
+{
+public:
+    AlignmentChunks(MappedAlignment *aln, int chunksize) :
+        aln(aln),
+        chunksize(chunksize),
+        start(0),
+        patterns(NULL),
+        seqs(aln->nseqs)
+    {
+        for (int i=0; i<aln->nseqs; i++)
+            seqs[i] = new char [chunksize + 1];
+    }
+
+    ~AlignmentChunks()
+    {
+        delete patterns;
+        for (int i=0; i<aln->nseqs; i++)
+            delete [] seqs[i];
+    }
+
+    // patterns of the next chunk (NULL after the last chunk)
+    SitePatterns *next()
+    {
+        delete patterns;
+        patterns = NULL;
+        if (start >= aln->seqlen)
+            return NULL;
+
+        const int end = min(start + chunksize, aln->seqlen);
+        aln->getColumns(start, end, seqs);
+        patterns = new SitePatterns(aln->nseqs, end - start, seqs);
+        start = end;
+        return patterns;
+    }
+
+    void rewind()
+    {
+        start = 0;
+    }
+
+    MappedAlignment *aln;
+    int chunksize;
+    int start;
+    SitePatterns *patterns;
+    ExtendArray<char*> seqs;
+};
+
+
+// Log likelihood of the tree summed over all chunks.  If derivs is given,
+// the branch derivatives (see MLBranchAlgorithm::calcBranchDerivs) are
+// summed as well.
+static double calcStreamSeqProbHky(Tree *tree, AlignmentChunks &chunks,
+                                   const float *bgfreq, float kappa, 
+                                   LikelihoodWorkspace *workspace,
+                                   LkDerivs *derivs=NULL)
 {
     HkyModel hky(bgfreq, kappa);
-    return findMLBranchLengths(tree, nseqs, seqs, bgfreq, hky, maxiter,
-                               minlen, maxlen);
+    double logl = 0.0;
+
+    if (derivs)
+        for (int i=0; i<tree->nnodes; i++)
+            derivs[i] = LkDerivs();
+
+    chunks.rewind();
+    SitePatterns *patterns;
+    while ((patterns = chunks.next())) {
+        if (derivs) {
+            MLBranchAlgorithm<HkyModel> mlalg(tree, patterns->npatterns, 
+                                              &hky, workspace);
+            logl += mlalg.calcBranchDerivs(tree, *patterns, bgfreq, derivs);
+        } else {
+            logl += calcSeqProb(tree, *patterns, bgfreq, hky, workspace);
+        }
+    }
+
+    return logl;
+}
+
+
+double calcSeqProbHky(Tree *tree, MappedAlignment *aln,
+                      const float *bgfreq, float kappa, int chunksize)
+{
+    AlignmentChunks chunks(aln, chunksize);
+    LikelihoodWorkspace workspace;
+    return calcStreamSeqProbHky(tree, chunks, bgfreq, kappa, &workspace);
+}
+
+
+// Branches cannot be fit one at a time without a pass over the alignment
+// for each of them, so every iteration takes a Newton step for all 
+// branches at once and halves the steps while the likelihood drops.
+double findMLBranchLengthsHky(Tree *tree, MappedAlignment *aln,
+                              const float *bgfreq, float kappa,
+                              int maxiter, double minlen, double maxlen,
+                              int chunksize)
+{
+    const double converge = logf(1.002);
+    const int maxhalve = 5;
+
+    AlignmentChunks chunks(aln, chunksize);
+    LikelihoodWorkspace workspace;
+    ExtendArray<LkDerivs> derivs(tree->nnodes);
+    ExtendArray<float> dists(tree->nnodes);  // lengths before the step
+    Node *node1 = tree->root->children[0];
+    Node *node2 = tree->root->children[1];
+
+    double logl = calcStreamSeqProbHky(tree, chunks, bgfreq, kappa, 
+                                       &workspace, derivs);
+
+    for (int iter=0; iter<maxiter; iter++) {
+        for (int i=0; i<tree->nnodes; i++) {
+            Node *node = tree->nodes[i];
+            dists[node->name] = node->dist;
+            if (node == tree->root || node == node2)
+                continue;
+
+            const double dist = (node == node1) ? 
+                node1->dist + node2->dist : node->dist;
+            const LkDerivs &d = derivs[node->name];
+            double next;
+            if (d.d2 < 0.0)
+                next = dist - d.d1 / d.d2;
+            else
+                next = (d.d1 > 0.0) ? 2.0 * dist : 0.5 * dist;
+            next = max(minlen, min(maxlen, next));
+
+            if (node == node1)
+                node1->dist = node2->dist = next / 2.0;
+            else
+                node->dist = next;
+        }
+
+        double logl2 = calcStreamSeqProbHky(tree, chunks, bgfreq, kappa, 
+                                            &workspace, derivs);
+        for (int k=0; k<maxhalve && logl2 < logl; k++) {
+            for (int i=0; i<tree->nnodes; i++) {
+                Node *node = tree->nodes[i];
+                node->dist = (node->dist + dists[node->name]) / 2.0;
+            }
+            logl2 = calcStreamSeqProbHky(tree, chunks, bgfreq, kappa, 
+                                         &workspace, derivs);
+        }
+
+        // no step improves the likelihood
+        if (logl2 < logl) {
+            for (int i=0; i<tree->nnodes; i++)
+                tree->nodes[i]->dist = dists[tree->nodes[i]->name];
+            break;
+        }
+
+        const double diff = logl2 - logl;
+        logl = logl2;
+        printLog(LOG_HIGH, "hky stream: iter %d lk=%f\n", iter, logl);
+        if (diff < converge)
+            break;
+    }
+
+    return logl;
+}
+
+
+
+//=============================================================================
+// cache of ML branch lengths
+
+BranchLengthCache::BranchLengthCache(int nleaves, int maxsize) :
+    nleaves(nleaves),
+    maxsize(maxsize),
+    size(0),
+    nwords((nleaves + 31) / 32),
+    lengths(NULL)
+{
+    clear();
+}
+
+
+BranchLengthCache::~BranchLengthCache()
+{
+    delete lengths;
+}
+
+
+void BranchLengthCache::clear()
+{
+    delete lengths;
+    lengths = new HashTable<string, float, HashBytes>(maxsize / 4 + 1, -1.0);
+    size = 0;
+}
+
+
+// compute the leaf set below every node
+void BranchLengthCache::getSplits(Tree *tree)
+{
+    bits.ensureSize(tree->nnodes * nwords);
+    bits.setSize(tree->nnodes * nwords);
+    postorder.setSize(0);
+    getTreePostOrder(tree, &postorder);
+
+    for (int l=0; l<postorder.size(); l++) {
+        Node *node = postorder[l];
+        unsigned int *set = &bits[node->name * nwords];
+        for (int i=0; i<nwords; i++)
+            set[i] = 0;
+
+        if (node->isLeaf()) {
+            set[node->name / 32] |= 1u << (node->name % 32);
+        } else {
+            for (int j=0; j<node->nchildren; j++) {
+                const unsigned int *set2 = 
+                    &bits[node->children[j]->name * nwords];
+                for (int i=0; i<nwords; i++)
+                    set[i] |= set2[i];
+            }
+        }
+    }
+}
+
+
+// The key of the branch above node is the side of its split that does
+// not contain leaf 0.
+string BranchLengthCache::getKey(Node *node)
+{
+    string key(nwords * sizeof(unsigned int), '\0');
+    unsigned int *set = (unsigned int*) &key[0];
+    const unsigned int *below = &bits[node->name * nwords];
+    const bool flip = below[0] & 1;
+
+    for (int i=0; i<nwords; i++)
+        set[i] = flip ? ~below[i] : below[i];
+    if (flip && nleaves % 32)
+        set[nwords - 1] &= (1u << (nleaves % 32)) - 1;
+    return key;
+}
+
+
+// The two branches below the root are one branch of the split, whose 
+// length is divided evenly between them (as in ML fitting).
+int BranchLengthCache::seed(Tree *tree)
+{
+    getSplits(tree);
+    
+    int nseeded = 0;
+    for (int i=0; i<tree->nnodes; i++) {
+        Node *node = tree->nodes[i];
+        if (!node->parent)
+            continue;
+
+        float dist = lengths->get(getKey(node));
+        if (dist < 0.0)
+            continue;
+        if (!node->parent->parent)
+            dist /= 2.0;
+        node->dist = dist;
+        nseeded++;
+    }
+
+    return nseeded;
+}
+
+
+void BranchLengthCache::store(Tree *tree)
+{
+    if (size >= maxsize)
+        clear();
+    getSplits(tree);
+
+    for (int i=0; i<tree->nnodes; i++) {
+        Node *node = tree->nodes[i];
+        Node *parent = node->parent;
+        if (!parent)
+            continue;
+
+        float dist = node->dist;
+        if (!parent->parent) {
+            Node *sib = (parent->children[0] == node) ? 
+                parent->children[1] : parent->children[0];
+            dist += sib->dist;
+        }
+
+        float &length = (*lengths)[getKey(node)];
+        if (length < 0.0)
+            size++;
+        length = dist;
+    }
+}
+
+
+//=============================================================================
+// cache of subtree rows
+
+// finalizer of MurmurHash3
+static inline unsigned long long mixHash(unsigned long long h)
+{
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ULL;
+    h ^= h >> 33;
+    return h;
+}
+
+// hash of the ordered pair (a, b)
+static inline unsigned long long combineHash(unsigned long long a,
+                                             unsigned long long b)
+{
+    return mixHash(a * 0x9e3779b97f4a7c15ULL + b);
+}
+
+
+SubtreeRowCache::SubtreeRowCache(int npatterns, int maxrows, int ncats) :
+    npatterns(npatterns),
+    maxrows(maxrows),
+    ncats(ncats),
+    size(0),
+    nlookups(0),
+    nhits(0),
+    ninserts(0),
+    nevictions(0),
+    rowsize(lkRowStride(npatterns, 4 * ncats) * sizeof(floatlk)),
+    scalesize(lkAlignSize(npatterns * sizeof(int))),
+    gapsize(lkAlignSize(gapMaskWords(npatterns) * sizeof(unsigned int))),
+    index(2 * maxrows + 1, -1),
+    keys(maxrows),
+    prev(maxrows),
+    next(maxrows),
+    head(-1),
+    tail(-1)
+{
+    entries = (char*) buffer.reserve(maxrows * 
+                                     (rowsize + scalesize + gapsize));
+}
+
+
+void SubtreeRowCache::clear()
+{
+    for (int i=0; i<size; i++)
+        index.remove(keys[i]);
+    size = 0;
+    head = tail = -1;
+}
+
+
+void SubtreeRowCache::setModel(const float *_params, int nparams)
+{
+    bool same = (params.size() == nparams);
+    for (int i=0; same && i<nparams; i++)
+        same = (params[i] == _params[i]);
+    if (same)
+        return;
+
+    clear();
+    params.setSize(0);
+    for (int i=0; i<nparams; i++)
+        params.append(_params[i]);
+}
+
+
+// The topology hash of a node combines the hashes of its children in
+// increasing order.  The length hash combines, in the same order, the 
+// length hash of each child and the bits of the length of its branch.
+void SubtreeRowCache::getKeys(Tree *tree, SubtreeRowKey *keys)
+{
+    ExtendArray<Node*> postorder(0, tree->nnodes);
+    getTreePostOrder(tree, &postorder);
+
+    for (int l=0; l<postorder.size(); l++) {
+        Node *node = postorder[l];
+        SubtreeRowKey &key = keys[node->name];
+        if (node->isLeaf()) {
+            key.clade = mixHash(node->name + 1);
+            key.lengths = 0;
+            continue;
+        }
+
+        Node *node1 = node->children[0];
+        Node *node2 = node->children[1];
+        if (keys[node1->name].clade > keys[node2->name].clade)
+            swap(node1, node2);
+        const SubtreeRowKey &key1 = keys[node1->name];
+        const SubtreeRowKey &key2 = keys[node2->name];
+        unsigned int dist1, dist2;
+        memcpy(&dist1, &node1->dist, sizeof(dist1));
+        memcpy(&dist2, &node2->dist, sizeof(dist2));
+
+        key.clade = combineHash(key1.clade, key2.clade);
+        key.lengths = combineHash(combineHash(key1.lengths, dist1),
+                                  combineHash(key2.lengths, dist2));
+    }
+}
+
+
+bool SubtreeRowCache::get(const SubtreeRowKey &key, floatlk *row, 
+                          int *scale, unsigned int *gaps)
+{
+    nlookups++;
+    const int entry = index.get(key);
+    if (entry < 0)
+        return false;
+    nhits++;
+
+    const char *data = entries + entry * (rowsize + scalesize + gapsize);
+    memcpy(row, data, rowsize);
+    memcpy(scale, data + rowsize, npatterns * sizeof(int));
+    memcpy(gaps, data + rowsize + scalesize, 
+           gapMaskWords(npatterns) * sizeof(unsigned int));
+
+    unlink(entry);
+    link(entry);
+    return true;
+}
+
+
+void SubtreeRowCache::put(const SubtreeRowKey &key, const floatlk *row,
+                          const int *scale, const unsigned int *gaps)
+{
+    if (maxrows == 0 || index.get(key) >= 0)
+        return;
+
+    // take a free entry or the least recently used one
+    int entry;
+    if (size < maxrows) {
+        entry = size++;
+    } else {
+        entry = tail;
+        unlink(entry);
+        index.remove(keys[entry]);
+        nevictions++;
+    }
+    ninserts++;
+
+    char *data = entries + entry * (rowsize + scalesize + gapsize);
+    memcpy(data, row, rowsize);
+    memcpy(data + rowsize, scale, npatterns * sizeof(int));
+    memcpy(data + rowsize + scalesize, gaps, 
+           gapMaskWords(npatterns) * sizeof(unsigned int));
+
+    keys[entry] = key;
+    index.insert(key, entry);
+    link(entry);
+}
+
+
+// make entry the most recently used
+void SubtreeRowCache::link(int entry)
+{
+    prev[entry] = -1;
+    next[entry] = head;
+    if (head >= 0)
+        prev[head] = entry;
+    head = entry;
+    if (tail < 0)
+        tail = entry;
+}
+
+
+void SubtreeRowCache::unlink(int entry)
+{
+    if (prev[entry] >= 0)
+        next[prev[entry]] = next[entry];
+    else
+        head = next[entry];
+    if (next[entry] >= 0)
+        prev[next[entry]] = prev[entry];
+    else
+        tail = prev[entry];
+}
+
+
+extern "C" {
+
+// cache of up to maxrows rows for the site patterns of seqs
+SubtreeRowCache *allocSubtreeRowCache(int nseqs, char **seqs, int maxrows)
+{
+    SitePatterns patterns(nseqs, strlen(seqs[0]), seqs);
+    return new SubtreeRowCache(patterns.npatterns, maxrows);
+}
+
+
+void freeSubtreeRowCache(SubtreeRowCache *cache)
+{
+    delete cache;
+}
+
+
+double calcSeqProbHkyCached(Tree *tree, int nseqs, char **seqs, 
+                            const float *bgfreq, float kappa,
+                            SubtreeRowCache *cache)
+{
+    SitePatterns patterns(nseqs, strlen(seqs[0]), seqs);
+    return calcSeqProbHky(tree, patterns, bgfreq, kappa, cache);
+}
+
+
+long long SubtreeRowCache_getLookups(SubtreeRowCache *cache)
+{
+    return cache->nlookups;
+}
+
+
+long long SubtreeRowCache_getHits(SubtreeRowCache *cache)
+{
+    return cache->nhits;
+}
+
+
+long long SubtreeRowCache_getInserts(SubtreeRowCache *cache)
+{
+    return cache->ninserts;
+}
+
+
+long long SubtreeRowCache_getEvictions(SubtreeRowCache *cache)
+{
+    return cache->nevictions;
+}
+
+
+double SubtreeRowCache_getHitRate(SubtreeRowCache *cache)
+{
+    return cache->getHitRate();
 }
 
+} // extern "C"
+
+
+
+// log likelihood of a tree as a function of kappa.  Branch lengths are 
+// refit for each kappa, starting from the lengths of the previous one.
+class KappaLikelihood
+{
+public:
+    KappaLikelihood(Tree *tree, SitePatterns &patterns, const float *bgfreq,
+                    int maxiter, LikelihoodWorkspace *workspace) :
+        tree(tree),
+        patterns(patterns),
+        bgfreq(bgfreq),
+        maxiter(maxiter),
+        workspace(workspace)
+    {}
+
+    double operator()(float kappa)
+    {
+        double logl = findMLBranchLengthsHky(tree, patterns, bgfreq, kappa,
+                                             maxiter, .0001, 10, workspace);
+        printLog(LOG_MEDIUM, "kappa %f: lnl %f\n", kappa, logl);
+        return logl;
+    }
+
+    Tree *tree;
+    SitePatterns &patterns;
+    const float *bgfreq;
+    int maxiter;
+    LikelihoodWorkspace *workspace;
+};
 
 
 double findMLKappaHky(Tree *tree, int nseqs, char **seqs, 
                       const float *bgfreq, float minkappa, float maxkappa,
-                      float kappastep)
+                      float kappastep, LikelihoodWorkspace *workspace)
 {
     const int maxiter = 1;
-    floatlk maxlk = -INFINITY;
-    float maxk = minkappa;
+    const int nscan = 8;
 
     // special case
     if (nseqs < 2)
         return 0.0;
 
-    for (float k=minkappa; k<=maxkappa; k+=kappastep) {
-        float l = findMLBranchLengthsHky(tree, nseqs, seqs, bgfreq, k, 
-                                         maxiter);
-        if (l > maxlk) {
-            maxlk = l;
-            maxk = k;
-        }
+    // compress the alignment and allocate tables once for all values 
+    // of kappa
+    SitePatterns patterns(nseqs, strlen(seqs[0]), seqs);
+    LikelihoodWorkspace localWorkspace;
+    if (!workspace)
+        workspace = &localWorkspace;
+    KappaLikelihood lk(tree, patterns, bgfreq, maxiter, workspace);
+
+    // fit branch lengths for the middle of the range
+    lk((minkappa + maxkappa) / 2.0);
+
+    // scan the range with these branch lengths in one batched traversal
+    float kappas[nscan];
+    double logls[nscan];
+    for (int i=0; i<nscan; i++)
+        kappas[i] = minkappa + i * (maxkappa - minkappa) / (nscan - 1);
+    calcSeqProbHky(tree, patterns, bgfreq, kappas, nscan, logls, workspace);
+
+    // the scan keeps nscan tables, which nothing else needs
+    workspace->kappa.release();
+
+    int best = 0;
+    for (int i=1; i<nscan; i++)
+        if (logls[i] > logls[best])
+            best = i;
+
+    // refine within the neighboring scan points, refitting branch lengths.
+    // The scan used the lengths of the middle kappa, so its bracket can
+    // miss the MLE.  If the MLE converges onto an edge of the bracket, the
+    // bracket is moved one scan interval past that edge.
+    const float width = (maxkappa - minkappa) / (nscan - 1);
+    float lo = kappas[max(best - 1, 0)];
+    float hi = kappas[min(best + 1, nscan - 1)];
+    float kappa = kappas[best];
+    for (int i=0; i<nscan; i++) {
+        kappa = brentMax(lk, lo, hi, kappa, kappastep / 2.0);
+        if (kappa - lo <= kappastep && lo > minkappa) {
+            lo = max(lo - width, minkappa);
+            hi = min(kappa + width, maxkappa);
+        } else if (hi - kappa <= kappastep && hi < maxkappa) {
+            lo = max(kappa - width, minkappa);
+            hi = min(hi + width, maxkappa);
+        } else
+            break;
+        printLog(LOG_MEDIUM, "kappa bracket moved to [%f, %f]\n", lo, hi);
     }
+    return kappa;
+}
+
 
-    return maxk;
+extern "C" {
+
+double findMLKappaHky(Tree *tree, int nseqs, char **seqs, 
+                      const float *bgfreq, float minkappa, float maxkappa,
+                      float kappastep)
+{
+    return findMLKappaHky(tree, nseqs, seqs, bgfreq, minkappa, maxkappa,
+                          kappastep, NULL);
 }
 
+} // extern "C"
+
 
 
 extern "C" {
 
-floatlk findMLBranchLengthsHky(int nnodes, int *ptree, int nseqs, char **seqs, 
-                               float *dists, const float *bgfreq, float ratio, 
-                               int maxiter, bool parsinit)
+double findMLBranchLengthsHky(int nnodes, int *ptree, int nseqs, char **seqs, 
+                              float *dists, const float *bgfreq, float ratio, 
+                              int maxiter, bool parsinit)
 {
     //int seqlen = strlen(seqs[0]);
         
@@ -906,14 +3711,37 @@ floatlk findMLBranchLengthsHky(int nnodes, int *ptree, int nseqs, char **seqs,
     if (parsinit)
         parsimony(&tree, nseqs, seqs);
     
-    floatlk logl = findMLBranchLengthsHky(&tree, nseqs, seqs, bgfreq, 
-                                          ratio, maxiter);
+    double logl = findMLBranchLengthsHky(&tree, nseqs, seqs, bgfreq, 
+                                         ratio, maxiter);
     tree.getDists(dists);
     
     return logl;
 }
 
 
+// streaming likelihood of a column file (-INFINITY if it cannot be read)
+double calcSeqProbHkyFile(Tree *tree, const char *filename,
+                          const float *bgfreq, float kappa, int chunksize)
+{
+    MappedAlignment aln;
+    if (!aln.open(filename))
+        return -INFINITY;
+    return calcSeqProbHky(tree, &aln, bgfreq, kappa, chunksize);
+}
+
+
+double findMLBranchLengthsHkyFile(Tree *tree, const char *filename,
+                                  const float *bgfreq, float kappa, 
+                                  int maxiter, int chunksize)
+{
+    MappedAlignment aln;
+    if (!aln.open(filename))
+        return -INFINITY;
+    return findMLBranchLengthsHky(tree, &aln, bgfreq, kappa, maxiter,
+                                  .0001, 10, chunksize);
+}
+
+
 } // extern C
 
 
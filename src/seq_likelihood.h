@@ -13,21 +13,494 @@
 #define SPIDIR_SEQ_LIKELIHOOD_H
 
 
+#include <string>
+
+#include "HashTable.h"
+#include "hky.h"
+#include "lk_kernels.h"
 #include "Tree.h"
 
 namespace spidir {
 
-typedef double floatlk;
+class LkRowBatch;
+class MappedAlignment;
+class SubtreeRowCache;
+struct SubtreeRowKey;
+template <class Model> class DiscreteGammaModel;
+
+
+// Alignment with identical columns collapsed into unique site patterns
+//
+// Each distinct column is stored once, together with the number of
+// alignment columns that share it.  All likelihood computations iterate
+// over patterns and weight each pattern's log-likelihood by its count.
+class SitePatterns
+{
+public:
+    SitePatterns(int nseqs, int seqlen, char **seqs);
+    ~SitePatterns();
+
+    int nseqs;
+    int seqlen;         // number of columns in the original alignment
+    int npatterns;      // number of unique columns
+    char **seqs;        // sequences restricted to pattern columns
+    unsigned char **codes; // leaf codes of seqs (4-bit base masks)
+    int *weights;       // weight of each pattern in the likelihood
+    int *counts;        // number of columns with each pattern
+    int *site2pattern;  // pattern index of each alignment column
+    unsigned int **gaps;   // gap masks of seqs (code 15, see gapMaskWords)
+
+    // set the weights of the patterns (NULL restores the column counts)
+    void setWeights(const int *weights);
+};
+
+
+// Gap masks have one bit per site, set where every leaf of a subtree is a
+// gap (or any other character with code 15).  The partials of such a site
+// are exactly one, so they do not need to be computed.
+inline int gapMaskWords(int seqlen)
+{
+    return (seqlen + 31) / 32;
+}
+
+
+// draw a bootstrap replicate of the columns as pattern weights
+void sampleBootstrapWeights(const SitePatterns &patterns, int *weights);
+
+
+// conditional likelihood dynamic programming table (one row per node)
+//
+// All rows live in one slab of aligned memory.  If a buffer is given the
+// slab is taken from it (and reused by the next table built on it),
+// otherwise the table allocates its own.  The first nleaves rows are
+// leaves, which are given by their codes (SitePatterns::codes) instead of
+// partials; their rows are NULL, their scale counts are zero and their gap
+// masks are SitePatterns::gaps.  Rows hold the partials of ncats rate
+// categories per site (see lk_kernels.h).
+class LikelihoodTable 
+{
+public:
+    LikelihoodTable(int nnodes, int seqlen, AlignedBuffer *buffer=NULL,
+                    int nleaves=0, int ncats=1);
+
+    floatlk **lktable;
+    int **scale;        // per-site scale counts of each row (lk_kernels.h)
+    unsigned int **gaps;   // sites of each row that hold the partials of
+                           // an all gap subtree (see gapMaskWords)
+
+    int nnodes;
+    int seqlen;
+    int ncats;
+
+protected:
+    AlignedBuffer ownbuffer;
+};
+
+
+// Memory reused by all likelihood computations of one gene family
+// (likelihood evaluation, ML branch lengths, kappa estimation).
+// Computations that can be active at the same time use separate buffers.
+class LikelihoodWorkspace
+{
+public:
+    // free all buffers (they are reallocated by the next computation)
+    void release();
+
+    AlignedBuffer table;    // table of calcSeqProb
+    AlignedBuffer mltable;  // table of ML branch length fitting
+    AlignedBuffer outside;  // outside table of ML branch length fitting
+    AlignedBuffer deriv;    // rows for branch length derivatives
+    AlignedBuffer kappa;    // tables of multiple kappa evaluation
+};
+
+
+// Site tiling
+//
+// A traversal computes all of its rows for one tile of sites before moving
+// on to the next tile, so that the rows of children are still in cache
+// when their parent uses them.
+enum {
+    LK_TILE_OFF = -1,   // compute each row over all sites at once
+    LK_TILE_AUTO = 0    // size tiles to the L2 cache
+};
+
+// set the number of sites per tile (or LK_TILE_OFF, LK_TILE_AUTO)
+void setLkTileSites(int sites=LK_TILE_AUTO);
+
+// number of sites per tile for a traversal of nrows rows over seqlen sites
+// with ncats rate categories
+int getLkTileSites(int nrows, int seqlen, int ncats=1);
+
+
+// Division of the rows of a traversal among the likelihood threads
+enum {
+    LK_SPLIT_AUTO = 0,  // subtrees for many rows per thread and few sites
+    LK_SPLIT_SITES,     // each thread computes every row over its sites
+    LK_SPLIT_SUBTREES   // independent subtrees are separate tasks
+};
+
+extern "C" void setLkSplit(int split=LK_SPLIT_AUTO);
+
+
+// Persistent HKY likelihood engine for one gene family
+//
+// The conditional likelihood table is kept between calls.  For every
+// internal node we remember the children and branch lengths that its row
+// was computed from, so that after a local change to the tree (NNI, SPR,
+// branch length change, or a fresh copy of the tree) only the rows on the
+// paths from the changed nodes to the root are recomputed.
+// Node names must identify the same sequence across calls (leaf i is seqs[i]).
+//
+// Every internal node has two rows.  The first time a node is recomputed
+// after accept() its new row goes to the other slot, so that reject() can
+// return to the rows of the last accepted tree without recomputing them.
+//
+// With a memory limit (setMemoryLimit) only the rows of 'checkpoint' nodes
+// are kept.  The other rows are recomputed from the nearest checkpoints
+// below them whenever an ancestor needs them, in a few scratch rows that
+// are reused as soon as the parent is done.  Checkpoints are chosen for
+// each tree so that recomputing any row takes at most 'maxchain' rows,
+// with the smallest maxchain whose checkpoints fit in the limit.
+//
+// With a row cache (setRowCache) the rows of subtrees from earlier calls,
+// such as those of a rejected proposal that is proposed again, are copied
+// from the cache instead of being recomputed.  The cache is only used
+// without a memory limit.
+class LikelihoodEngine
+{
+public:
+    LikelihoodEngine(int nseqs, int seqlen, char **seqs, 
+                     const float *bgfreq, float kappa);
+    ~LikelihoodEngine();
+
+    // log P(D | T, B) for the current topology and branch lengths of tree
+    double calcSeqProb(Tree *tree);
+
+    // forget all cached rows (e.g. if the sequences change)
+    void invalidate();
+
+    // weigh the site patterns, e.g. by a bootstrap replicate 
+    // (NULL restores the column counts)
+    void setWeights(const int *weights);
+
+    // keep the rows computed since the last accept(), or go back to the
+    // rows in use before them
+    void accept();
+    void reject();
+
+    // keep at most about 'bytes' of rows (0: no limit)
+    void setMemoryLimit(size_t bytes);
+
+    // cache the rows of up to maxrows subtrees (0: no cache)
+    void setRowCache(int maxrows);
+
+    // use ncats discrete gamma rate categories of shape alpha (1 for a
+    // single rate).  Cached rows are dropped.
+    void setGammaRates(float alpha, int ncats);
+
+    int nseqs;
+    int seqlen;
+    char **seqs;
+    SitePatterns patterns;
+    float bgfreq[4];
+    HkyModel model;
+    DiscreteGammaModel<HkyModel> *gammaModel;   // NULL for a single rate
+    int ncats;
+
+    // statistics
+    int nrows_computed;
+    int nrows_reused;
+    int nrows_recomputed;   // unchanged rows that were not kept
+    int ncheckpoints;       // internal nodes whose rows are kept
+    int maxchain;
+    int nrows_cached;       // rows copied from the row cache
+
+    SubtreeRowCache *rowCache;  // NULL without a row cache
+
+protected:
+    void init(int nnodes);
+    void allocTable();
+    int getRow(int node, int slot) const;
+    const floatlk *getNodeMatrix(Node *node);
+    void setCheckpoint(int node, bool set);
+    int countCheckpoints(int chain);
+    void chooseCheckpoints();
+    int assignRows(Node *root);
+    void lookupCachedRows(Tree *tree);
+
+    int nnodes;
+    size_t memlimit;
+    int maxcheckpoints;
+    int nscratch;       // table rows for recomputing rows that are not kept
+    LikelihoodTable *table;
+    LkRowBatch *batch;
+    
+    // the state each internal row was computed from (indexed by row)
+    ExtendArray<bool> valid;
+    ExtendArray<int> child1;
+    ExtendArray<int> child2;
+    ExtendArray<float> dist1;
+    ExtendArray<float> dist2;
+    ExtendArray<int> tablerow;   // table row of checkpoints (else -1)
+    ExtendArray<bool> kept;      // the table row holds it
+
+    // per node
+    ExtendArray<bool> dirty;     // row changed in this call
+    ExtendArray<int> slot;       // slot of the row in use
+    ExtendArray<bool> shadowed;  // recomputed since the last accept()
+    ExtendArray<int> changed;    // nodes with shadowed set
+    ExtendArray<bool> checkpoint;
+    ExtendArray<int> cost;       // rows needed to recompute the row
+    ExtendArray<int> location;   // table row used in this call
+    ExtendArray<Node*> postorder;
+
+    // table rows of checkpoints (two per node) and of scratch rows
+    // that are not in use
+    ExtendArray<int> freerows;
+    ExtendArray<int> freescratch;
+
+    // subtree keys of the nodes and the rows computed in this call, for 
+    // the row cache
+    SubtreeRowKey *rowKeys;
+    ExtendArray<int> newrows;
+
+    // transition matrix of the branch above each node
+    ExtendArray<float> matrixDist;
+    ExtendArray<floatlk> matrices;
+};
+
+
+// hash of a string of raw bytes (which may contain zeros)
+struct HashBytes {
+    static unsigned int hash(const string &s)
+    {
+        unsigned int h = 0;
+        for (unsigned int i=0; i<s.size(); i++)
+            h = h * 31 + (unsigned char) s[i];
+        return h;
+    }
+};
+
+
+// Branch lengths of past ML fits keyed by the split of the leaves that
+// each branch induces (ignoring the root).  Seeding a proposed tree with
+// the lengths of the splits it shares with earlier trees lets ML fitting
+// start close to the optimum.  Leaf i must be sequence i.
+class BranchLengthCache
+{
+public:
+    BranchLengthCache(int nleaves, int maxsize=100000);
+    ~BranchLengthCache();
+
+    // set the lengths of the branches of tree whose splits are known and
+    // return how many were set
+    int seed(Tree *tree);
+
+    // remember the lengths of all branches of tree
+    void store(Tree *tree);
+
+    void clear();
+
+    int nleaves;
+    int maxsize;    // the cache is cleared when it has this many splits
+    int size;
+
+protected:
+    void getSplits(Tree *tree);
+    string getKey(Node *node);
+
+    int nwords;
+    ExtendArray<unsigned int> bits;   // leaf set below each node
+    ExtendArray<Node*> postorder;
+    HashTable<string, float, HashBytes> *lengths;
+
+private:
+    // not copyable
+    BranchLengthCache(const BranchLengthCache &other);
+    BranchLengthCache &operator=(const BranchLengthCache &other);
+};
+
+
+// A subtree is identified by a hash of its topology (which does not depend
+// on the order of children) and a hash of its branch lengths.  Leaf i must
+// be sequence i.
+struct SubtreeRowKey
+{
+    bool operator==(const SubtreeRowKey &other) const
+    {
+        return clade == other.clade && lengths == other.lengths;
+    }
+
+    unsigned long long clade;
+    unsigned long long lengths;
+};
+
+struct HashSubtreeRowKey {
+    static unsigned int hash(const SubtreeRowKey &key)
+    {
+        return (unsigned int) (key.clade ^ key.lengths);
+    }
+};
+
+
+// Rows of subtrees from the likelihoods of earlier trees
+//
+// During a search the same clades with the same branch lengths come back
+// in many proposals, in trees that are new copies.  The cache keeps the
+// rows (with their scale counts and gap masks) of up to maxrows subtrees
+// and drops the least recently used, and calcLkTable copies the row of a
+// cached subtree instead of computing the subtree.  Keys are 128 bits of
+// hashes, which are trusted without comparing subtrees.
+//
+// Rows belong to one set of site patterns and one model.  setModel() drops
+// them when the parameters of the model change.
+class SubtreeRowCache
+{
+public:
+    SubtreeRowCache(int npatterns, int maxrows=1000, int ncats=1);
+
+    // drop all rows (the statistics are kept)
+    void clear();
+
+    // parameters of the model of the rows (e.g. bgfreq and kappa)
+    void setModel(const float *params, int nparams);
+
+    // keys of the subtrees of all nodes of tree (indexed by name)
+    static void getKeys(Tree *tree, SubtreeRowKey *keys);
+
+    // copy the row of a subtree and return true if it is cached
+    bool get(const SubtreeRowKey &key, floatlk *row, int *scale, 
+             unsigned int *gaps);
+
+    // add the row of a subtree
+    void put(const SubtreeRowKey &key, const floatlk *row, const int *scale,
+             const unsigned int *gaps);
+
+    // fraction of the lookups that found their row
+    double getHitRate() const
+    {
+        return nlookups > 0 ? double(nhits) / nlookups : 0.0;
+    }
+
+    int npatterns;
+    int maxrows;
+    int ncats;
+    int size;
+
+    // statistics
+    long long nlookups;
+    long long nhits;
+    long long ninserts;
+    long long nevictions;
+
+protected:
+    void link(int entry);
+    void unlink(int entry);
+
+    // an entry is a row, its scale counts and its gap mask
+    size_t rowsize;
+    size_t scalesize;
+    size_t gapsize;
+    AlignedBuffer buffer;
+    char *entries;
+
+    HashTable<SubtreeRowKey, int, HashSubtreeRowKey> index;
+    ExtendArray<SubtreeRowKey> keys;
+    ExtendArray<int> prev;      // list of entries from the most recently
+    ExtendArray<int> next;      // used (head) to the least (tail)
+    int head;
+    int tail;
+    ExtendArray<float> params;
+
+private:
+    // not copyable
+    SubtreeRowCache(const SubtreeRowCache &other);
+    SubtreeRowCache &operator=(const SubtreeRowCache &other);
+};
+
 
 double findMLBranchLengthsHky(Tree *tree, int nseqs, char **seqs, 
                               const float *bgfreq, float kappa, 
                               int maxiter=100, 
                               double minlen=.0001, double maxlen=10);
 
-template <class Model>
-floatlk getTotalLikelihood(ExtendArray<floatlk*> &lktable, Tree *tree, 
-                           int nseqs, int seqlen, char **seqs, Model &model,
-                           const float *bgfreq);
+double findMLBranchLengthsHky(Tree *tree, SitePatterns &patterns,
+                              const float *bgfreq, float kappa, 
+                              int maxiter=100, 
+                              double minlen=.0001, double maxlen=10,
+                              LikelihoodWorkspace *workspace=NULL);
+
+double calcSeqProbHky(Tree *tree, SitePatterns &patterns,
+                      const float *bgfreq, float kappa,
+                      LikelihoodWorkspace *workspace=NULL);
+
+// the same, with the rows of subtrees kept in cache by earlier calls (for
+// the same patterns)
+double calcSeqProbHky(Tree *tree, SitePatterns &patterns,
+                      const float *bgfreq, float kappa, 
+                      SubtreeRowCache *cache, 
+                      LikelihoodWorkspace *workspace=NULL);
+
+// the same with a nucleotide GTR model (rates as in gtr.h)
+double findMLBranchLengthsGtr(Tree *tree, SitePatterns &patterns,
+                              const float *bgfreq, const float *rates,
+                              int maxiter=100,
+                              double minlen=.0001, double maxlen=10,
+                              LikelihoodWorkspace *workspace=NULL);
+
+double calcSeqProbGtr(Tree *tree, SitePatterns &patterns,
+                      const float *bgfreq, const float *rates,
+                      LikelihoodWorkspace *workspace=NULL);
+
+// the same with HKY and ncats discrete gamma rate categories of shape alpha
+// (see gamma_model.h).  All categories are computed in one traversal.
+double findMLBranchLengthsHkyGamma(Tree *tree, SitePatterns &patterns,
+                                   const float *bgfreq, float kappa,
+                                   float alpha, int ncats,
+                                   int maxiter=100,
+                                   double minlen=.0001, double maxlen=10,
+                                   LikelihoodWorkspace *workspace=NULL);
+
+double calcSeqProbHkyGamma(Tree *tree, SitePatterns &patterns,
+                           const float *bgfreq, float kappa,
+                           float alpha, int ncats,
+                           LikelihoodWorkspace *workspace=NULL);
+
+// log likelihoods logls[i] of a tree for each kappas[i], computed in one 
+// traversal of the tree
+void calcSeqProbHky(Tree *tree, SitePatterns &patterns,
+                    const float *bgfreq, const float *kappas, int nkappas, 
+                    double *logls, LikelihoodWorkspace *workspace=NULL);
+
+// log likelihoods logls[i] of each of ntrees trees (e.g. candidate
+// proposals) over the same sequences.  Subtrees that are shared by several
+// trees (same topology and branch lengths) are computed only once, and the
+// rows of all trees are computed in one pass over the sites.  Leaf i of 
+// every tree must be sequence i.
+void calcSeqProbHky(Tree **trees, int ntrees, SitePatterns &patterns,
+                    const float *bgfreq, float kappa, 
+                    double *logls, LikelihoodWorkspace *workspace=NULL);
+
+
+// Streaming likelihood of long alignments
+//
+// The alignment is read from a column file (MappedAlignment) one chunk of
+// columns at a time, and only the site patterns and tables of one chunk
+// are in memory.  Log likelihoods and their derivatives are sums over
+// chunks, so memory does not depend on the length of the alignment.
+// Leaf i must be sequence i of the file.
+const int LK_CHUNK_SITES = 8192;
+
+double calcSeqProbHky(Tree *tree, MappedAlignment *aln,
+                      const float *bgfreq, float kappa,
+                      int chunksize=LK_CHUNK_SITES);
+
+// ML branch lengths, with one pass over the alignment per iteration
+double findMLBranchLengthsHky(Tree *tree, MappedAlignment *aln,
+                              const float *bgfreq, float kappa,
+                              int maxiter=10,
+                              double minlen=.0001, double maxlen=10,
+                              int chunksize=LK_CHUNK_SITES);
 
 extern "C" {
 
@@ -35,33 +508,86 @@ void makeHkyMatrix(const float *bgfreq, float ratio, float t, float *matrix);
 
 void makeHkyDerivMatrix(const float *bgfreq, float ratio, float t, float *matrix);
 
-floatlk branchLikelihoodHky(floatlk *probs1, floatlk *probs2, int seqlen, 
-                            const float *bgfreq, float kappa, float t);
+double branchLikelihoodHky(floatlk *probs1, floatlk *probs2, int seqlen, 
+                           const float *bgfreq, float kappa, float t);
 
-floatlk branchLikelihoodHkyDeriv(floatlk *probs1, floatlk *probs2, int seqlen, 
-                                 const float *bgfreq, float kappa, float t);
+double branchLikelihoodHkyDeriv(floatlk *probs1, floatlk *probs2, int seqlen, 
+                                const float *bgfreq, float kappa, float t);
 
-floatlk branchLikelihoodHkyDeriv2(floatlk *probs1, floatlk *probs2, 
-                                  int seqlen, 
-                                  const float *bgfreq, float kappa, float t);
+double branchLikelihoodHkyDeriv2(floatlk *probs1, floatlk *probs2, 
+                                 int seqlen, 
+                                 const float *bgfreq, float kappa, float t);
 
 floatlk mleDistanceHky(floatlk *probs1, floatlk *probs2, int seqlen, 
                        const float *bgfreq, float kappa,
                        float t0, float t1);
 
-floatlk calcSeqProbHky(Tree *tree, int nseqs, char **seqs, 
-                     const float *bgfreq, float kappa);
+double calcSeqProbHky(Tree *tree, int nseqs, char **seqs, 
+                      const float *bgfreq, float kappa);
+
+// nucleotide GTR model (rates as in gtr.h)
+double calcSeqProbGtr(Tree *tree, int nseqs, char **seqs, 
+                      const float *bgfreq, const float *rates);
+double findMLBranchLengthsGtr(Tree *tree, int nseqs, char **seqs, 
+                              const float *bgfreq, const float *rates,
+                              int maxiter);
+
+// log likelihoods of several trees (leaf i of every tree is sequence i)
+void calcSeqProbHkyTrees(Tree **trees, int ntrees, int nseqs, char **seqs, 
+                         const float *bgfreq, float kappa, double *logls);
+
+double findMLBranchLengthsHky(int nnodes, int *ptree, int nseqs, char **seqs, 
+                              float *dists, const float *bgfreq, float kappa, 
+                              int maxiter, bool parsinit=false);
 
-floatlk findMLBranchLengthsHky(int nnodes, int *ptree, int nseqs, char **seqs, 
-                               float *dists, const float *bgfreq, float kappa, 
-                               int maxiter, bool parsinit=false);
+// streaming likelihood and ML branch lengths of a column file
+// (-INFINITY if the file cannot be read)
+double calcSeqProbHkyFile(Tree *tree, const char *filename,
+                          const float *bgfreq, float kappa, int chunksize);
+double findMLBranchLengthsHkyFile(Tree *tree, const char *filename,
+                                  const float *bgfreq, float kappa, 
+                                  int maxiter, int chunksize);
 
+// cache of subtree rows (sequence i is leaf i of every tree)
+SubtreeRowCache *allocSubtreeRowCache(int nseqs, char **seqs, int maxrows);
+void freeSubtreeRowCache(SubtreeRowCache *cache);
+double calcSeqProbHkyCached(Tree *tree, int nseqs, char **seqs, 
+                            const float *bgfreq, float kappa,
+                            SubtreeRowCache *cache);
+long long SubtreeRowCache_getLookups(SubtreeRowCache *cache);
+long long SubtreeRowCache_getHits(SubtreeRowCache *cache);
+long long SubtreeRowCache_getInserts(SubtreeRowCache *cache);
+long long SubtreeRowCache_getEvictions(SubtreeRowCache *cache);
+double SubtreeRowCache_getHitRate(SubtreeRowCache *cache);
+
+// persistent likelihood engine
+LikelihoodEngine *allocLikelihoodEngine(int nseqs, int seqlen, char **seqs,
+                                        const float *bgfreq, float kappa);
+void freeLikelihoodEngine(LikelihoodEngine *engine);
+double LikelihoodEngine_calcSeqProb(LikelihoodEngine *engine, Tree *tree);
+void LikelihoodEngine_accept(LikelihoodEngine *engine);
+void LikelihoodEngine_reject(LikelihoodEngine *engine);
+int LikelihoodEngine_getRowsComputed(LikelihoodEngine *engine);
+void LikelihoodEngine_setMemoryLimit(LikelihoodEngine *engine, size_t bytes);
+int LikelihoodEngine_getCheckpoints(LikelihoodEngine *engine);
+void LikelihoodEngine_setRowCache(LikelihoodEngine *engine, int maxrows);
+void LikelihoodEngine_setGammaRates(LikelihoodEngine *engine, float alpha,
+                                    int ncats);
+SubtreeRowCache *LikelihoodEngine_getRowCache(LikelihoodEngine *engine);
+
+// MLE of kappa within [minkappa, maxkappa] to about kappastep
 double findMLKappaHky(Tree *tree, int nseqs, char **seqs, 
                       const float *bgfreq, float minkappa, float maxkappa,
                       float kappastep);
 
 } // extern "C"
 
+
+// findMLKappaHky() with the tables of workspace
+double findMLKappaHky(Tree *tree, int nseqs, char **seqs, 
+                      const float *bgfreq, float minkappa, float maxkappa,
+                      float kappastep, LikelihoodWorkspace *workspace);
+
 } // namespace spidir
 
 #endif // SPIDIR_SEQ_LIKELIHOOD_H
@@ -36,6 +36,7 @@
 #include "seq.h"
 #include "seq_likelihood.h"
 #include "Sequences.h"
+#include "ThreadPool.h"
 #include "treevis.h"
 #include "WGD.h"
 
@@ -81,6 +82,9 @@ public:
 	config.add(new ConfigParam<string>
 		   ("-a", "--align", "<alignment fasta>", &alignfile, 
 		    "sequence alignment in fasta format"));
+	config.add(new ConfigSwitch
+		   ("", "--align-columns", &alignColumns, 
+		    "the alignment is a column file (see writeColumnAlign) instead of fasta"));
 	config.add(new ConfigParam<string>
 		   ("-S", "--smap", "<species map>", &smapfile, 
 		    "gene to species map"));
@@ -110,6 +114,14 @@ public:
 		   ("-f", "--bgfreq", "<A freq>,<C ferq>,<G freq>,<T freq>", 
 		    &bgfreqstr, "",
 		    "background frequencies (default: estimate)"));
+	config.add(new ConfigParam<float>
+		   ("", "--gamma", "<shape alpha>", 
+		    &gammaAlpha, 0.0,
+		    "discrete gamma rate variation among sites (default: 0, one rate)"));
+	config.add(new ConfigParam<int>
+		   ("", "--ncats", "<number of rate categories>", 
+		    &gammaCats, 4,
+		    "number of discrete gamma rate categories (default: 4)"));
 
         // dup/loss model
 	config.add(new ConfigParamComment("Dup/loss evolution model"));
@@ -146,6 +158,10 @@ public:
 		   ("-b", "--boot", "<# bootstraps>", 
 		    &bootiter, 1,
 		    "number of bootstraps to perform (default: 1)"));
+	config.add(new ConfigSwitch
+		   ("", "--boot-align", 
+		    &bootAlign,
+		    "write the alignment of each bootstrap to <outprefix>.boot.align"));
         config.add(new ConfigParam<int>
 		   ("-g", "--proposal-gene-topology", "<proposal type for gene tree topology>", 
 		    &propid, 2,
@@ -193,6 +209,35 @@ public:
 		   ("-x", "--seed", "<random seed number>", 
 		    &seed, 0, 
 		    "use 0 to use time as seed", DEBUG_OPT));
+	config.add(new ConfigSwitch
+		   ("", "--hugepages", 
+		    &hugePages,
+		    "back likelihood tables with huge pages", DEBUG_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--threads", "<number of threads>",
+                    &threads, 1,
+                    "threads used to compute sequence likelihoods (default: 1)",
+                    DEBUG_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--lk-tile", "<number of sites>",
+                    &lkTile, LK_TILE_AUTO,
+                    "sites per tile of likelihood traversals (0: fit L2 cache, -1: no tiling, default: 0)",
+                    DEBUG_OPT));
+        config.add(new ConfigParam<string>
+                   ("", "--lk-split", "auto|sites|subtrees",
+                    &lkSplit, "auto",
+                    "divide likelihood rows among threads by sites or by subtrees (default: auto)",
+                    DEBUG_OPT));
+        config.add(new ConfigParam<float>
+                   ("", "--lk-memory", "<megabytes>",
+                    &lkMemory, 0.0,
+                    "memory for kept likelihood rows, others are recomputed; ML fitting tables are freed after each fit (0: no limit, default: 0)",
+                    DEBUG_OPT));
+        config.add(new ConfigParam<int>
+                   ("", "--lk-cache", "<number of rows>",
+                    &lkCache, 0,
+                    "cache the likelihood rows of this many subtrees of earlier proposals, used without --lk-memory (0: no cache, default: 0)",
+                    DEBUG_OPT));
 
         // help information
 	config.add(new ConfigParamComment("Information"));
@@ -262,6 +307,7 @@ public:
     printLog(LOG_LOW, "SPIMAP executed with the following parameters\n");
     printLog(LOG_LOW, "-propGT (0 for NNI, 1 for SPR, 2 for SubtreeSlide) %d\n", propid);
     printLog(LOG_LOW, "-a %s\n", alignfile.c_str());
+    printLog(LOG_LOW, "--align-columns %d\n", alignColumns);
     printLog(LOG_LOW, "-S %s\n", smapfile.c_str());
     printLog(LOG_LOW, "-s %s\n", streefile.c_str());
     printLog(LOG_LOW, "-p %s\n", paramsfile.c_str());
@@ -269,6 +315,8 @@ public:
     printLog(LOG_LOW, "-r (1 true, 0 false) %d\n", outputRecon);
     printLog(LOG_LOW, "-k  %f\n", kappa);
     printLog(LOG_LOW, " -f %s\n", bgfreqstr.c_str());
+    printLog(LOG_LOW, "--gamma %f\n", gammaAlpha);
+    printLog(LOG_LOW, "--ncats %d\n", gammaCats);
     printLog(LOG_LOW, "-duprate %f\n", duprate);
     printLog(LOG_LOW, "-lossrate %f\n", lossrate);  
     printLog(LOG_LOW, "--lineagesatroot %f\n", q);
@@ -277,6 +325,7 @@ public:
     printLog(LOG_LOW, "-niter %d\n", niter);
     printLog(LOG_LOW, "-- quickiter %d\n", quickiter);
     printLog(LOG_LOW, "-b %d\n", bootiter);
+    printLog(LOG_LOW, "--boot-align %d\n", bootAlign);
     printLog(LOG_LOW, "-g (0 for NNI, 1 for SPR, 2 for SubtreeSlide) %d\n", propid);
     printLog(LOG_LOW, "--mcmc (1 for MCMC and 0 for MAP) %d\n", method);
     printLog(LOG_LOW, "-x %d\n", seed);
@@ -288,6 +337,12 @@ public:
     printLog(LOG_LOW, "--lkiter %d\n",  lkiter);
     printLog(LOG_LOW, "--minlen %f\n", minlen);
     printLog(LOG_LOW, "--maxlen %f\n", maxlen);
+    printLog(LOG_LOW, "--hugepages %d\n", hugePages);
+    printLog(LOG_LOW, "--threads %d\n", threads);
+    printLog(LOG_LOW, "--lk-tile %d\n", lkTile);
+    printLog(LOG_LOW, "--lk-split %s\n", lkSplit.c_str());
+    printLog(LOG_LOW, "--lk-memory %f\n", lkMemory);
+    printLog(LOG_LOW, "--lk-cache %d\n", lkCache);
     printLog(LOG_LOW, "-V %d\n", verbose);
     printLog(LOG_LOW, "--treeSampled (1 true, 0 false) %d\n", keepTreeSampled);
     printLog(LOG_LOW, "--informationduploss (1 true, 0 false) %d\n", keepDupLoss);
@@ -295,6 +350,7 @@ public:
     printLog(LOG_LOW, "-h %d\n", help);
     printLog(LOG_LOW, "--help-debug %d\n", help_debug);
     printLog(LOG_LOW, "--log %s\n", logfile.c_str());
+    printLog(LOG_LOW, "likelihood kernel: %s\n", getLkKernelName());
     printLog(LOG_LOW, "\n\n");
   }
   
@@ -304,6 +360,7 @@ public:
 
     // input/output
     string alignfile;
+    bool alignColumns;
     string smapfile;
     string streefile;
     string paramsfile;
@@ -313,6 +370,8 @@ public:
     // sequence model
     float kappa;
     string bgfreqstr;
+    float gammaAlpha;
+    int gammaCats;
 
     // dup/loss model
     float duprate;
@@ -325,6 +384,7 @@ public:
     int niter;
     int quickiter;
     int bootiter;
+    bool bootAlign;
     int propid;
     int method;
 
@@ -338,6 +398,12 @@ public:
     int lkiter;
     float minlen;
     float maxlen;
+    bool hugePages;
+    int threads;
+    int lkTile;
+    string lkSplit;
+    float lkMemory;
+    int lkCache;
 
     // help/information
     int verbose;
@@ -351,9 +417,42 @@ public:
 };
 
 
+// build the alignment of a bootstrap replicate given by pattern weights
+// (the columns of each pattern are adjacent)
+void makeBootAlign(Sequences *aln, SitePatterns &patterns, 
+                   const int *weights, Sequences *bootAln)
+{
+    for (int i=0; i<aln->nseqs; i++) {
+        int j = 0;
+        for (int k=0; k<patterns.npatterns; k++)
+            for (int w=0; w<weights[k]; w++)
+                bootAln->seqs[i][j++] = patterns.seqs[i][k];
+    }
+}
+
+
+void writeBootAlign(FILE *stream, Sequences *aln, Sequences *bootAln)
+{
+    for (int i=0; i<aln->nseqs; i++)
+        fprintf(stream, ">%s\n%s\n", aln->names[i].c_str(), 
+                bootAln->seqs[i]);
+}
+
+
 // perform bootstrapping
-bool bootstrap(Sequences *aln, string *genes, TreeSearch *search,
-	       int bootiter, string outprefix)
+//
+// Each replicate is a vector of weights over the site patterns of the
+// alignment, which the sequence likelihood uses in place of the column
+// counts.  The columns of the replicate are still built for its initial
+// tree (neighbor joining rooted by stree) and the parsimony lengths of its
+// search.  The search outputs of replicate i are written with the prefix 
+// <outprefix>.boot.<i>.
+bool bootstrap(Sequences *aln, string *genes,
+               SpeciesTree *stree, int *gene2species,
+               TreeSearchClimb *search,
+               HkySeqLikelihood *seqlikelihood,
+	       int bootiter, string outprefix, bool bootAlign,
+               int method, int observingsomething)
 {
     // bootstrap
     if (bootiter > 1) {  
@@ -369,36 +468,51 @@ bool bootstrap(Sequences *aln, string *genes, TreeSearch *search,
 	    return false;
 	}
             
-	if (! (bootAlignfile = fopen(bootAlignFilename.c_str(), "w"))) {
+	if (bootAlign && 
+            ! (bootAlignfile = fopen(bootAlignFilename.c_str(), "w"))) {
 	    printError("cannot open '%s' for writing", bootAlignFilename.c_str());
+	    fclose(bootfile);
 	    return false;
 	}
 
-	// create blank alignment for bootstrapping
-	Sequences aln2;
-	aln2.alloc(aln->nseqs, aln->seqlen);
-	for (int i=0; i<aln->nseqs; i++)
-	    aln2.names[i] = aln->names[i];
+	SitePatterns &patterns = seqlikelihood->engine.patterns;
+	ExtendArray<int> weights(patterns.npatterns);
+	Sequences bootAln;
+	bootAln.alloc(aln->nseqs, aln->seqlen);
 
 	for (int i=1; i<=bootiter; i++) {
 	    printLog(LOG_LOW, "bootstrap %d of %d\n", i, bootiter);
-	    resampleAlign(aln, &aln2);
+	    sampleBootstrapWeights(patterns, weights);
+	    seqlikelihood->setWeights(weights);
+	    makeBootAlign(aln, patterns, weights, &bootAln);
             
-	    boottree = search->search(NULL, genes, 
-				      aln2.nseqs, aln2.seqlen, aln2.seqs);
+	    Tree *inittree = getInitialTree(genes, bootAln.nseqs, 
+                                            bootAln.seqlen, bootAln.seqs,
+                                            stree, gene2species);
+
+	    char bootPrefix[32];
+	    snprintf(bootPrefix, sizeof(bootPrefix), ".boot.%d", i);
+	    boottree = search->search(inittree, genes, 
+				      bootAln.nseqs, bootAln.seqlen, 
+                                      bootAln.seqs,
+                                      outprefix + bootPrefix, method, 
+                                      false, false, observingsomething);
 
 	    boottree->setLeafNames(genes);
 	    writeNewickTree(bootfile, boottree, 0, true);
 	    fprintf(bootfile, "\n");
 	    fflush(bootfile);
 	    delete boottree;            
+	    delete inittree;
 
-	    // DEBUG
-	    writeFasta(bootAlignfile, &aln2);
+	    if (bootAlignfile)
+		writeBootAlign(bootAlignfile, aln, &bootAln);
 	}
+	seqlikelihood->setWeights(NULL);
 
 	fclose(bootfile);
-	fclose(bootAlignfile);
+	if (bootAlignfile)
+	    fclose(bootAlignfile);
     } 
     
     return true;
@@ -455,6 +569,58 @@ int main(int argc, char **argv)
         c.seed = time(NULL);
     srand(c.seed);
     printLog(LOG_LOW, "random seed: %d\n", c.seed);
+
+    // threads for the likelihood computations
+    if (c.threads < 1) {
+        printError("--threads must be at least 1");
+        return 1;
+    }
+    setLkThreads(c.threads);
+    printLog(LOG_LOW, "likelihood threads: %d\n", c.threads);
+
+    // sites per tile of likelihood traversals
+    if (c.lkTile < LK_TILE_OFF) {
+        printError("--lk-tile must be at least -1");
+        return 1;
+    }
+    setLkTileSites(c.lkTile);
+    if (c.lkTile == LK_TILE_AUTO)
+        printLog(LOG_LOW, "likelihood tiles: auto (L2 cache %d KB)\n", 
+                 (int) (getL2CacheSize() >> 10));
+
+    // division of likelihood rows among threads
+    if (c.lkSplit == "auto")
+        setLkSplit(LK_SPLIT_AUTO);
+    else if (c.lkSplit == "sites")
+        setLkSplit(LK_SPLIT_SITES);
+    else if (c.lkSplit == "subtrees")
+        setLkSplit(LK_SPLIT_SUBTREES);
+    else {
+        printError("--lk-split must be auto, sites or subtrees");
+        return 1;
+    }
+
+    // memory of the persistent likelihood rows
+    if (c.lkMemory < 0) {
+        printError("--lk-memory must be at least 0");
+        return 1;
+    }
+    if (c.lkMemory > 0)
+        printLog(LOG_LOW, "likelihood memory: %.1f MB of rows\n", c.lkMemory);
+    if (c.lkCache < 0) {
+        printError("--lk-cache must be at least 0");
+        return 1;
+    }
+
+    // rate variation among sites
+    if (c.gammaAlpha < 0) {
+        printError("--gamma must be at least 0");
+        return 1;
+    }
+    if (c.gammaAlpha > 0 && (c.gammaCats < 1 || c.gammaCats > LK_MAX_CATS)) {
+        printError("--ncats must be between 1 and %d", LK_MAX_CATS);
+        return 1;
+    }
     
 
 
@@ -523,7 +689,11 @@ int main(int argc, char **argv)
     stree_noWGD.setDepths();
     
     // read sequences 
-    Sequences *aln = readAlignFasta(c.alignfile.c_str());
+    Sequences *aln;
+    if (c.alignColumns)
+        aln = readColumnAlign(c.alignfile.c_str());
+    else
+        aln = readAlignFasta(c.alignfile.c_str());
     auto_ptr<Sequences> aln_ptr(aln);
     if (aln == NULL || !checkSequences(aln->nseqs, aln->seqlen, aln->seqs)) {
         printError("bad alignment file");
@@ -620,6 +790,10 @@ int main(int argc, char **argv)
     //========================================================
     // determine kappa
 
+    // memory for all likelihood computations of this family
+    AlignedBuffer::useHugePages = c.hugePages;
+    LikelihoodWorkspace workspace;
+
     if (c.kappa < 0) {
         const float minkappa = .4;
         const float maxkappa = 5.0;
@@ -630,7 +804,8 @@ int main(int argc, char **argv)
         parsimony(tree, aln->nseqs, aln->seqs); 
         c.kappa =  findMLKappaHky(tree, aln->nseqs, aln->seqs, 
                                   bgfreq, 
-                                  minkappa, maxkappa, stepkappa);
+                                  minkappa, maxkappa, stepkappa,
+                                  &workspace);
         printLog(LOG_LOW, "optimum kappa = %f\n", c.kappa);
     }
     
@@ -676,10 +851,18 @@ int main(int argc, char **argv)
 
     */
 
-     m->setLikelihoodFunc(new HkySeqLikelihood(
+     HkySeqLikelihood *seqlikelihood = new HkySeqLikelihood(
         aln->nseqs, aln->seqlen, aln->seqs, 
         bgfreq, c.kappa, c.lkiter, 
-        c.minlen, c.maxlen));
+        c.minlen, c.maxlen, &workspace);
+     seqlikelihood->setMemoryLimit((size_t) (c.lkMemory * 1048576.0));
+     if (c.gammaAlpha > 0) {
+         seqlikelihood->setGammaRates(c.gammaAlpha, c.gammaCats);
+         printLog(LOG_LOW, "gamma rates: alpha %f, %d categories\n", 
+                  c.gammaAlpha, c.gammaCats);
+     }
+     seqlikelihood->engine.setRowCache(c.lkCache);
+     m->setLikelihoodFunc(seqlikelihood);
 
     
     model = m;
@@ -734,10 +917,13 @@ int main(int argc, char **argv)
     // return 1;
 
     auto_ptr<Tree> toptree_ptr(toptree);
-    if (c.bootiter > 1) {
-	if (!bootstrap(aln, genes, search, c.bootiter, c.outprefix))
-	    return 1;
-    }
+
+    SubtreeRowCache *rowCache = seqlikelihood->engine.rowCache;
+    if (rowCache)
+        printLog(LOG_LOW, "likelihood row cache: %lld of %lld lookups hit "
+                 "(%.1f%%), %lld evictions\n", 
+                 rowCache->nhits, rowCache->nlookups, 
+                 100.0 * rowCache->getHitRate(), rowCache->nevictions);
     
    
     fflush(stdout);
@@ -763,6 +949,16 @@ int main(int argc, char **argv)
     string outtreeFilename = c.outprefix  + ".tree";
     writeNewickTree(outtreeFilename.c_str(), toptree);
 
+    // bootstrap after the outputs of the main search, since the searches
+    // of the replicates change the reconciliation of the model
+    if (c.bootiter > 1) {
+	if (!bootstrap(aln, genes, &stree_noWGD, gene2species, search, 
+                       seqlikelihood, c.bootiter, 
+                       c.outprefix, c.bootAlign, c.method, 
+                       c.observingsomething))
+	    return 1;
+    }
+
     
 
     /////////////////////////////
@@ -105,6 +105,34 @@ class TestHKY (unittest.TestCase):
                     fequal(mat[i][j], mat2[i][j])
 
 
+    def test_gtr_hky(self):
+        """test equivalence of GTR with HKY rates"""
+        
+        bgfreq = [.3, .2, .25, .25]
+        kappa = 2.5
+        rates = [1.0, kappa, 1.0, 1.0, kappa, 1.0]
+
+        for t in frange(0, 2.0, .1):
+            mat = spidir.make_hky_matrix(bgfreq, kappa, t)
+            mat2 = spidir.make_gtr_matrix(bgfreq, rates, t)
+
+            for i in xrange(4):
+                for j in xrange(4):
+                    fequal(mat[i][j], mat2[i][j])
+
+
+    def test_discrete_gamma_rates(self):
+        """test rates of discrete gamma categories (Yang 1994)"""
+
+        rates = spidir.discrete_gamma_rates(.5, 4)
+        for rate, expected in zip(rates, [.0334, .2519, .8203, 2.8944]):
+            fequal(rate, expected, .001)
+
+        for ncats in xrange(1, 9):
+            rates = spidir.discrete_gamma_rates(2.0, ncats)
+            fequal(sum(rates) / ncats, 1.0)
+
+
 
 
 if __name__ == "__main__":
@@ -6,7 +6,7 @@
 
 """
 
-import sys, unittest, ctypes
+import sys, unittest, ctypes, math
 
 
 sys.path.append("python")
@@ -15,6 +15,7 @@ import spidir
 from test import *
 
 from rasmus.common import *
+from rasmus.bio import fasta
 
 rplot_set_viewer("display")
 
@@ -22,7 +23,11 @@ rplot_set_viewer("display")
 class TestSeqLikelihood (unittest.TestCase):
 
     def setUp(self):
-        pass        
+        self.align = {"A": "CGCAGACAACTCCCCCGACCACACATAGTACGAAATCCTCAGCCGCTGCCGACTCCGACGCGCGGACTGTCCGGGTTCAGCGAGGCTTAAGAGAACGGCC",
+                      "B": "CCCAAACAACTCCCCCGACCAGACATAGTACGAGATCCTCAGCCACTGGCGACTCGGACGCGCAGAGTGTCCCGCTTAAGCGAGGCTGCAGAGAACGGCC",
+                      "C": "GGCCAGCAATTCCTCCGACCACGCATAGTACGAGATCGTCTGCCTCCTGCGAATCGGACGCGCAGAGTGTTCCGGTTAAGGGAGACTTCAGAGACCTGGC",
+                      "D": "CGCTAACAATTCCCCCGACCACACTGAGTACGAGATACTCGGACTCCGGCGATCTCTACTCGCAGAGAGTCCCACTTAAGCGAGACTGACGAGCACGGGC",
+                      "E": "ATTCTTCCACACCTGCGTGTTCGTCACGTATCAAATGCGGAGCCCACGTCCAATGGCACACGAACAGTCGGCCACGGAATCGCAGACTCGTTGACCAACG"}
         
 
     def test_calc_hky_seq_likelihood(self):
@@ -30,11 +35,7 @@ class TestSeqLikelihood (unittest.TestCase):
         bgfreq = [.258,.267,.266,.209]
         kappa = 1.59
         tree = treelib.parseNewick("((A:.1,B:.1):.1,((C:.1,D:.1):.2,E:.3):.1);")
-        align = {"A": "CGCAGACAACTCCCCCGACCACACATAGTACGAAATCCTCAGCCGCTGCCGACTCCGACGCGCGGACTGTCCGGGTTCAGCGAGGCTTAAGAGAACGGCC",
-                 "B": "CCCAAACAACTCCCCCGACCAGACATAGTACGAGATCCTCAGCCACTGGCGACTCGGACGCGCAGAGTGTCCCGCTTAAGCGAGGCTGCAGAGAACGGCC",
-                 "C": "GGCCAGCAATTCCTCCGACCACGCATAGTACGAGATCGTCTGCCTCCTGCGAATCGGACGCGCAGAGTGTTCCGGTTAAGGGAGACTTCAGAGACCTGGC",
-                 "D": "CGCTAACAATTCCCCCGACCACACTGAGTACGAGATACTCGGACTCCGGCGATCTCTACTCGCAGAGAGTCCCACTTAAGCGAGACTGACGAGCACGGGC",
-                 "E": "ATTCTTCCACACCTGCGTGTTCGTCACGTATCAAATGCGGAGCCCACGTCCAATGGCACACGAACAGTCGGCCACGGAATCGCAGACTCGTTGACCAACG"}
+        align = self.align
 
         drawTree(tree)
 
@@ -52,6 +53,417 @@ class TestSeqLikelihood (unittest.TestCase):
         self.assert_(l2 > l)
 
 
+    def test_calc_hky_seq_likelihood_trees(self):
+        """batched likelihood of trees that share subtrees"""
+
+        bgfreq = [.258,.267,.266,.209]
+        kappa = 1.59
+        trees = [treelib.parseNewick(x) for x in [
+            "((A:.1,B:.1):.1,((C:.1,D:.1):.2,E:.3):.1);",
+            "((A:.1,B:.1):.1,((C:.1,E:.1):.2,D:.3):.1);",
+            "((B:.1,A:.1):.1,((D:.1,C:.1):.2,E:.3):.1);",
+            "((A:.2,B:.1):.1,((C:.1,D:.1):.2,E:.3):.1);",
+            "(((A:.1,B:.1):.1,E:.2):.1,(C:.1,D:.1):.2);"]]
+
+        logls = spidir.calc_seq_likelihood_hky_trees(trees, self.align,
+                                                     bgfreq, kappa)
+        for tree, l in zip(trees, logls):
+            l2 = spidir.calc_seq_likelihood_hky(tree, self.align, 
+                                                bgfreq, kappa)
+            print "log lk", l, l2
+            self.assertEqual(l, l2)
+
+
+    def test_likelihood_engine(self):
+        """persistent engine after accepted and rejected proposals"""
+
+        bgfreq = [.258,.267,.266,.209]
+        kappa = 1.59
+        trees = [treelib.parseNewick(x) for x in [
+            "((A:.1,B:.1):.1,((C:.1,D:.1):.2,E:.3):.1);",
+            "((A:.1,B:.1):.1,((C:.1,E:.1):.2,D:.3):.1);",
+            "((A:.1,C:.1):.1,((B:.1,D:.1):.2,E:.3):.1);",
+            "(((A:.1,B:.1):.1,E:.2):.1,(C:.1,D:.1):.2);"]]
+        engine = spidir.alloc_likelihood_engine(self.align, bgfreq, kappa)
+
+        def check(tree):
+            l = spidir.likelihood_engine_calc_seq_likelihood(engine, tree)
+            l2 = spidir.calc_seq_likelihood_hky(tree, self.align, 
+                                                bgfreq, kappa)
+            self.assertEqual(l, l2)
+
+        # propose, reject, propose
+        check(trees[0])
+        spidir.likelihood_engine_accept(engine)
+        check(trees[1])
+        spidir.likelihood_engine_reject(engine)
+        check(trees[2])
+        spidir.likelihood_engine_reject(engine)
+
+        # the rows of the accepted tree were kept
+        nrows = spidir.likelihood_engine_rows_computed(engine)
+        check(trees[0])
+        self.assertEqual(spidir.likelihood_engine_rows_computed(engine), 
+                         nrows)
+
+        # random topologies and branch lengths
+        random.seed(1)
+        for i in range(50):
+            tree = random.choice(trees).copy()
+            node = random.choice(tree.nodes.values())
+            node.dist *= random.uniform(.5, 2.0)
+            check(tree)
+            if random.random() < .5:
+                spidir.likelihood_engine_accept(engine)
+            else:
+                spidir.likelihood_engine_reject(engine)
+
+        spidir.free_likelihood_engine(engine)
+
+
+    def test_likelihood_engine_checkpoints(self):
+        """engine under a memory limit matches a full recompute"""
+
+        bgfreq = [.258,.267,.266,.209]
+        kappa = 1.59
+        trees = [treelib.parseNewick(x) for x in [
+            "((A:.1,B:.1):.1,((C:.1,D:.1):.2,E:.3):.1);",
+            "((A:.1,B:.1):.1,((C:.1,E:.1):.2,D:.3):.1);",
+            "(((A:.1,B:.1):.1,E:.2):.1,(C:.1,D:.1):.2);",
+            "((((A:.1,B:.1):.1,C:.1):.1,D:.2):.1,E:.2);"]]
+        engine = spidir.alloc_likelihood_engine(self.align, bgfreq, kappa)
+
+        # only part of the rows of the 4 internal nodes fit
+        spidir.likelihood_engine_set_memory_limit(engine, 12000)
+
+        random.seed(2)
+        for i in range(50):
+            tree = random.choice(trees).copy()
+            node = random.choice(tree.nodes.values())
+            node.dist *= random.uniform(.5, 2.0)
+            
+            l = spidir.likelihood_engine_calc_seq_likelihood(engine, tree)
+            l2 = spidir.calc_seq_likelihood_hky(tree, self.align, 
+                                                bgfreq, kappa)
+            self.assertEqual(l, l2)
+            self.assert_(spidir.likelihood_engine_checkpoints(engine) < 4)
+            
+            if random.random() < .5:
+                spidir.likelihood_engine_accept(engine)
+            else:
+                spidir.likelihood_engine_reject(engine)
+
+        # limits of 4 GB and more are not truncated
+        spidir.likelihood_engine_set_memory_limit(engine, (4 << 30) + 12000)
+        l = spidir.likelihood_engine_calc_seq_likelihood(engine, trees[0])
+        self.assertEqual(l, spidir.calc_seq_likelihood_hky(
+            trees[0], self.align, bgfreq, kappa))
+        self.assertEqual(spidir.likelihood_engine_checkpoints(engine), 4)
+
+        spidir.free_likelihood_engine(engine)
+
+
+    def test_likelihood_engine_row_cache(self):
+        """engine takes the rows of rejected trees from its row cache"""
+
+        bgfreq = [.258,.267,.266,.209]
+        kappa = 1.59
+        trees = [treelib.parseNewick(x) for x in [
+            "((A:.1,B:.1):.1,((C:.1,D:.1):.2,E:.3):.1);",
+            "((A:.1,B:.1):.1,((C:.1,E:.1):.2,D:.3):.1);",
+            "(((A:.1,B:.1):.1,E:.2):.1,(C:.1,D:.1):.2);"]]
+        engine = spidir.alloc_likelihood_engine(self.align, bgfreq, kappa)
+        spidir.likelihood_engine_set_row_cache(engine, 100)
+        cache = spidir.likelihood_engine_row_cache(engine)
+
+        def check(tree):
+            l = spidir.likelihood_engine_calc_seq_likelihood(engine, tree)
+            l2 = spidir.calc_seq_likelihood_hky(tree, self.align, 
+                                                bgfreq, kappa)
+            self.assertEqual(l, l2)
+
+        check(trees[0])
+        spidir.likelihood_engine_accept(engine)
+        check(trees[1])
+        spidir.likelihood_engine_reject(engine)
+        check(trees[2])
+        spidir.likelihood_engine_reject(engine)
+
+        # the rejected tree is proposed again
+        nrows = spidir.likelihood_engine_rows_computed(engine)
+        nhits = spidir.subtree_row_cache_stats(cache)["hits"]
+        check(trees[1])
+        self.assertEqual(spidir.likelihood_engine_rows_computed(engine), 
+                         nrows)
+        self.assert_(spidir.subtree_row_cache_stats(cache)["hits"] > nhits)
+        spidir.likelihood_engine_reject(engine)
+
+        # random topologies and branch lengths
+        random.seed(3)
+        for i in range(50):
+            tree = random.choice(trees).copy()
+            node = random.choice(tree.nodes.values())
+            node.dist = random.choice([.1, .2])
+            check(tree)
+            if random.random() < .5:
+                spidir.likelihood_engine_accept(engine)
+            else:
+                spidir.likelihood_engine_reject(engine)
+        self.assert_(spidir.subtree_row_cache_stats(cache)["hits"] > nhits + 1)
+
+        spidir.free_likelihood_engine(engine)
+
+
+    def test_ambiguity_codes(self):
+        """an ambiguous base sums the likelihoods of its bases"""
+
+        bgfreq = [.258,.267,.266,.209]
+        kappa = 1.59
+        tree = treelib.parseNewick(
+            "(((A:.1,B:.2):.1,C:.3):.1,(D:.1,E:.2):.2);")
+        column = {"A": "C", "B": "T", "C": "A", "D": "C", "E": "G"}
+
+        def calc(base):
+            align = dict(column)
+            align["B"] = base
+            return spidir.calc_seq_likelihood_hky(tree, align, bgfreq, kappa)
+
+        # R is A or G
+        fequal(math.exp(calc("R")), 
+               math.exp(calc("A")) + math.exp(calc("G")), 1e-5)
+
+        # N is any base, as is a gap
+        self.assertEqual(calc("N"), calc("-"))
+        fequal(math.exp(calc("N")), 
+               sum(math.exp(calc(x)) for x in "ACGT"), 1e-5)
+
+
+    def test_lk_kernels(self):
+        """SIMD likelihood kernels agree with the scalar kernel"""
+
+        bgfreq = [.258,.267,.266,.209]
+        kappa = 1.59
+        tree = treelib.readTree("test/data/0.nt.tree")
+        align = fasta.readFasta("test/data/0.nt.align")
+        tree2 = treelib.parseNewick(
+            "(((A:.1,B:.2):.1,C:.3):.1,(D:.1,E:.2):.2);")
+
+        def calc():
+            # the rows of the leaves use the tip kernels
+            l = [spidir.calc_seq_likelihood_hky(tree, align, bgfreq, kappa),
+                 spidir.calc_seq_likelihood_hky(tree2, self.align, 
+                                                bgfreq, kappa)]
+
+            # rate categories
+            for t, a in [(tree, align), (tree2, self.align)]:
+                engine = spidir.alloc_likelihood_engine(a, bgfreq, kappa)
+                spidir.likelihood_engine_set_gamma_rates(engine, .5, 4)
+                l.append(spidir.likelihood_engine_calc_seq_likelihood(
+                    engine, t))
+                spidir.free_likelihood_engine(engine)
+
+            # derivatives
+            l.append(spidir.find_ml_branch_lengths_hky(
+                tree.copy(), align, bgfreq, kappa, maxiter=5, 
+                parsinit=False))
+            return l
+
+        self.assert_(spidir.set_lk_kernel("scalar"))
+        self.assertEqual(spidir.get_lk_kernel_name(), "scalar")
+        logls = calc()
+
+        for name in ["avx2", "avx512"]:
+            if not spidir.set_lk_kernel(name):
+                print "skipping unsupported kernel", name
+                continue
+            self.assertEqual(spidir.get_lk_kernel_name(), name)
+            for l, l2 in zip(calc(), logls):
+                fequal(l, l2, 1e-9)
+
+        spidir.set_lk_kernel("auto")
+
+
+    def test_lk_threads(self):
+        """likelihoods with several threads match one thread"""
+
+        bgfreq = [.258,.267,.266,.209]
+        kappa = 1.59
+        tree = treelib.readTree("test/data/verts/19520/19520.ensembl.tree")
+        align = fasta.readFasta("test/data/verts/19520/19520.nt.mfa")
+
+        # 117 rows and few sites per thread take the subtree tasks
+        align = dict((name, seq[:400]) for name, seq in align.items())
+
+        def calc():
+            l = [spidir.calc_seq_likelihood_hky(tree, align, bgfreq, kappa)]
+
+            # rate categories
+            engine = spidir.alloc_likelihood_engine(align, bgfreq, kappa)
+            spidir.likelihood_engine_set_gamma_rates(engine, .5, 4)
+            l.append(spidir.likelihood_engine_calc_seq_likelihood(engine, 
+                                                                  tree))
+            spidir.free_likelihood_engine(engine)
+            return l
+
+        spidir.set_lk_threads(1)
+        logls = calc()
+
+        spidir.set_lk_threads(4)
+        for split in ["auto", "subtrees", "sites"]:
+            spidir.set_lk_split(split)
+            for l, l2 in zip(calc(), logls):
+                fequal(l, l2, 1e-9)
+
+        spidir.set_lk_split("auto")
+        spidir.set_lk_threads(1)
+
+
+    def test_subtree_row_cache(self):
+        """trees sharing a clade take its row from cache"""
+
+        bgfreq = [.258,.267,.266,.209]
+        kappa = 1.59
+        tree1 = treelib.parseNewick(
+            "(((A:.1,B:.2):.1,C:.3):.1,(D:.1,E:.2):.2);")
+        tree2 = treelib.parseNewick(
+            "(((A:.1,B:.2):.1,D:.3):.1,(C:.1,E:.2):.2);")
+        cache = spidir.alloc_subtree_row_cache(self.align, 100)
+
+        l = spidir.calc_seq_likelihood_hky_cached(tree1, self.align, 
+                                                  bgfreq, kappa, cache)
+        stats = spidir.subtree_row_cache_stats(cache)
+        self.assertEqual(stats["lookups"], 4)
+        self.assertEqual(stats["hits"], 0)
+        self.assertEqual(stats["inserts"], 4)
+        self.assertEqual(stats["evictions"], 0)
+        self.assertEqual(l, spidir.calc_seq_likelihood_hky(
+            tree1, self.align, bgfreq, kappa))
+
+        # (A,B) with the same lengths is found
+        l = spidir.calc_seq_likelihood_hky_cached(tree2, self.align, 
+                                                  bgfreq, kappa, cache)
+        stats = spidir.subtree_row_cache_stats(cache)
+        self.assertEqual(stats["hits"], 1)
+        self.assertEqual(stats["inserts"], 7)
+        self.assertEqual(l, spidir.calc_seq_likelihood_hky(
+            tree2, self.align, bgfreq, kappa))
+
+        # (A,B) with a new length is not, (C,E) of the last tree is
+        tree2.nodes["B"].dist = .25
+        l = spidir.calc_seq_likelihood_hky_cached(tree2, self.align, 
+                                                  bgfreq, kappa, cache)
+        stats = spidir.subtree_row_cache_stats(cache)
+        self.assertEqual(stats["hits"], 2)
+        self.assertEqual(stats["evictions"], 0)
+        self.assertEqual(stats["hit_rate"], 
+                         float(stats["hits"]) / stats["lookups"])
+        self.assertEqual(l, spidir.calc_seq_likelihood_hky(
+            tree2, self.align, bgfreq, kappa))
+
+        spidir.free_subtree_row_cache(cache)
+
+        # a full cache evicts rows
+        cache = spidir.alloc_subtree_row_cache(self.align, 2)
+        spidir.calc_seq_likelihood_hky_cached(tree1, self.align, 
+                                              bgfreq, kappa, cache)
+        stats = spidir.subtree_row_cache_stats(cache)
+        self.assertEqual(stats["inserts"], 4)
+        self.assertEqual(stats["evictions"], 2)
+        spidir.free_subtree_row_cache(cache)
+
+
+    def test_gtr_hky(self):
+        """GTR with HKY rates gives the HKY likelihood and ML lengths"""
+
+        bgfreq = [.258,.267,.266,.209]
+        kappa = 1.59
+        rates = [1.0, kappa, 1.0, 1.0, kappa, 1.0]
+        tree = treelib.readTree("test/data/0.nt.tree")
+        align = fasta.readFasta("test/data/0.nt.align")
+
+        l = spidir.calc_seq_likelihood_hky(tree, align, bgfreq, kappa)
+        l2 = spidir.calc_seq_likelihood_gtr(tree, align, bgfreq, rates)
+        fequal(l2, l, 1e-5)
+
+        tree1 = tree.copy()
+        tree2 = tree.copy()
+        l = spidir.find_ml_branch_lengths_hky(tree1, align, bgfreq, kappa, 
+                                              maxiter=20, parsinit=False)
+        l2 = spidir.find_ml_branch_lengths_gtr(tree2, align, bgfreq, rates,
+                                               maxiter=20)
+        fequal(l2, l, 1e-5)
+        for name, node in tree1.nodes.iteritems():
+            self.assert_(abs(node.dist - tree2.nodes[name].dist) < .001)
+
+
+    def test_ml_kappa_hky(self):
+        """ML kappa agrees with a scan of kappa in steps of 0.1"""
+
+        bgfreq = [.258,.267,.266,.209]
+        tree = treelib.readTree("test/data/0.nt.tree")
+        align = fasta.readFasta("test/data/0.nt.align")
+
+        # fit the lengths for each kappa in turn, keeping the best
+        tree2 = tree.copy()
+        maxl = -INF
+        for i in range(47):
+            kappa = .4 + .1 * i
+            l = spidir.find_ml_branch_lengths_hky(tree2, align, bgfreq, 
+                                                  kappa, maxiter=1, 
+                                                  parsinit=False)
+            if l > maxl:
+                maxl = l
+                maxkappa = kappa
+
+        # wide ranges place the first bracket far from the MLE
+        for minkappa, maxkappa2 in [(.4, 5.0), (.4, 20.0), (.1, 50.0)]:
+            kappa = spidir.find_ml_kappa_hky(tree.copy(), align, bgfreq,
+                                             minkappa, maxkappa2, .1)
+            print minkappa, maxkappa2, kappa, maxkappa
+            self.assert_(abs(kappa - maxkappa) <= .1)
+
+
+    def test_stream_hky(self):
+        """streamed column file matches the in-memory likelihood"""
+
+        bgfreq = [.258,.267,.266,.209]
+        kappa = 1.59
+        tree = treelib.readTree("test/data/0.nt.tree")
+        align = fasta.readFasta("test/data/0.nt.align")
+
+        prep_dir("test/output/seq_likelihood_stream")
+        filename = "test/output/seq_likelihood_stream/0.nt.col"
+        self.assert_(spidir.write_column_align(filename, align))
+
+        # several chunks, including a short last one
+        l = spidir.calc_seq_likelihood_hky(tree, align, bgfreq, kappa)
+        for chunksize in [100, 300, 8192]:
+            l2 = spidir.calc_seq_likelihood_hky_file(tree, filename, 
+                                                     bgfreq, kappa, chunksize)
+            fequal(l2, l, 1e-6)
+
+        # ML branch lengths
+        tree1 = tree.copy()
+        tree2 = tree.copy()
+        l = spidir.find_ml_branch_lengths_hky(tree1, align, bgfreq, kappa, 
+                                              maxiter=20, parsinit=False)
+        l2 = spidir.find_ml_branch_lengths_hky_file(tree2, filename, bgfreq,
+                                                    kappa, maxiter=20, 
+                                                    chunksize=100)
+        fequal(l2, l, 1e-6)
+
+        # the two root branches are fit as one
+        for name, node in tree1.nodes.iteritems():
+            if node.parent is None:
+                continue
+            dist1 = node.dist
+            dist2 = tree2.nodes[name].dist
+            if node.parent == tree1.root:
+                dist1 = sum(x.dist for x in tree1.root.children)
+                dist2 = sum(x.dist for x in tree2.root.children)
+            self.assert_(abs(dist1 - dist2) < .001)
+
+
     def test_branch_likelihood_hky(self):
         """Test likelihood function"""
 
@@ -162,6 +574,38 @@ class TestSeqLikelihood (unittest.TestCase):
         rplot_end(True)
 
 
+    def test_branch_likelihood_log_free(self):
+        """Site likelihoods summed without a log per site"""
+
+        # the frequencies as the C code sees them (float)
+        bgfreq = [ctypes.c_float(x).value for x in [.2,.3,.3,.2]]
+        kappa = 1.59
+        seqlen = 2500
+
+        # partials spanning many orders of magnitude
+        probs1 = [random.random() * 2.0**-random.randint(0, 60)
+                  for i in xrange(4*seqlen)]
+        probs2 = [random.random() * 2.0**-random.randint(0, 60)
+                  for i in xrange(4*seqlen)]
+
+        for t in [.001, .1, 1.0]:
+            # one log per site
+            model1 = spidir.make_hky_matrix(bgfreq, kappa, 0.0)
+            model2 = spidir.make_hky_matrix(bgfreq, kappa, t)
+            logl = 0.0
+            for j in xrange(seqlen):
+                s = sum(bgfreq[k] *
+                        sum(model1[k][x] * probs1[4*j+x] for x in xrange(4)) *
+                        sum(model2[k][y] * probs2[4*j+y] for y in xrange(4))
+                        for k in xrange(4))
+                logl += math.log(s)
+
+            logl2 = spidir.branch_likelihood_hky(probs1, probs2, seqlen,
+                                                 bgfreq, kappa, t)
+            print t, logl, logl2
+            self.assert_(abs(logl - logl2) < 1e-10 * abs(logl))
+
+
     def _test_calc_lktable_row(self):
         """test the function CalcLktbaleRow"""
 